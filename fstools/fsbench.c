@@ -0,0 +1,298 @@
+// File system benchmark
+//
+// Runs the file system module (source/fs.c) on the
+// development machine, over a copy of a disk image,
+// and counts the disk accesses of some workloads:
+// create, write, read, list, copy and delete files.
+// Results are repeatable, so they can be compared
+// before and after a file system change.
+//
+// Expected parameters:
+// [-n files] [-s size] [-x KB] image_file [work_file]
+//
+// -n files  number of files (default 64)
+// -s size   size of each file in bytes (default 4096)
+// -x KB     extended memory size, enables the disk cache (default 0)
+//
+// image_file is not modified. Workloads run over
+// work_file, by default fsbench.img
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fshost.h"
+
+#include "types.h"
+#include "kernel.h"
+#include "ulib/ulib.h"
+#include "fs.h"
+
+#define BENCH_DIR  "bench"
+#define COPY_DIR   "benchcp"
+#define CHUNK_SIZE 512
+
+// Workload parameters
+int nfiles = 64;
+int file_size = 4096;
+long xmem_kb = 0;
+
+// Data buffers
+uchar* wbuff;
+uchar* rbuff;
+
+// Copy a file
+int copy_image(char* src, char* dst)
+{
+  FILE* in = fopen(src, "rb");
+  FILE* out;
+  char buf[4096];
+  size_t n;
+
+  if(in == 0) {
+    perror(src);
+    return 1;
+  }
+  out = fopen(dst, "wb");
+  if(out == 0) {
+    perror(dst);
+    fclose(in);
+    return 1;
+  }
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    fwrite(buf, 1, n, out);
+  }
+  fclose(in);
+  fclose(out);
+  return 0;
+}
+
+// Path of a benchmark file
+uchar* file_path(uchar* path, char* dir, int i)
+{
+  snprintf((char*)path, 32, "%s/f%d", dir, i);
+  return path;
+}
+
+// Fill a buffer with data that depends on a seed
+void fill(uchar* buff, int size, int seed)
+{
+  int i;
+  for(i = 0; i < size; i++) {
+    buff[i] = (uchar)(i*7 + seed*13 + (i >> 8));
+  }
+}
+
+// Compare buffers
+int equal(uchar* a, uchar* b, int size)
+{
+  int i;
+  for(i = 0; i < size; i++) {
+    if(a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Print results of a phase
+int phase_end(char* name, int ops, int errors)
+{
+  fs_sync();
+  printf("%-8s %6d %8lu %8lu %8lu %8lu\n", name, ops,
+    fshost_stats.reads, fshost_stats.writes,
+    fshost_stats.sectors, fshost_stats.seeks);
+  if(errors) {
+    fprintf(stderr, "fsbench: %s: %d errors\n", name, errors);
+  }
+  fshost_reset_stats();
+  return errors;
+}
+
+// Create directory and files in a single write each
+int bench_create()
+{
+  uchar path[32];
+  int i, errors = 0;
+
+  if(fs_create_directory((uchar*)BENCH_DIR) >= ERROR_ANY) {
+    errors++;
+  }
+  for(i = 0; i < nfiles; i++) {
+    fill(wbuff, file_size, i);
+    if(fs_write_file(wbuff, file_path(path, BENCH_DIR, i), 0, file_size,
+      WF_CREATE | WF_TRUNCATE) != file_size) {
+      errors++;
+    }
+  }
+  return phase_end("create", nfiles + 1, errors);
+}
+
+// Rewrite files in small chunks
+int bench_write()
+{
+  uchar path[32];
+  int i, offset, errors = 0, ops = 0;
+
+  for(i = 0; i < nfiles; i++) {
+    fill(wbuff, file_size, i + 1);
+    for(offset = 0; offset < file_size; offset += CHUNK_SIZE) {
+      int count = file_size - offset < CHUNK_SIZE ? file_size - offset : CHUNK_SIZE;
+      if(fs_write_file(&wbuff[offset], file_path(path, BENCH_DIR, i),
+        offset, count, 0) != count) {
+        errors++;
+      }
+      ops++;
+    }
+  }
+  return phase_end("write", ops, errors);
+}
+
+// Read whole files and check their contents
+int bench_read(char* dir)
+{
+  uchar path[32];
+  int i, errors = 0;
+
+  for(i = 0; i < nfiles; i++) {
+    fill(wbuff, file_size, i + 1);
+    if(fs_read_file(rbuff, file_path(path, dir, i), 0, file_size) != file_size ||
+      !equal(rbuff, wbuff, file_size)) {
+      errors++;
+    }
+  }
+  return phase_end("read", nfiles, errors);
+}
+
+// List directory, one by one and in batches
+int bench_list()
+{
+  struct SFS_ENTRY entry;
+  struct FS_ENTRY entries[16];
+  int i, n, errors = 0, ops = 0;
+
+  for(i = 0; i < nfiles; i++) {
+    if(fs_list(&entry, (uchar*)BENCH_DIR, i) != nfiles) {
+      errors++;
+    }
+    ops++;
+  }
+  for(i = 0; i < nfiles; i += n) {
+    n = fs_list_many(lp(entries), (uchar*)BENCH_DIR, i, 16);
+    if(n == 0 || n >= ERROR_ANY) {
+      errors++;
+      break;
+    }
+    ops++;
+  }
+  return phase_end("list", ops, errors);
+}
+
+// Copy the benchmark directory
+int bench_copy()
+{
+  int errors = 0;
+  if(fs_copy((uchar*)BENCH_DIR, (uchar*)COPY_DIR) >= ERROR_ANY) {
+    errors++;
+  }
+  errors += phase_end("copy", 1, 0);
+  return errors + bench_read(COPY_DIR);
+}
+
+// Delete files and directories
+int bench_delete()
+{
+  uchar path[32];
+  int i, errors = 0;
+
+  for(i = 0; i < nfiles; i++) {
+    if(fs_delete(file_path(path, BENCH_DIR, i)) >= ERROR_ANY) {
+      errors++;
+    }
+  }
+  if(fs_delete((uchar*)BENCH_DIR) >= ERROR_ANY) {
+    errors++;
+  }
+  if(fs_delete((uchar*)COPY_DIR) >= ERROR_ANY) {
+    errors++;
+  }
+  return phase_end("delete", nfiles + 2, errors);
+}
+
+// Entry point
+int main(int argc, char* argv[])
+{
+  char* prog = argv[0];
+  char* work = "fsbench.img";
+  int errors = 0;
+
+  // Check options
+  while(argc > 2 && argv[1][0] == '-') {
+    if(argv[1][1] == 'n') {
+      nfiles = atoi(argv[2]);
+    } else if(argv[1][1] == 's') {
+      file_size = atoi(argv[2]);
+    } else if(argv[1][1] == 'x') {
+      xmem_kb = atol(argv[2]);
+    } else {
+      break;
+    }
+    argv += 2;
+    argc -= 2;
+  }
+
+  // Check usage
+  if(argc < 2 || argc > 3 || nfiles <= 0 || xmem_kb < 0 ||
+    file_size <= 0 || file_size >= ERROR_ANY) {
+    fprintf(stderr, "Usage: %s [-n files] [-s size] [-x KB] image_file [work_file]\n", prog);
+    exit(1);
+  }
+  if(argc == 3) {
+    work = argv[2];
+  }
+
+  // Attach a copy of the image as system disk
+  if(copy_image(argv[1], work)) {
+    exit(1);
+  }
+  fshost_detach();
+  if(fshost_attach(0, 0x80, "hd0", work, 0, 0)) {
+    exit(1);
+  }
+  system_disk = 0x80;
+
+  if(fshost_set_xmem(xmem_kb)) {
+    fprintf(stderr, "%s: not enough memory\n", prog);
+    exit(1);
+  }
+  fshost_reset_stats();
+  fs_init_info();
+  fs_init_xcache(xmem_kb);
+  if(disk_info[0].fstype != FS_TYPE_NSFS) {
+    fprintf(stderr, "%s: %s is not a NSFS image\n", prog, argv[1]);
+    exit(1);
+  }
+
+  wbuff = calloc(1, file_size);
+  rbuff = calloc(1, file_size);
+
+  printf("%s: %s, %lu blocks, %d files of %d bytes\n", prog, argv[1],
+    (unsigned long)disk_info[0].fssize, nfiles, file_size);
+  printf("%-8s %6s %8s %8s %8s %8s\n",
+    "phase", "ops", "reads", "writes", "sectors", "seeks");
+  phase_end("mount", 1, 0);
+
+  errors += bench_create();
+  errors += bench_write();
+  errors += bench_read(BENCH_DIR);
+  errors += bench_list();
+  errors += bench_copy();
+  errors += bench_delete();
+
+  free(wbuff);
+  free(rbuff);
+  fshost_detach();
+  fshost_set_xmem(0);
+
+  exit(errors ? 1 : 0);
+}
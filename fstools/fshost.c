@@ -0,0 +1,433 @@
+// Host replacements for the kernel and ulib functions
+// used by the file system module (source/fs.c)
+//
+// Disks are image files. Sector accesses are counted,
+// and a seek is counted each time an access starts in
+// a cylinder different from the previous one.
+// See fshost.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "fshost.h"
+
+#include "types.h"
+#include "kernel.h"
+#include "hw86.h"
+#include "ulib/ulib.h"
+
+// Kernel variables used by fs.c
+uchar  disk_buff[SECTOR_SIZE];
+uchar  system_disk = 0;
+ul_t   system_timer_ms = 10;
+struct DISKINFO disk_info[MAX_DISK];
+
+struct FSHOST_STATS fshost_stats;
+
+// Image files and last accessed cylinder of each disk
+static FILE* disk_file[MAX_DISK];
+static long  disk_cylinder[MAX_DISK];
+
+// Attach an image file as a disk
+int fshost_attach(unsigned int index, unsigned int id, char* name,
+  char* path, unsigned int sectors, unsigned int sides)
+{
+  long size;
+
+  if(index >= MAX_DISK) {
+    return 1;
+  }
+
+  disk_file[index] = fopen(path, "r+b");
+  if(disk_file[index] == 0) {
+    perror(path);
+    return 1;
+  }
+  fseek(disk_file[index], 0, SEEK_END);
+  size = ftell(disk_file[index]) / SECTOR_SIZE;
+
+  // Guess geometry: 1.44MB floppy disks, or a hard disk
+  if(sectors == 0 || sides == 0) {
+    if(size <= 2880) {
+      sectors = 18;
+      sides = 2;
+    } else {
+      sectors = 63;
+      sides = 16;
+    }
+  }
+
+  disk_info[index].id = id;
+  strncpy((char*)disk_info[index].name, name, sizeof(disk_info[index].name) - 1);
+  disk_info[index].fstype = 0;
+  disk_info[index].fssize = 0;
+  disk_info[index].sectors = sectors;
+  disk_info[index].sides = sides;
+  disk_info[index].cylinders = (size + sectors*sides - 1) / (sectors*sides);
+  disk_info[index].size = (size * SECTOR_SIZE) / 1048576L;
+  if(disk_info[index].size == 0) {
+    disk_info[index].size = 1;
+  }
+  disk_info[index].last_access = 0;
+  disk_info[index].probed = 1;
+  disk_cylinder[index] = -1;
+  return 0;
+}
+
+// Detach all disks
+void fshost_detach(void)
+{
+  int i;
+  for(i = 0; i < MAX_DISK; i++) {
+    if(disk_file[i]) {
+      fclose(disk_file[i]);
+      disk_file[i] = 0;
+    }
+    disk_info[i].id = 0xFF;
+    disk_info[i].size = 0;
+  }
+}
+
+// Reset disk access counters
+void fshost_reset_stats(void)
+{
+  memset((uchar*)&fshost_stats, 0, sizeof(fshost_stats));
+}
+
+// Find index of a disk, and account an access
+static int disk_access(uint disk, uint sector, uint n)
+{
+  int i;
+  long cylinder;
+
+  for(i = 0; i < MAX_DISK; i++) {
+    if(disk_file[i] && disk_info[i].id == disk) {
+      break;
+    }
+  }
+  if(i == MAX_DISK || n == 0 ||
+    (long)sector + n > (long)disk_info[i].cylinders *
+      disk_info[i].sectors * disk_info[i].sides) {
+    return -1;
+  }
+
+  cylinder = sector / (disk_info[i].sectors * disk_info[i].sides);
+  if(cylinder != disk_cylinder[i]) {
+    fshost_stats.seeks++;
+    disk_cylinder[i] = cylinder;
+  }
+  fshost_stats.sectors += n;
+  disk_info[i].last_access = system_timer_ms;
+  fseek(disk_file[i], (long)sector * SECTOR_SIZE, SEEK_SET);
+  return i;
+}
+
+// Disks are attached with their geometry, so the
+// file system never needs to probe them
+uint get_disk_info(uint disk, uint* st, uint* hd, uint* cl)
+{
+  return 1;
+}
+
+// Read disk sectors
+uint read_disk_sector(uint disk, uint sector, uint n, uchar* buff)
+{
+  int i = disk_access(disk, sector, n);
+  fshost_stats.reads++;
+  if(i < 0) {
+    return 1;
+  }
+  memset(buff, 0, (size_t)n * SECTOR_SIZE);
+  fread(buff, SECTOR_SIZE, n, disk_file[i]);
+  return 0;
+}
+
+// Read disk sectors to far memory, which is host memory
+uint read_disk_sector_far(uint disk, uint sector, uint n, lp_t buff)
+{
+  return read_disk_sector(disk, sector, n, (uchar*)buff);
+}
+
+// Write disk sectors
+uint write_disk_sector(uint disk, uint sector, uint n, uchar* buff)
+{
+  int i = disk_access(disk, sector, n);
+  fshost_stats.writes++;
+  if(i < 0) {
+    return 1;
+  }
+  if(fwrite(buff, SECTOR_SIZE, n, disk_file[i]) != n) {
+    return 1;
+  }
+  return 0;
+}
+
+// Extended memory is a host buffer. Linear addresses
+// from 1MB up map to it, and lower ones are host pointers
+#define XMEM_BASE 0x100000UL
+
+static uchar* xmem;
+static unsigned long xmem_kb;
+
+int fshost_set_xmem(unsigned long size_kb)
+{
+  free(xmem);
+  xmem = 0;
+  xmem_kb = 0;
+  if(size_kb) {
+    xmem = calloc(size_kb, 1024);
+    if(xmem == 0) {
+      return 1;
+    }
+    xmem_kb = size_kb;
+  }
+  return 0;
+}
+
+ul_t xmem_get_size()
+{
+  return xmem_kb;
+}
+
+static uchar* xmem_ptr(ul_t addr, uint size)
+{
+  if(addr >= XMEM_BASE && addr < XMEM_BASE + xmem_kb * 1024) {
+    if(addr + size > XMEM_BASE + xmem_kb * 1024) {
+      return 0;
+    }
+    return &xmem[addr - XMEM_BASE];
+  }
+  return (uchar*)addr;
+}
+
+uint xmem_copy(ul_t dst, ul_t src, uint words)
+{
+  uchar* d = xmem_ptr(dst, words * 2);
+  uchar* s = xmem_ptr(src, words * 2);
+  if(d == 0 || s == 0) {
+    return 1;
+  }
+  memmove(d, s, (size_t)words * 2);
+  return 0;
+}
+
+// Far memory is host memory
+lp_t lmem_alloc(ul_t size)
+{
+  return (lp_t)calloc(1, size);
+}
+
+void lmem_free(lp_t ptr)
+{
+  free((void*)ptr);
+}
+
+lp_t hma_alloc(ul_t size)
+{
+  return lmem_alloc(size);
+}
+
+void hma_free(lp_t ptr)
+{
+  lmem_free(ptr);
+}
+
+void lmem_setbyte(lp_t addr, uchar b)
+{
+  *(uchar*)addr = b;
+}
+
+uchar lmem_getbyte(lp_t addr)
+{
+  return *(uchar*)addr;
+}
+
+// Words and dwords are little endian, like in the 8086
+void lmem_setword(lp_t addr, uint w)
+{
+  lmem_setbyte(addr, w & 0xFF);
+  lmem_setbyte(addr + 1, w >> 8);
+}
+
+uint lmem_getword(lp_t addr)
+{
+  return lmem_getbyte(addr) | (lmem_getbyte(addr + 1) << 8);
+}
+
+void lmem_setdword(lp_t addr, ul_t d)
+{
+  lmem_setword(addr, d & 0xFFFF);
+  lmem_setword(addr + 2, (d >> 16) & 0xFFFF);
+}
+
+ul_t lmem_getdword(lp_t addr)
+{
+  return lmem_getword(addr) | ((ul_t)lmem_getword(addr + 2) << 16);
+}
+
+lp_t lp(void* ptr)
+{
+  return (lp_t)ptr;
+}
+
+ul_t lmemcpy(lp_t dst, lp_t src, ul_t size)
+{
+  memmove((void*)dst, (void*)src, size);
+  return size;
+}
+
+ul_t lmemset(lp_t dst, uchar value, ul_t size)
+{
+  uchar* p = (uchar*)dst;
+  ul_t i;
+  for(i = 0; i < size; i++) {
+    p[i] = value;
+  }
+  return size;
+}
+
+// Debug output goes to stderr, only if FSHOST_DEBUG is set
+// %U is a ul_t, like in ulib format strings
+void debugstr(uchar* format, ...)
+{
+  va_list args;
+  uchar* c;
+
+  if(getenv("FSHOST_DEBUG") == 0) {
+    return;
+  }
+
+  va_start(args, format);
+  for(c = format; *c; c++) {
+    if(*c != '%') {
+      if(*c != '\r') {
+        fputc(*c, stderr);
+      }
+      continue;
+    }
+    c++;
+    if(*c == 'U') {
+      fprintf(stderr, "%lu", va_arg(args, unsigned long));
+    } else if(*c == 'u' || *c == 'd') {
+      fprintf(stderr, "%u", (uint)va_arg(args, int));
+    } else if(*c == 'x') {
+      fprintf(stderr, "%x", (uint)va_arg(args, int));
+    } else if(*c == 's') {
+      fprintf(stderr, "%s", va_arg(args, char*));
+    } else if(*c == 'c') {
+      fputc(va_arg(args, int), stderr);
+    } else {
+      fputc(*c, stderr);
+    }
+  }
+  va_end(args);
+}
+
+// Timestamps are fixed, so images are repeatable
+void time(struct TIME* t)
+{
+  t->year = 2017;
+  t->month = 1;
+  t->day = 1;
+  t->hour = 0;
+  t->minute = 0;
+  t->second = 0;
+}
+
+// ulib string and memory functions.
+// Same behavior as source/ulib/ulib.c
+
+uint strcpy_s(uchar* dst, uchar* src, uint dst_size)
+{
+  uint i = 0;
+  while(src[i]!=0 && i+1<dst_size) {
+    dst[i] = src[i];
+    i++;
+  }
+  dst[i] = 0;
+  return i;
+}
+
+uint strlen(uchar* str)
+{
+  uint i = 0;
+  while(str[i] != 0) {
+    i++;
+  }
+  return i;
+}
+
+uint strcat_s(uchar* dst, uchar* src, uint dst_size)
+{
+  uint j = 0;
+  uint i = strlen(dst);
+  while(src[j]!=0 && i+1<dst_size) {
+    dst[i] = src[j];
+    i++;
+    j++;
+  }
+  dst[i] = 0;
+  return i;
+}
+
+int strcmp(uchar* str1, uchar* str2)
+{
+  uint i = 0;
+  while(str1[i]==str2[i] && str1[i]!=0) {
+    i++;
+  }
+  return str1[i] - str2[i];
+}
+
+uchar* strtok(uchar* src, uchar** next, uchar delim)
+{
+  uchar* s;
+
+  while(*src == delim) {
+    *src = 0;
+    src++;
+  }
+
+  s = src;
+
+  while(*s) {
+    if(*s == delim) {
+      *s = 0;
+      *next = s+1;
+      return src;
+    }
+    s++;
+  }
+
+  *next = s;
+  return src;
+}
+
+uint strchr(uchar* src, uchar c)
+{
+  uint n = 0;
+  while(src[n]) {
+    if(src[n] == c) {
+      return n+1;
+    }
+    n++;
+  }
+  return 0;
+}
+
+uint memcpy(uchar* dst, uchar* src, uint size)
+{
+  memmove(dst, src, size);
+  return size;
+}
+
+uint memset(uchar* dst, uchar value, uint size)
+{
+  uint i = 0;
+  for(i=0; i<size; i++) {
+    dst[i] = value;
+  }
+  return i;
+}
@@ -0,0 +1,63 @@
+// Host build of the NSFS file system module
+//
+// source/fs.c is compiled on the development machine with gcc,
+// and linked with fshost.c, which replaces the kernel and ulib
+// functions it needs. Disks are backed by image files.
+//
+// This header must be included after any C library header and
+// before any NANO-S16 header. The build forces it in front of
+// fs.c with gcc -include. It renames the ulib functions whose
+// names clash with the C library.
+//
+// Since the host is a 64-bit machine, far pointers (lp_t) are
+// host pointers, so far memory is just host memory.
+
+#ifndef _FSHOST_H
+#define _FSHOST_H
+
+#define HOST // types.h needs this
+
+#define syscall ulib_syscall
+#define rand    ulib_rand
+#define putchar ulib_putchar
+#define getchar ulib_getchar
+#define strcpy  ulib_strcpy
+#define strcat  ulib_strcat
+#define strlen  ulib_strlen
+#define strcmp  ulib_strcmp
+#define strncmp ulib_strncmp
+#define strtok  ulib_strtok
+#define strchr  ulib_strchr
+#define memcpy  ulib_memcpy
+#define memset  ulib_memset
+#define memcmp  ulib_memcmp
+#define malloc  ulib_malloc
+#define time    ulib_time
+
+// Disk access counters
+struct FSHOST_STATS {
+  unsigned long reads;    // read_disk_sector calls
+  unsigned long writes;   // write_disk_sector calls
+  unsigned long sectors;  // Sectors read or written
+  unsigned long seeks;    // Accesses that changed cylinder
+};
+
+extern struct FSHOST_STATS fshost_stats;
+
+// Attach an image file as disk_info[index] with the given
+// disk id and name. If geometry is 0, it is guessed from
+// the image size (floppy or hard disk). Returns 0 on success
+int fshost_attach(unsigned int index, unsigned int id, char* name,
+  char* path, unsigned int sectors, unsigned int sides);
+
+// Detach all disks
+void fshost_detach(void);
+
+// Reset disk access counters
+void fshost_reset_stats(void);
+
+// Emulate extended memory (KB above 1MB), so xmem_get_size
+// and xmem_copy work. Size 0 releases it
+int fshost_set_xmem(unsigned long size_kb);
+
+#endif // _FSHOST_H
@@ -5,7 +5,19 @@
 // target architecture
 //
 // Expected parameters:
-// output_file block_count kernel [other files]
+// [options] output_file block_count boot_sect kernel [other files or dirs]
+//
+// Options:
+// -z           compress other files (the kernel is never compressed)
+// -n nentries  number of entries of the entries table
+// -b block     place the kernel at this block, instead of the first data block
+// -p list      lay out first the files listed in this text file (one image
+//              path per line, like "programs/edit.bin"), so they are
+//              contiguous and close to the kernel
+//
+// Directories are imported recursively. Entries and data blocks are
+// assigned in breadth-first order, and each file is stored in contiguous
+// data blocks, so files of the same directory are close in disk.
 
 #include <stdio.h>
 #include <unistd.h>
@@ -13,6 +25,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #define MKFS // fs.h needs this
 
@@ -33,34 +47,357 @@ int fsfd;
 void wblock(uint, void*);
 void rblock(uint sec, void *buf);
 
+// Read a full file
+unsigned char* read_file(char* path, int* size);
+
+// Compress file data
+int lz_compress(unsigned char** out, unsigned char* data, int size);
+
+// Image tree node: a file or a directory
+struct NODE {
+  char          name[SFS_NAMESIZE];
+  char          path[256];  // Path inside the image
+  char*         host_path;  // Path in the host
+  int           is_dir;
+  int           entry;      // Head entry index
+  int           nentries;   // Number of chained entries
+  int           nrefs;      // Number of references
+  int           size;       // Stored size (files) or items (dirs)
+  int           flags;
+  int           block;      // First data block (files), or -1
+  unsigned char* data;      // Stored data (files)
+  struct NODE*  parent;
+  struct NODE** child;
+  int           nchild;
+};
+
+// Nodes in breadth-first order
+struct NODE** nodes;
+int nnodes;
+
+// Options
+int compress = 0;
+
+// Add a node to the list of nodes
+void add_node(struct NODE* node)
+{
+  nodes = realloc(nodes, (nnodes + 1) * sizeof(struct NODE*));
+  nodes[nnodes++] = node;
+}
+
+// Create a node for a host file or directory
+struct NODE* new_node(struct NODE* parent, char* host_path, char* name)
+{
+  struct NODE* node = calloc(1, sizeof(struct NODE));
+  struct stat st;
+  char* p;
+
+  if(stat(host_path, &st) != 0) {
+    perror(host_path);
+    exit(1);
+  }
+
+  // Remove slashes from name, and keep a valid length
+  p = strrchr(name, '/');
+  strncpy(node->name, p ? p + 1 : name, SFS_NAMESIZE-1);
+
+  node->host_path = strdup(host_path);
+  node->is_dir = S_ISDIR(st.st_mode);
+  node->parent = parent;
+  node->block = -1;
+  if(parent && parent->parent) {
+    if(strlen(parent->path) + strlen(node->name) + 2 > sizeof(node->path)) {
+      fprintf(stderr, "mkfs: %s: path too long\n", host_path);
+      exit(1);
+    }
+    strcpy(node->path, parent->path);
+    strcat(node->path, "/");
+  }
+  strcat(node->path, node->name);
+
+  if(parent) {
+    parent->child = realloc(parent->child, (parent->nchild + 1) * sizeof(struct NODE*));
+    parent->child[parent->nchild++] = node;
+  }
+  return node;
+}
+
+// Sort directory items by name
+int compare_names(const void* a, const void* b)
+{
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+// Add items of a host directory to a node
+void read_dir(struct NODE* node)
+{
+  DIR* dir;
+  struct dirent* de;
+  char** names = 0;
+  int n = 0;
+  int i;
+
+  if((dir = opendir(node->host_path)) == 0) {
+    perror(node->host_path);
+    exit(1);
+  }
+  while((de = readdir(dir)) != 0) {
+    if(de->d_name[0] == '.') {
+      continue;
+    }
+    names = realloc(names, (n + 1) * sizeof(char*));
+    names[n++] = strdup(de->d_name);
+  }
+  closedir(dir);
+
+  qsort(names, n, sizeof(char*), compare_names);
+  for(i = 0; i < n; i++) {
+    char host_path[512];
+    snprintf(host_path, sizeof(host_path), "%s/%s", node->host_path, names[i]);
+    new_node(node, host_path, names[i]);
+    free(names[i]);
+  }
+  free(names);
+}
+
+// Read and, if requested and worth it, compress file data
+void load_file(struct NODE* node, int can_compress)
+{
+  int size;
+  unsigned char* data = read_file(node->host_path, &size);
+
+  node->flags = T_FILE;
+  node->data = data;
+  node->size = size;
+
+  if(compress && can_compress) {
+    unsigned char* lz;
+    int lz_size = lz_compress(&lz, data, size);
+    if(lz_size > 0) {
+      printf("mkfs: %s compressed %d -> %d bytes\n", node->path, size, lz_size);
+      free(data);
+      node->data = lz;
+      node->size = lz_size;
+      node->flags |= F_LZ;
+    }
+  }
+  node->nrefs = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Find a node given its image path
+struct NODE* find_node(char* path)
+{
+  int i;
+  for(i = 0; i < nnodes; i++) {
+    if(strcmp(nodes[i]->path, path) == 0) {
+      return nodes[i];
+    }
+  }
+  return 0;
+}
+
+// Next free data block, skipping the kernel blocks
+int next_block = 0;
+int kernel_start = 0;
+int kernel_end = 0;
+
+int alloc_blocks(int count)
+{
+  int b;
+  if(next_block < kernel_end && next_block + count > kernel_start) {
+    next_block = kernel_end;
+  }
+  b = next_block;
+  next_block += count;
+  return b;
+}
+
+// Write data blocks of a file node
+void write_file_blocks(struct NODE* node)
+{
+  char buf[BLOCK_SIZE];
+  int i;
+
+  for(i = 0; i < node->nrefs; i++) {
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, node->data + i*BLOCK_SIZE, min(BLOCK_SIZE, node->size - i*BLOCK_SIZE));
+    wblock(node->block + i, buf);
+  }
+}
+
 // Entry point
 int main(int argc, char *argv[])
 {
-  int i, f, e, b, cc, fd;
-  char* name;
+  int i, f, e, r;
+  int fssize_blocks, numentries = 0, entries_size;
+  int boot_block = -1;
+  int first_data;
+  char* prefetch = 0;
+  char* prog = argv[0];
+  unsigned char* data;
+  int size;
   char buf[BLOCK_SIZE];
   struct SFS_SUPERBLOCK sfs_sb;
   struct SFS_ENTRY* sfs_entry;
+  struct NODE* root;
 
   // Check architecture and fs definition sizes
   assert(sizeof(uint8_t)  == 1);
   assert(sizeof(uint32_t) == 4);
   assert(BLOCK_SIZE % sizeof(struct SFS_ENTRY) == 0 ||
          sizeof(struct SFS_ENTRY) % BLOCK_SIZE == 0);
+  assert(sizeof(struct SFS_LZHEADER) == BLOCK_SIZE);
+
+  // Check options
+  while(argc > 1 && argv[1][0] == '-') {
+    if(strcmp(argv[1], "-z") == 0) {
+      compress = 1;
+    } else if(strcmp(argv[1], "-n") == 0 && argc > 2) {
+      numentries = atoi(argv[2]);
+      argv++;
+      argc--;
+    } else if(strcmp(argv[1], "-b") == 0 && argc > 2) {
+      boot_block = atoi(argv[2]);
+      argv++;
+      argc--;
+    } else if(strcmp(argv[1], "-p") == 0 && argc > 2) {
+      prefetch = argv[2];
+      argv++;
+      argc--;
+    } else {
+      break;
+    }
+    argv++;
+    argc--;
+  }
 
   // Check usage
   if(argc < 5) {
     fprintf(stderr,
-      "Usage: %s output_file fs_size_blocks boot_sect kernel_file [other_files ...]\n",
-      argv[0]);
+      "Usage: %s [-z] [-n nentries] [-b boot_block] [-p prefetch_list] "
+      "output_file fs_size_blocks boot_sect kernel_file [other_files_or_dirs ...]\n",
+      prog);
 
     exit(1);
   }
 
+  // Build image tree: root dir, kernel, and other files and dirs
+  root = new_node(0, ".", ROOT_DIR_NAME);
+  root->is_dir = 1;
+  root->path[0] = 0;
+  for(f = 4; f < argc; f++) {
+    new_node(root, argv[f], argv[f]);
+  }
+  if(root->child[0]->is_dir) {
+    fprintf(stderr, "%s: kernel can't be a directory\n", prog);
+    exit(1);
+  }
+
+  // Breadth-first traversal. Read directories and files
+  add_node(root);
+  for(i = 0; i < nnodes; i++) {
+    struct NODE* node = nodes[i];
+    if(node->is_dir) {
+      if(node != root) {
+        read_dir(node);
+      }
+      for(f = 0; f < node->nchild; f++) {
+        add_node(node->child[f]);
+      }
+      node->flags = T_DIR;
+      node->size = node->nchild;
+      node->nrefs = node->nchild;
+    } else {
+      load_file(node, node != root->child[0]);
+    }
+    node->nentries = max(1, (node->nrefs + SFS_ENTRYREFS - 1) / SFS_ENTRYREFS);
+  }
+
+  // Assign entries. The kernel must be entry 1
+  e = 0;
+  root->entry = e++;
+  root->child[0]->entry = e++;
+  e += root->nentries - 1;
+  e += root->child[0]->nentries - 1;
+  for(i = 0; i < nnodes; i++) {
+    if(i > 0 && nodes[i] != root->child[0]) {
+      nodes[i]->entry = e;
+      e += nodes[i]->nentries;
+    }
+  }
+
   // Get fs parameters
-  int fssize_blocks = atoi(argv[2]);  // Size of file system in blocks
-  int numentries = min(((fssize_blocks * BLOCK_SIZE)/10)/sizeof(struct SFS_ENTRY), 4096);
-  int entries_size = numentries * sizeof(struct SFS_ENTRY);
+  fssize_blocks = atoi(argv[2]);  // Size of file system in blocks
+  if(numentries == 0) {
+    numentries = min(((fssize_blocks * BLOCK_SIZE)/100)*SFS_DEFAULT_ENTRIES_PCT/sizeof(struct SFS_ENTRY),
+      SFS_DEFAULT_ENTRIES);
+  }
+  if(numentries < e) {
+    fprintf(stderr, "%s: %d entries are needed, but only %d are available\n",
+      prog, e, numentries);
+    exit(1);
+  }
+  entries_size = numentries * sizeof(struct SFS_ENTRY);
+
+  // Superblock
+  memset(&sfs_sb, 0, sizeof(sfs_sb));
+  sfs_sb.type = SFS_TYPE_ID;
+  sfs_sb.size = fssize_blocks;
+  sfs_sb.nentries = numentries;
+  sfs_sb.journalstart = 2 + entries_size/BLOCK_SIZE;
+  sfs_sb.journalsize = SFS_JOURNAL_BLOCKS;
+  first_data = sfs_sb.journalstart + sfs_sb.journalsize;
+
+  // Lay out data: kernel, prefetch list files, then
+  // other files in breadth-first order
+  next_block = first_data;
+  kernel_start = boot_block >= 0 ? boot_block : first_data;
+  kernel_end = kernel_start + root->child[0]->nrefs;
+  if(kernel_start < first_data || kernel_end > fssize_blocks) {
+    fprintf(stderr, "%s: bad boot block %d\n", prog, kernel_start);
+    exit(1);
+  }
+  root->child[0]->block = kernel_start;
+  sfs_sb.bootstart = kernel_start;
+  if(boot_block < 0) {
+    next_block = kernel_end;
+  }
+
+  if(prefetch) {
+    FILE* pf = fopen(prefetch, "r");
+    char line[256];
+    if(pf == 0) {
+      perror(prefetch);
+      exit(1);
+    }
+    while(fgets(line, sizeof(line), pf)) {
+      struct NODE* node;
+      line[strcspn(line, "\r\n")] = 0;
+      if(line[0] == 0 || line[0] == '#') {
+        continue;
+      }
+      node = find_node(line);
+      if(node == 0 || node->is_dir) {
+        fprintf(stderr, "%s: %s: file not found in image\n", prog, line);
+        exit(1);
+      }
+      if(node->block < 0) {
+        node->block = alloc_blocks(node->nrefs);
+      }
+    }
+    fclose(pf);
+  }
+
+  for(i = 0; i < nnodes; i++) {
+    if(!nodes[i]->is_dir && nodes[i]->block < 0) {
+      nodes[i]->block = alloc_blocks(nodes[i]->nrefs);
+    }
+  }
+  if(next_block > fssize_blocks || kernel_end > fssize_blocks) {
+    fprintf(stderr, "%s: %d blocks are needed, but only %d are available\n",
+      prog, max(next_block, kernel_end), fssize_blocks);
+    exit(1);
+  }
 
   // Open output file
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
@@ -73,13 +410,9 @@ int main(int argc, char *argv[])
   memset(buf, 0, sizeof(buf));
 
   // Now add boot image to the block
-  if((fd = open(argv[3], 0)) < 0) {
-    perror(argv[3]);
-    exit(1);
-  }
-
-  read(fd, buf, 512);
-  close(fd);
+  data = read_file(argv[3], &size);
+  memcpy(buf, data, min(size, BLOCK_SIZE));
+  free(data);
   wblock(0, buf);
 
   // Write all image with 0s
@@ -87,94 +420,57 @@ int main(int argc, char *argv[])
   for(i = 1; i < fssize_blocks; i++)
     wblock(i, buf);
 
-  // Superblock
-  sfs_sb.type = SFS_TYPE_ID;
-  sfs_sb.size = fssize_blocks;
-  sfs_sb.nentries = numentries;
-  sfs_sb.bootstart = 2 + entries_size/BLOCK_SIZE;
-
   memmove(buf, &sfs_sb, sizeof(sfs_sb));
   wblock(1, buf);
 
-  printf("%s: creating %s (size=%d nentries=%d bootstart=%d)\n",
-    argv[0], argv[1], sfs_sb.size, sfs_sb.nentries, sfs_sb.bootstart);
+  printf("%s: creating %s (size=%d nentries=%d journal=%d bootstart=%d)\n",
+    prog, argv[1], sfs_sb.size, sfs_sb.nentries, sfs_sb.journalsize,
+    sfs_sb.bootstart);
 
-  // Create empty entries table
+  // Create entries table
   sfs_entry = malloc(entries_size);
   memset(sfs_entry, 0, entries_size);
-  e = 0;
-  b = sfs_sb.bootstart;
-
-  // Create root dir
-  strncpy(sfs_entry[e].name, ROOT_DIR_NAME, SFS_NAMESIZE-1);
-  sfs_entry[e].flags = T_DIR;
-  sfs_entry[e].time = 0;
-  sfs_entry[e].size = argc - 4;
-  sfs_entry[e].parent = 0;
-  sfs_entry[e].next = 0;
 
-  e++;
-
-  // Copy input files to image
-  // The first one is expected to be the kernel
-  for(f = 4; f < argc; f++) {
-
-    // Open file
-    if((fd = open(argv[f], 0)) < 0) {
-      perror(argv[f]);
-      exit(1);
-    }
+  for(i = 0; i < nnodes; i++) {
+    struct NODE* node = nodes[i];
+    int remaining = node->size;
 
-    // Remove slashes from name
-    name = strrchr(argv[f], '/');
-    if(name == 0) {
-      name = argv[f];
-    } else {
-      name++;
-    }
+    // Fill head and chained entries
+    for(f = 0; f < node->nentries; f++) {
+      struct SFS_ENTRY* entry;
+      int n = node->entry + f;
 
-    // Create first file entry
-    sfs_entry[0].ref[f - 4] = e;
-
-    strncpy(sfs_entry[e].name, name, SFS_NAMESIZE-1);
-    sfs_entry[e].flags = T_FILE;
-    sfs_entry[e].time = 0;
-    sfs_entry[e].size = 0;
-    sfs_entry[e].parent = 0;
-    sfs_entry[e].next = 0;
-
-
-    // Read file, write data block, and add more entries
-    // when there is no room for more refs in current entry
-    i = 0;
-
-    while((cc = read(fd, buf, BLOCK_SIZE)) > 0) {
-      int ec = e + (sfs_entry[e].size / (SFS_ENTRYREFS*BLOCK_SIZE));
-      if(e != ec && sfs_entry[ec].name[0] == 0) {
-        strncpy(sfs_entry[ec].name, sfs_entry[e].name, SFS_NAMESIZE-1);
-        sfs_entry[ec-1].next = ec;
-        sfs_entry[ec].flags = T_FILE;
-        sfs_entry[ec].time = 0;
-        sfs_entry[ec].size = 0;
-        sfs_entry[ec].parent = ec-1;
-        sfs_entry[ec].next = 0;
-        i = 0;
+      // Root dir chained entries are placed after the kernel
+      if(node == root && f > 0) {
+        n = 1 + root->child[0]->nentries + f - 1;
+      }
+      entry = &sfs_entry[n];
+
+      strncpy((char*)entry->name, node->name, SFS_NAMESIZE-1);
+      entry->flags = node->flags;
+      entry->time = 0;
+      entry->size = remaining;
+      if(f == 0) {
+        entry->parent = node->parent ? node->parent->entry : 0;
+      } else {
+        entry->parent = (node == root && f == 1) ? 0 : n - 1;
+        sfs_entry[entry->parent].next = n;
       }
 
-      sfs_entry[ec].ref[i] = b;
-      wblock(sfs_entry[ec].ref[i], buf);
-      while(ec >= e) {
-        sfs_entry[ec].size += cc;
-        ec--;
+      for(r = 0; r < SFS_ENTRYREFS && f*SFS_ENTRYREFS + r < node->nrefs; r++) {
+        if(node->is_dir) {
+          entry->ref[r] = node->child[f*SFS_ENTRYREFS + r]->entry;
+        } else {
+          entry->ref[r] = node->block + f*SFS_ENTRYREFS + r;
+        }
       }
-      i++;
-      b++;
+      remaining -= node->is_dir ? SFS_ENTRYREFS : SFS_ENTRYREFS*BLOCK_SIZE;
     }
 
-    close(fd);
-
-    while(sfs_entry[e].name[0]) {
-      e++;
+    if(!node->is_dir) {
+      write_file_blocks(node);
+      printf("%s: %s blocks %d-%d\n", prog, node->path[0] ? node->path : ".",
+        node->block, node->block + node->nrefs - 1);
     }
   }
 
@@ -221,3 +517,113 @@ void rblock(uint bindex, void* buf)
     exit(1);
   }
 }
+
+// Read a full file
+// Returns allocated buffer, to be freed by caller
+unsigned char* read_file(char* path, int* size)
+{
+  unsigned char* data;
+  int fd;
+
+  if((fd = open(path, 0)) < 0) {
+    perror(path);
+    exit(1);
+  }
+  *size = lseek(fd, 0, SEEK_END);
+  lseek(fd, 0, SEEK_SET);
+
+  data = malloc(*size + 1);
+  if(data == 0 || read(fd, data, *size) != *size) {
+    perror(path);
+    exit(1);
+  }
+  close(fd);
+  return data;
+}
+
+// Compress a chunk using LZSS. See fs.h for format
+// Returns compressed size, or len if it can't be compressed
+int lz_compress_chunk(unsigned char* dst, unsigned char* src, int len)
+{
+  int i = 0;
+  int o = 0;
+  int flags, bit, d, l, best_len, best_dist;
+  unsigned int w;
+
+  while(i < len) {
+    flags = o++;
+    dst[flags] = 0;
+    for(bit = 0; bit < 8 && i < len; bit++) {
+      // Find longest match in previous data
+      best_len = 0;
+      best_dist = 0;
+      for(d = 1; d <= SFS_LZMAXDIST + 1 && d <= i; d++) {
+        for(l = 0; l < SFS_LZMAXMATCH && i + l < len && src[i+l] == src[i-d+l]; l++);
+        if(l > best_len) {
+          best_len = l;
+          best_dist = d;
+        }
+      }
+
+      if(best_len >= SFS_LZMINMATCH) {
+        w = (best_dist - 1) | ((best_len - SFS_LZMINMATCH) << SFS_LZDISTBITS);
+        dst[o++] = w & 0xFF;
+        dst[o++] = w >> 8;
+        i += best_len;
+      } else {
+        dst[flags] |= 1 << bit;
+        dst[o++] = src[i++];
+      }
+
+      if(o >= len) {
+        return len;
+      }
+    }
+  }
+  return o;
+}
+
+// Compress file data. See fs.h for format
+// Output: out, allocated buffer to be freed by caller
+// Returns compressed size, or 0 if compression does not reduce size
+int lz_compress(unsigned char** out, unsigned char* data, int size)
+{
+  struct SFS_LZHEADER* header;
+  unsigned char chunk[2*SFS_LZCHUNK];
+  unsigned char* buf;
+  int nchunks = (size + SFS_LZCHUNK - 1) / SFS_LZCHUNK;
+  int c, len, clen, o;
+
+  // The kernel can only address files up to 64KB
+  if(size == 0 || size > SFS_LZMAXSIZE || nchunks > SFS_LZCHUNKS) {
+    return 0;
+  }
+
+  buf = malloc(sizeof(struct SFS_LZHEADER) + size);
+  memset(buf, 0, sizeof(struct SFS_LZHEADER));
+  header = (struct SFS_LZHEADER*)buf;
+  header->type = SFS_LZ_ID;
+  header->size = size;
+  header->nchunks = nchunks;
+
+  o = sizeof(struct SFS_LZHEADER);
+  for(c = 0; c < nchunks; c++) {
+    len = min(SFS_LZCHUNK, size - c*SFS_LZCHUNK);
+    clen = lz_compress_chunk(chunk, data + c*SFS_LZCHUNK, len);
+    header->offset[c] = o;
+    if(clen < len) {
+      memcpy(buf + o, chunk, clen);
+    } else {
+      memcpy(buf + o, data + c*SFS_LZCHUNK, len);
+      clen = len;
+    }
+    o += clen;
+  }
+
+  if(o >= size) {
+    free(buf);
+    return 0;
+  }
+  *out = buf;
+  return o;
+}
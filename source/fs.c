@@ -4,9 +4,9 @@
 
 #include "types.h"
 #include "kernel.h"
-#include "fs.h"
 #include "hw86.h"
 #include "ulib/ulib.h"
+#include "fs.h"
 
 /*
  * See fs.h for more detailed description
@@ -119,6 +119,419 @@ static uchar* string_to_name(uchar* str)
   return str;
 }
 
+/*
+ * RAM disk access, specific block, offset and size
+ * Data is copied from or to far memory, depending on write
+ * Returns 0 on success, another value otherwise
+ */
+static uint ram_disk_access(uint disk, uint block, uint offset, uint buff_size, uchar* buff, uint write)
+{
+  struct DISKINFO* info = &disk_info[disk_to_index(disk)];
+  ul_t pos = (ul_t)block * (ul_t)BLOCK_SIZE + (ul_t)offset;
+
+  if(pos + (ul_t)buff_size > (ul_t)info->sectors * (ul_t)SECTOR_SIZE) {
+    debugstr("RAM disk: out of bounds (%U)\n\r", pos);
+    return 1;
+  }
+
+  if(write) {
+    lmemcpy(info->ram + pos, lp(buff), (ul_t)buff_size);
+  } else {
+    lmemcpy(lp(buff), info->ram + pos, (ul_t)buff_size);
+  }
+  return 0;
+}
+
+/*
+ * Boot to RAM
+ *
+ * Used blocks of the system disk are copied to far memory slots
+ * (see fs_set_bootram). Reads of copied blocks are served from memory.
+ * Writes update memory and, unless mode is BOOTRAM_VOLATILE, the disk.
+ * map holds, for each disk block, its slot index + 1, or 0 if the block
+ * is not in memory.
+ */
+#define BOOTRAM_EXTRA_BLOCKS 256 /* Max free slots for blocks written later */
+#define BOOTRAM_MIN_EXTRA    16  /* Min free slots in volatile mode */
+
+static struct BOOTRAM {
+  uint  mode;    /* See fs.h */
+  uint  disk;    /* Disk id */
+  uint  nblocks; /* Number of blocks in map */
+  uint  nslots;  /* Number of slots */
+  uint  used;    /* Number of used slots */
+  lp_t  map;     /* Slot of each block (far memory) */
+  lp_t  data;    /* Slots (far memory) */
+} bootram;
+
+static uint read_disk(uint disk, uint block, uint offset, uint buff_size, uchar* buff);
+static void disk_probe(uint disk_index);
+
+/*
+ * Get or set slot index + 1 of a block
+ */
+static uint bootram_get_slot(uint block)
+{
+  lp_t p = bootram.map + (lp_t)block * 2L;
+  if(block >= bootram.nblocks) {
+    return 0;
+  }
+  return lmem_getword(p);
+}
+
+static void bootram_set_slot(uint block, uint slot)
+{
+  lmem_setword(bootram.map + (lp_t)block * 2L, slot);
+}
+
+/*
+ * Get far memory address of a block, given its slot index + 1
+ */
+static lp_t bootram_addr(uint slot)
+{
+  return bootram.data + (lp_t)(slot-1) * (lp_t)BLOCK_SIZE;
+}
+
+/*
+ * Read from memory, if all requested blocks are there
+ * Returns 0 on success, another value otherwise
+ */
+static uint bootram_read(uint block, uint offset, uint buff_size, uchar* buff)
+{
+  ul_t pos = (ul_t)block * (ul_t)BLOCK_SIZE + (ul_t)offset;
+  ul_t end = pos + (ul_t)buff_size;
+  ul_t b;
+  uint i = 0;
+
+  for(b=pos/BLOCK_SIZE; b*BLOCK_SIZE<end; b++) {
+    if(bootram_get_slot((uint)b) == 0) {
+      return 1;
+    }
+  }
+
+  while(pos < end) {
+    uint o = (uint)(pos % BLOCK_SIZE);
+    uint n = (uint)min((ul_t)(BLOCK_SIZE - o), end - pos);
+    uint slot = bootram_get_slot((uint)(pos / BLOCK_SIZE));
+    lmemcpy(lp(&buff[i]), bootram_addr(slot) + (lp_t)o, (ul_t)n);
+    pos += n;
+    i += n;
+  }
+  return 0;
+}
+
+/*
+ * Write to memory
+ * Blocks not in memory are added if there are free slots.
+ * In volatile mode they must be added, since the disk is not written
+ * Returns 0 on success, another value otherwise
+ */
+static uint bootram_write(uint block, uint offset, uint buff_size, uchar* buff)
+{
+  ul_t pos = (ul_t)block * (ul_t)BLOCK_SIZE + (ul_t)offset;
+  ul_t end = pos + (ul_t)buff_size;
+  uchar bbuff[BLOCK_SIZE];
+  uint i = 0;
+
+  while(pos < end) {
+    uint b = (uint)(pos / BLOCK_SIZE);
+    uint o = (uint)(pos % BLOCK_SIZE);
+    uint n = (uint)min((ul_t)(BLOCK_SIZE - o), end - pos);
+    uint slot = bootram_get_slot(b);
+
+    if(slot == 0 && b < bootram.nblocks && bootram.used < bootram.nslots) {
+      /* Partially written blocks must be read first.
+       * In write-through mode, they are not worth it */
+      if(n == BLOCK_SIZE) {
+        slot = ++bootram.used;
+      } else if(bootram.mode == BOOTRAM_VOLATILE &&
+        read_disk(bootram.disk, b, 0, BLOCK_SIZE, bbuff) == 0) {
+        lmemcpy(bootram_addr(bootram.used+1), lp(bbuff), (ul_t)BLOCK_SIZE);
+        slot = ++bootram.used;
+      }
+      if(slot) {
+        bootram_set_slot(b, slot);
+      }
+    }
+
+    if(slot) {
+      lmemcpy(bootram_addr(slot) + (lp_t)o, lp(&buff[i]), (ul_t)n);
+    } else if(bootram.mode == BOOTRAM_VOLATILE) {
+      debugstr("Boot to RAM: no free slots\n\r");
+      return 1;
+    }
+
+    pos += n;
+    i += n;
+  }
+  return 0;
+}
+
+/*
+ * Extended memory cache
+ *
+ * Second level cache of disk blocks, stored above 1MB (after
+ * the HMA) and accessed with BIOS block moves (see xmem_copy).
+ * It's direct mapped, and write-through, so it never holds
+ * data that is not on disk. Tags are kept in the HMA, or in far
+ * memory (see hma_alloc), not in the kernel segment.
+ * Each tag is a dword: disk index + 1 in the high word, and
+ * block in the low word. A 0 tag means a free slot.
+ * RAM disk blocks are not cached
+ */
+#define XCACHE_BASE      0x110000L /* Linear address of first slot */
+#define XCACHE_MAX_SLOTS 1024      /* Power of 2. Tags use 4 bytes each */
+
+#define XCACHE_TAG(disk_index, block) \
+  ((((ul_t)(disk_index) + 1L) << 16) | (ul_t)(block))
+
+static struct XCACHE {
+  uint  nslots;  /* Number of slots, 0 if disabled */
+  ul_t  hits;    /* Blocks read from cache */
+  ul_t  misses;  /* Blocks read from disk */
+  lp_t  tags;    /* Tag of each slot (HMA or far memory) */
+} xcache;
+
+static uchar xcache_buff[BLOCK_SIZE];
+
+/*
+ * Get slot of a block, and its address
+ */
+static uint xcache_slot(uint disk_index, uint block)
+{
+  return (block ^ (disk_index << 8)) & (xcache.nslots - 1);
+}
+
+static ul_t xcache_addr(uint slot)
+{
+  return XCACHE_BASE + (ul_t)slot * (ul_t)BLOCK_SIZE;
+}
+
+/*
+ * Get or set tag of a slot
+ */
+static ul_t xcache_get_tag(uint slot)
+{
+  return lmem_getdword(xcache.tags + (lp_t)slot * 4L);
+}
+
+static void xcache_set_tag(uint slot, ul_t tag)
+{
+  lmem_setdword(xcache.tags + (lp_t)slot * 4L, tag);
+}
+
+/*
+ * Invalidate all cached blocks of a disk, or of all disks
+ * if disk is UNKNOWN_VALUE
+ */
+static void xcache_invalidate(uint disk)
+{
+  uint i;
+  if(disk == UNKNOWN_VALUE) {
+    lmemset(xcache.tags, 0, (ul_t)xcache.nslots * 4L);
+    return;
+  }
+  for(i=0; i<xcache.nslots; i++) {
+    if((xcache_get_tag(i) >> 16) == (ul_t)disk_to_index(disk) + 1L) {
+      xcache_set_tag(i, 0L);
+    }
+  }
+}
+
+/*
+ * Read from cache, if all requested blocks are there
+ * Returns 0 on success, another value otherwise
+ */
+static uint xcache_read(uint disk, uint block, uint offset, uint buff_size, uchar* buff)
+{
+  uint disk_index = disk_to_index(disk);
+  ul_t pos = (ul_t)block * (ul_t)BLOCK_SIZE + (ul_t)offset;
+  ul_t end = pos + (ul_t)buff_size;
+  uint i = 0;
+
+  while(pos < end) {
+    uint b = (uint)(pos / BLOCK_SIZE);
+    uint o = (uint)(pos % BLOCK_SIZE);
+    uint n = (uint)min((ul_t)(BLOCK_SIZE - o), end - pos);
+    uint slot = xcache_slot(disk_index, b);
+
+    if(xcache_get_tag(slot) != XCACHE_TAG(disk_index, b)) {
+      xcache.misses++;
+      return 1;
+    }
+    if(n == BLOCK_SIZE) {
+      if(xmem_copy(lp(&buff[i]), xcache_addr(slot), BLOCK_SIZE/2)) {
+        return 1;
+      }
+    } else {
+      if(xmem_copy(lp(xcache_buff), xcache_addr(slot), BLOCK_SIZE/2)) {
+        return 1;
+      }
+      memcpy(&buff[i], &xcache_buff[o], n);
+    }
+    xcache.hits++;
+    pos += n;
+    i += n;
+  }
+  return 0;
+}
+
+/*
+ * Add an entire block to the cache, given its far address,
+ * replacing the previous block in its slot
+ */
+static void xcache_put(uint disk_index, uint block, lp_t src)
+{
+  uint slot = xcache_slot(disk_index, block);
+  if(xmem_copy(xcache_addr(slot), src, BLOCK_SIZE/2)) {
+    xcache_set_tag(slot, 0L);
+  } else {
+    xcache_set_tag(slot, XCACHE_TAG(disk_index, block));
+  }
+}
+
+/*
+ * Update cache with data that is on disk
+ * Entire blocks are added, replacing the previous block in their
+ * slot. Partial blocks are only updated if they are already cached
+ */
+static void xcache_write(uint disk, uint block, uint offset, uint buff_size, uchar* buff)
+{
+  uint disk_index = disk_to_index(disk);
+  ul_t pos = (ul_t)block * (ul_t)BLOCK_SIZE + (ul_t)offset;
+  ul_t end = pos + (ul_t)buff_size;
+  uint i = 0;
+
+  while(pos < end) {
+    uint b = (uint)(pos / BLOCK_SIZE);
+    uint o = (uint)(pos % BLOCK_SIZE);
+    uint n = (uint)min((ul_t)(BLOCK_SIZE - o), end - pos);
+    uint slot = xcache_slot(disk_index, b);
+    uint result;
+
+    if(n == BLOCK_SIZE) {
+      xcache_put(disk_index, b, lp(&buff[i]));
+    } else if(xcache_get_tag(slot) == XCACHE_TAG(disk_index, b)) {
+      result = xmem_copy(lp(xcache_buff), xcache_addr(slot), BLOCK_SIZE/2);
+      memcpy(&xcache_buff[o], &buff[i], n);
+      result += xmem_copy(xcache_addr(slot), lp(xcache_buff), BLOCK_SIZE/2);
+      if(result) {
+        xcache_set_tag(slot, 0L);
+      }
+    }
+    pos += n;
+    i += n;
+  }
+}
+
+/*
+ * Enable the extended memory cache
+ */
+uint fs_init_xcache(ul_t xmem_kb)
+{
+  uchar check[16];
+  uint i;
+
+  if(xcache.tags) {
+    hma_free(xcache.tags);
+  }
+  memset((uchar*)&xcache, 0, sizeof(xcache));
+
+  /* Skip the HMA. Each KB holds two blocks */
+  if(xmem_kb <= (XCACHE_BASE - 0x100000L) / 1024L) {
+    return 0;
+  }
+  xmem_kb -= (XCACHE_BASE - 0x100000L) / 1024L;
+  xcache.nslots = XCACHE_MAX_SLOTS;
+  while((ul_t)xcache.nslots > xmem_kb * (1024L / BLOCK_SIZE)) {
+    xcache.nslots >>= 1;
+  }
+
+  /* Check memory is really there: write a pattern at the
+   * end of the last slot and read it back */
+  for(i=0; i<sizeof(check); i++) {
+    xcache_buff[i] = (uchar)(i ^ 0xA5);
+  }
+  if(xcache.nslots == 0 ||
+    xmem_copy(xcache_addr(xcache.nslots) - sizeof(check), lp(xcache_buff), sizeof(check)/2) ||
+    xmem_copy(lp(check), xcache_addr(xcache.nslots) - sizeof(check), sizeof(check)/2)) {
+    xcache.nslots = 0;
+  }
+  for(i=0; i<sizeof(check) && xcache.nslots; i++) {
+    if(check[i] != xcache_buff[i]) {
+      xcache.nslots = 0;
+    }
+  }
+  if(xcache.nslots) {
+    xcache.tags = hma_alloc((ul_t)xcache.nslots * 4L);
+    if(xcache.tags == 0) {
+      xcache.nslots = 0;
+    }
+  }
+  if(xcache.nslots == 0) {
+    debugstr("Extended memory cache: not available\n\r");
+    return 0;
+  }
+  lmemset(xcache.tags, 0, (ul_t)xcache.nslots * 4L);
+
+  debugstr("Extended memory cache: %u blocks at %X\n\r",
+    xcache.nslots, XCACHE_BASE);
+  return xcache.nslots;
+}
+
+/*
+ * Get disk cache usage
+ */
+void fs_get_cache_info(struct MEM_INFO* info)
+{
+  info->xcache_blocks = xcache.nslots;
+  info->xcache_hits = xcache.hits;
+  info->xcache_misses = xcache.misses;
+  info->bootram_blocks = bootram.nslots;
+  info->bootram_used = bootram.used;
+}
+
+/*
+ * Boot prefetch profile
+ *
+ * Blocks of the system disk read during a boot can be recorded
+ * in BOOTPF_FILE (see fs_bootpf_begin and fs_bootpf_start).
+ * In next boots, they are read in advance, sorted and merged
+ * a track at a time, so they are in the extended memory cache
+ * when they are needed
+ */
+static struct BOOTPF {
+  uint  recording;                /* Blocks read are being recorded */
+  ul_t  start_ms;                 /* Recording start time */
+  uint  nblocks;                  /* Number of recorded blocks */
+  uint  block[BOOTPF_MAX_BLOCKS]; /* Recorded blocks, in read order */
+} bootpf;
+
+/*
+ * Record blocks read from the system disk
+ * Blocks already recorded are skipped
+ */
+static void bootpf_record(uint block, uint offset, uint buff_size)
+{
+  ul_t pos = (ul_t)block * (ul_t)BLOCK_SIZE + (ul_t)offset;
+  ul_t end = pos + (ul_t)buff_size;
+  ul_t b;
+
+  if(system_timer_ms - bootpf.start_ms > BOOTPF_RECORD_MS) {
+    return;
+  }
+
+  for(b=pos/BLOCK_SIZE; b*BLOCK_SIZE<end && bootpf.nblocks<BOOTPF_MAX_BLOCKS; b++) {
+    uint i = bootpf.nblocks;
+    while(i > 0 && bootpf.block[i-1] != (uint)b) {
+      i--;
+    }
+    if(i == 0) {
+      bootpf.block[bootpf.nblocks++] = (uint)b;
+    }
+  }
+}
+
 /*
  * Read disk, specific block, offset and size
  * Returns 0 on success, another value otherwise
@@ -129,6 +542,8 @@ static uint read_disk(uint disk, uint block, uint offset, uint buff_size, uchar*
   uint n_sectors = 0;
   uint i = 0;
   uint result = 0;
+  uint first_offset = offset;
+  uint total_size = buff_size;
   uint sector;
 
   /* Check params */
@@ -137,11 +552,32 @@ static uint read_disk(uint disk, uint block, uint offset, uint buff_size, uchar*
     return 1;
   }
 
+  disk_probe(disk_to_index(disk));
+
   if(disk_info[disk_to_index(disk)].size == 0) {
     debugstr("Read disk: bad disk\n\r");
     return 1;
   }
 
+  if(disk_info[disk_to_index(disk)].ram) {
+    return ram_disk_access(disk, block, offset, buff_size, buff, 0);
+  }
+
+  /* Record reads even if they are served from memory,
+   * since memory may not hold them in next boots */
+  if(bootpf.recording && disk == system_disk) {
+    bootpf_record(block, offset, buff_size);
+  }
+
+  if(bootram.map && disk == bootram.disk &&
+    bootram_read(block, offset, buff_size, buff) == 0) {
+    return 0;
+  }
+
+  if(xcache.nslots && xcache_read(disk, block, offset, buff_size, buff) == 0) {
+    return 0;
+  }
+
   /* Convert blocks to sectors */
   if(BLOCK_SIZE >= SECTOR_SIZE) {
     sector = block * (BLOCK_SIZE / SECTOR_SIZE);
@@ -201,6 +637,8 @@ static uint read_disk(uint disk, uint block, uint offset, uint buff_size, uchar*
 
   if(result != 0) {
     debugstr("Read disk error (%x)\n\r", result);
+  } else if(xcache.nslots) {
+    xcache_write(disk, block, first_offset, total_size, buff);
   }
 
   return result;
@@ -215,6 +653,8 @@ static uint write_disk(uint disk, uint block, uint offset, uint buff_size, uchar
   uint n_sectors = 0;
   uint i = 0;
   uint result = 0;
+  uint first_offset = offset;
+  uint total_size = buff_size;
   uint sector;
 
   /* Check params */
@@ -223,11 +663,24 @@ static uint write_disk(uint disk, uint block, uint offset, uint buff_size, uchar
     return 1;
   }
 
+  disk_probe(disk_to_index(disk));
+
   if(disk_info[disk_to_index(disk)].size == 0) {
     debugstr("Write disk: bad disk\n\r");
     return 1;
   }
 
+  if(disk_info[disk_to_index(disk)].ram) {
+    return ram_disk_access(disk, block, offset, buff_size, buff, 1);
+  }
+
+  if(bootram.map && disk == bootram.disk) {
+    if(bootram.mode == BOOTRAM_VOLATILE) {
+      return bootram_write(block, offset, buff_size, buff);
+    }
+    bootram_write(block, offset, buff_size, buff);
+  }
+
   /* Convert blocks to sectors */
   if(BLOCK_SIZE >= SECTOR_SIZE) {
     sector = block * (BLOCK_SIZE / SECTOR_SIZE);
@@ -277,20 +730,1438 @@ static uint write_disk(uint disk, uint block, uint offset, uint buff_size, uchar
     }
   }
 
-  /* write_disk_sector can only write entire and aligned sectors.
-   * If requested size exceeds entire sectors, read
-   * an entire sector, overwrite requested bytes, and write */
-  if(buff_size && result == 0) {
-    result += read_disk_sector(disk, sector, 1, disk_buff);
-    memcpy(disk_buff, &buff[i], buff_size);
-    result += write_disk_sector(disk, sector, 1, disk_buff);
+  /* write_disk_sector can only write entire and aligned sectors.
+   * If requested size exceeds entire sectors, read
+   * an entire sector, overwrite requested bytes, and write */
+  if(buff_size && result == 0) {
+    result += read_disk_sector(disk, sector, 1, disk_buff);
+    memcpy(disk_buff, &buff[i], buff_size);
+    result += write_disk_sector(disk, sector, 1, disk_buff);
+  }
+
+  /* On errors, disk contents are unknown */
+  if(result != 0) {
+    debugstr("Write disk error (%x)\n\r", result);
+    xcache_invalidate(disk);
+  } else if(xcache.nslots) {
+    xcache_write(disk, block, first_offset, total_size, buff);
+  }
+
+  return result;
+}
+
+/*
+ * Get number of needed blocks to contain a given size (bytes)
+ */
+static uint needed_blocks(uint size)
+{
+  uint nblocks = size / BLOCK_SIZE;
+  if(size % BLOCK_SIZE) {
+    nblocks++;
+  }
+  return nblocks;
+}
+
+/*
+ * Get number of block references used by a file entry.
+ * Its size is the size of the file from this entry on,
+ * so it can exceed uint for the first entries of big files
+ */
+static uint entry_block_refs(struct SFS_ENTRY* entry)
+{
+  return (uint)min((entry->size + (uint32_t)(BLOCK_SIZE-1)) / (uint32_t)BLOCK_SIZE,
+    (uint32_t)SFS_ENTRYREFS);
+}
+
+/*
+ * Sorted disk accesses
+ *
+ * When many blocks must be read or written at once, requests are issued
+ * sorted by block index (elevator order), and contiguous blocks are
+ * merged in a single disk access. Logical block order is also cylinder
+ * and head order for CHS disks, but merged accesses never cross a track
+ * boundary, since not all BIOSes support it.
+ */
+#define IO_MERGE_BLOCKS 4 /* Max blocks merged using the io buffer */
+
+static uchar io_buff[IO_MERGE_BLOCKS*BLOCK_SIZE];
+
+struct IO_STATS {
+  ul_t  blocks;        /* Blocks accessed with sorted accesses */
+  ul_t  accesses;      /* Disk accesses issued for these blocks */
+  ul_t  seeks_avoided; /* Discontinuities removed by sorting */
+};
+static struct IO_STATS io_stats;
+
+/*
+ * Get max number of blocks that can be accessed at once
+ * starting at a given block, without crossing a track boundary
+ */
+static uint io_track_blocks(uint disk, uint block)
+{
+  uint index = disk_to_index(disk);
+  uint spb = BLOCK_SIZE >= SECTOR_SIZE ? BLOCK_SIZE / SECTOR_SIZE : 1;
+  uint sectors;
+  uint left;
+
+  if(index >= MAX_DISK || disk_info[index].sectors == 0) {
+    return 1;
+  }
+
+  sectors = disk_info[index].sectors;
+  left = (sectors - (uint)(((ul_t)block * (ul_t)spb) % (ul_t)sectors)) / spb;
+  return left ? left : 1;
+}
+
+/*
+ * Count discontinuities in a list of block indexes
+ * Each one is a seek for the disk
+ */
+static uint io_discontinuities(uint* block, uint count)
+{
+  uint n = 0;
+  uint i;
+  for(i=1; i<count; i++) {
+    if(block[i] != block[i-1] + 1) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/*
+ * Sort a list of block indexes in ascending order
+ * tag, if not 0, is reordered along with block
+ */
+static void io_sort(uint* block, uint* tag, uint count)
+{
+  uint before = io_discontinuities(block, count);
+  uint i;
+  uint j;
+
+  for(i=1; i<count; i++) {
+    uint b = block[i];
+    uint t = tag ? tag[i] : 0;
+    for(j=i; j>0 && block[j-1]>b; j--) {
+      block[j] = block[j-1];
+      if(tag) {
+        tag[j] = tag[j-1];
+      }
+    }
+    block[j] = b;
+    if(tag) {
+      tag[j] = t;
+    }
+  }
+
+  io_stats.seeks_avoided += before - io_discontinuities(block, count);
+}
+
+/*
+ * Account a merged disk access of n blocks
+ */
+static void io_account(uint n)
+{
+  io_stats.blocks += n;
+  io_stats.accesses++;
+}
+
+/*
+ * Show sorted access counters through debug output
+ */
+static void io_report(uint disk)
+{
+  debugstr("IO: %x blocks=%U accesses=%U seeks_avoided=%U\n\r", disk,
+    io_stats.blocks, io_stats.accesses, io_stats.seeks_avoided);
+  if(xcache.nslots) {
+    debugstr("IO: xcache hits=%U misses=%U\n\r", xcache.hits, xcache.misses);
+  }
+}
+
+/*
+ * Get first data block index given a superblock
+ */
+static uint first_data_block(struct SFS_SUPERBLOCK* sb)
+{
+  return (uint)(2L +
+    ((uint32_t)sb->nentries*(uint32_t)sizeof(struct SFS_ENTRY))/(uint32_t)BLOCK_SIZE +
+    sb->journalsize);
+}
+
+static uint get_entry_n(struct SFS_ENTRY* entry, uint disk, uint n);
+static uint journal_find(uint disk, uint n);
+static uint find_entry(struct SFS_ENTRY* entry, uchar* path, uint parent, uint disk);
+static void lz_invalidate(uint disk, uint n);
+
+/*
+ * Free space accounting
+ *
+ * For each mounted NSFS disk, used blocks and used entries are tracked
+ * in two bitmaps (one bit per block or entry, set if used) stored in
+ * kernel far memory. They are built once at mount time, by scanning the
+ * entries table, and then updated by every allocation and free, so free
+ * space queries and free block or entry searches need no disk access.
+ * If accounting is not valid for a disk (not NSFS or not enough far
+ * memory), the slower disk scanning methods are used instead.
+ */
+struct FS_USAGE {
+  uint      valid;        /* Accounting is valid for this disk */
+  lp_t      block_map;    /* Used blocks bitmap (HMA or far memory) */
+  lp_t      entry_map;    /* Used entries bitmap (HMA or far memory) */
+  uint      nblocks;      /* Number of blocks tracked */
+  uint      nentries;     /* Number of entries tracked */
+  uint      first_data;   /* First data block */
+  uint      free_blocks;  /* Number of free data blocks */
+  uint      free_entries; /* Number of free entries */
+  uint      largest_run;  /* Largest contiguous free blocks run */
+  uint      run_dirty;    /* largest_run must be recomputed */
+};
+
+static struct FS_USAGE fs_usage[MAX_DISK];
+
+/*
+ * Get or set a bit in a far memory bitmap
+ */
+static uint bitmap_get(lp_t map, uint n)
+{
+  return (lmem_getbyte(map + (lp_t)(n >> 3)) >> (n & 7)) & 1;
+}
+
+static void bitmap_set(lp_t map, uint n, uint value)
+{
+  uchar b = lmem_getbyte(map + (lp_t)(n >> 3));
+  if(value) {
+    b |= (1 << (n & 7));
+  } else {
+    b &= ~(1 << (n & 7));
+  }
+  lmem_setbyte(map + (lp_t)(n >> 3), b);
+}
+
+/*
+ * Find first clear bit in a far memory bitmap,
+ * starting at first and below limit
+ * Returns its index or ERROR_NO_SPACE
+ */
+static uint bitmap_find_clear(lp_t map, uint first, uint limit)
+{
+  ul_t n = first;
+  while(n < (ul_t)limit) {
+    /* Skip full dwords and bytes at once */
+    if((n & 31) == 0 && n + 32 <= (ul_t)limit &&
+      lmem_getdword(map + (lp_t)(n >> 3)) == 0xFFFFFFFFL) {
+      n += 32;
+      continue;
+    }
+    if((n & 7) == 0 && lmem_getbyte(map + (lp_t)(n >> 3)) == 0xFF) {
+      n += 8;
+      continue;
+    }
+    if(!bitmap_get(map, (uint)n)) {
+      return (uint)n;
+    }
+    n++;
+  }
+  return ERROR_NO_SPACE;
+}
+
+/*
+ * Mark a block as used or free in disk accounting
+ */
+static void usage_mark_block(uint disk, uint block, uint used)
+{
+  uint index = disk_to_index(disk);
+  struct FS_USAGE* u;
+
+  if(index >= MAX_DISK || !fs_usage[index].valid) {
+    return;
+  }
+  u = &fs_usage[index];
+  if(block < u->first_data || block >= u->nblocks ||
+    bitmap_get(u->block_map, block) == (used ? 1 : 0)) {
+    return;
+  }
+  bitmap_set(u->block_map, block, used);
+  if(used) {
+    u->free_blocks--;
+  } else {
+    u->free_blocks++;
+  }
+  u->run_dirty = 1;
+}
+
+/*
+ * Mark an entry as used or free in disk accounting
+ */
+static void usage_mark_entry(uint disk, uint n, uint used)
+{
+  uint index = disk_to_index(disk);
+  struct FS_USAGE* u;
+
+  if(index >= MAX_DISK || !fs_usage[index].valid) {
+    return;
+  }
+  u = &fs_usage[index];
+  if(n >= u->nentries || bitmap_get(u->entry_map, n) == (used ? 1 : 0)) {
+    return;
+  }
+  bitmap_set(u->entry_map, n, used);
+  if(used) {
+    u->free_entries--;
+  } else {
+    u->free_entries++;
+  }
+}
+
+/*
+ * Mark as free all data blocks referenced by a file entry
+ */
+static void usage_free_entry_blocks(uint disk, struct SFS_ENTRY* entry)
+{
+  uint b;
+  if(entry->flags & T_FILE) {
+    for(b=0; b<entry_block_refs(entry); b++) {
+      if(entry->ref[b]) {
+        usage_mark_block(disk, (uint)entry->ref[b], 0);
+      }
+    }
+  }
+}
+
+/*
+ * Release accounting of a disk
+ */
+static void usage_release(uint disk_index)
+{
+  struct FS_USAGE* u = &fs_usage[disk_index];
+  if(u->block_map) {
+    hma_free(u->block_map);
+  }
+  if(u->entry_map) {
+    hma_free(u->entry_map);
+  }
+  memset((uchar*)u, 0, sizeof(struct FS_USAGE));
+}
+
+/*
+ * Reset accounting of a disk given its superblock:
+ * all data blocks and all entries are set as free
+ * Returns 0 on success
+ */
+static uint usage_reset(uint disk_index, struct SFS_SUPERBLOCK* sb)
+{
+  struct FS_USAGE* u = &fs_usage[disk_index];
+  uint b;
+
+  usage_release(disk_index);
+
+  /* Block indexes must be valid uint values */
+  u->nblocks = (uint)min(sb->size, (uint32_t)ERROR_ANY);
+  u->nentries = (uint)min(sb->nentries, (uint32_t)ERROR_ANY);
+  u->first_data = first_data_block(sb);
+  if(u->first_data > u->nblocks) {
+    u->first_data = u->nblocks;
+  }
+
+  /* Allocate bitmaps */
+  u->block_map = hma_alloc((ul_t)(u->nblocks/8 + 1));
+  u->entry_map = hma_alloc((ul_t)(u->nentries/8 + 1));
+  if(u->block_map == 0 || u->entry_map == 0) {
+    debugstr("FS usage: not enough memory for disk %x\n\r",
+      index_to_disk(disk_index));
+    usage_release(disk_index);
+    return ERROR_NO_SPACE;
+  }
+
+  /* Everything is free, but metadata blocks */
+  lmemset(u->block_map, 0, (ul_t)(u->nblocks/8 + 1));
+  lmemset(u->entry_map, 0, (ul_t)(u->nentries/8 + 1));
+  for(b=0; b<u->first_data; b++) {
+    bitmap_set(u->block_map, b, 1);
+  }
+  u->free_blocks = u->nblocks - u->first_data;
+  u->free_entries = u->nentries;
+  u->run_dirty = 1;
+  u->valid = 1;
+
+  return 0;
+}
+
+/*
+ * Build accounting of a disk given its superblock
+ * Scans the full entries table
+ * Returns 0 on success
+ */
+static uint usage_init(uint disk_index, struct SFS_SUPERBLOCK* sb)
+{
+  struct SFS_ENTRY entry;
+  struct SFS_ENTRY* e;
+  uint disk = index_to_disk(disk_index);
+  uint nentries;
+  uint per_block = BLOCK_SIZE / sizeof(struct SFS_ENTRY);
+  uint result;
+  uint n, b, i;
+  uint count;
+
+  result = usage_reset(disk_index, sb);
+  if(result != 0) {
+    return result;
+  }
+  nentries = fs_usage[disk_index].nentries;
+
+  /* Mark used entries and referenced blocks.
+   * The entries table is read in runs of blocks, not entry by entry */
+  for(n=0; n<nentries; n+=count) {
+    uint block = 2 + n / per_block;
+    count = min(IO_MERGE_BLOCKS, io_track_blocks(disk, block)) * per_block;
+    count = min(count, nentries - n);
+    result = read_disk(disk, block, 0, count*sizeof(struct SFS_ENTRY), io_buff);
+    if(result != 0) {
+      usage_release(disk_index);
+      return ERROR_IO;
+    }
+    io_account(count / per_block);
+
+    for(i=0; i<count; i++) {
+      e = (struct SFS_ENTRY*)&io_buff[i*sizeof(struct SFS_ENTRY)];
+      /* Entries not yet checkpointed are in the journal cache */
+      if(journal_find(disk, n+i) != ERROR_NOT_FOUND) {
+        get_entry_n(&entry, disk, n+i);
+        e = &entry;
+      }
+      if(e->flags & F_USED) {
+        usage_mark_entry(disk, n+i, 1);
+      }
+      if(e->flags & T_FILE) {
+        for(b=0; b<entry_block_refs(e); b++) {
+          if(e->ref[b]) {
+            usage_mark_block(disk, (uint)e->ref[b], 1);
+          }
+        }
+      }
+    }
+  }
+
+  debugstr("FS usage: %x free blocks=%u free entries=%u\n\r",
+    disk, fs_usage[disk_index].free_blocks, fs_usage[disk_index].free_entries);
+
+  return 0;
+}
+
+/*
+ * Get largest contiguous free blocks run of a disk
+ * It's only recomputed if blocks were allocated or freed
+ */
+static uint usage_largest_run(uint disk_index)
+{
+  struct FS_USAGE* u = &fs_usage[disk_index];
+  ul_t n;
+  uint run = 0;
+
+  if(!u->valid) {
+    return 0;
+  }
+
+  if(u->run_dirty) {
+    u->largest_run = 0;
+    n = u->first_data;
+    while(n < (ul_t)u->nblocks) {
+      /* Process full dwords and bytes at once */
+      if((n & 31) == 0 && n + 32 <= (ul_t)u->nblocks) {
+        ul_t d = lmem_getdword(u->block_map + (lp_t)(n >> 3));
+        if(d == 0L) {
+          run += 32;
+          n += 32;
+          continue;
+        } else if(d == 0xFFFFFFFFL) {
+          u->largest_run = max(u->largest_run, run);
+          run = 0;
+          n += 32;
+          continue;
+        }
+      }
+      if((n & 7) == 0 && n + 8 <= (ul_t)u->nblocks) {
+        uchar b = lmem_getbyte(u->block_map + (lp_t)(n >> 3));
+        if(b == 0x00) {
+          run += 8;
+          n += 8;
+          continue;
+        } else if(b == 0xFF) {
+          u->largest_run = max(u->largest_run, run);
+          run = 0;
+          n += 8;
+          continue;
+        }
+      }
+      if(bitmap_get(u->block_map, (uint)n)) {
+        u->largest_run = max(u->largest_run, run);
+        run = 0;
+      } else {
+        run++;
+      }
+      n++;
+    }
+    u->largest_run = max(u->largest_run, run);
+    u->run_dirty = 0;
+  }
+
+  return u->largest_run;
+}
+
+/*
+ * Find first contiguous free blocks run of at least count blocks
+ * Returns its first block or ERROR_NO_SPACE
+ */
+static uint usage_find_run(uint disk_index, uint count)
+{
+  struct FS_USAGE* u = &fs_usage[disk_index];
+  uint first;
+  uint n;
+
+  if(!u->valid || count == 0) {
+    return ERROR_NO_SPACE;
+  }
+
+  first = bitmap_find_clear(u->block_map, u->first_data, u->nblocks);
+  while(first < ERROR_ANY) {
+    for(n=first; n<u->nblocks && n-first<count; n++) {
+      if(bitmap_get(u->block_map, n)) {
+        break;
+      }
+    }
+    if(n - first == count) {
+      return first;
+    }
+    first = bitmap_find_clear(u->block_map, n, u->nblocks);
+  }
+  return ERROR_NO_SPACE;
+}
+
+/*
+ * Write count contiguous entries starting at index n,
+ * directly in the entries table
+ */
+static uint write_entries_home(uchar* buff, uint disk, uint n, uint count)
+{
+  /* Compute block number and offset */
+  uint32_t block = 2L +
+    ((uint32_t)n*(uint32_t)sizeof(struct SFS_ENTRY))/(uint32_t)BLOCK_SIZE;
+
+  uint32_t offset = ((uint32_t)n *
+    (uint32_t)sizeof(struct SFS_ENTRY)) % (uint32_t)BLOCK_SIZE;
+
+  /* Write and return */
+  uint result = write_disk(disk, (uint)block, (uint)offset,
+    count*sizeof(struct SFS_ENTRY), buff);
+
+  return result != 0 ? ERROR_IO : 0;
+}
+
+/*
+ * Write entry by index at disk, directly in the entries table
+ */
+static uint write_entry_home(struct SFS_ENTRY* entry, uint disk, uint n)
+{
+  return write_entries_home((uchar*)entry, disk, n, 1);
+}
+
+/*
+ * Metadata journal
+ *
+ * See fs.h for the on-disk format.
+ * Modified entries are kept in a cache in kernel far memory. Each cache
+ * slot can be:
+ * - staged: modified by the current transaction, not yet in the journal
+ * - logged: committed to the journal, not yet written to the entries table
+ * When a transaction ends, all staged entries of each disk are committed.
+ * If it failed, they are dropped instead. A transaction is never split:
+ * if its entries don't fit in the cache, it fails with ERROR_NO_SPACE.
+ * Operations on whole trees (directory copy and delete) are a
+ * transaction per item, so they never need more than a few slots.
+ * Logged entries are only written to the entries table (checkpoint) when
+ * the journal or the cache are full, or when fs_sync is called.
+ * Reads of cached entries are served from the cache.
+ */
+#define JOURNAL_CACHE_SIZE 24 /* Max number of cached modified entries */
+
+#define JS_FREE   0 /* Unused cache slot */
+#define JS_STAGED 1 /* Modified in current transaction */
+#define JS_LOGGED 2 /* Committed to journal, not checkpointed */
+
+struct JOURNAL_SLOT {
+  uint  state;   /* JS_ state */
+  uint  disk;    /* Disk id */
+  uint  n;       /* Entry index */
+  uint  jblock;  /* Journal block of the last committed copy, or 0 */
+};
+
+struct JOURNAL_INFO {
+  uint      enabled;  /* Journal is being used in this disk */
+  uint      start;    /* First journal block */
+  uint      size;     /* Number of journal blocks */
+  uint      pos;      /* Next free journal block (relative to start) */
+  uint32_t  sequence; /* Sequence number of next transaction */
+};
+
+static struct JOURNAL_SLOT journal_slot[JOURNAL_CACHE_SIZE];
+static struct JOURNAL_INFO journal_info[MAX_DISK];
+static lp_t journal_cache = 0; /* HMA or far memory, one entry per slot */
+static uint journal_depth = 0; /* Nesting level of current transaction */
+
+static uint journal_commit(uint disk_index);
+
+/*
+ * Get far memory address of a cache slot entry
+ */
+static lp_t journal_slot_addr(uint s)
+{
+  return journal_cache + (lp_t)s*(lp_t)sizeof(struct SFS_ENTRY);
+}
+
+/*
+ * Find cache slot of a given entry
+ * Returns slot index or ERROR_NOT_FOUND
+ */
+static uint journal_find(uint disk, uint n)
+{
+  uint s;
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    if(journal_slot[s].state != JS_FREE &&
+      journal_slot[s].disk == disk && journal_slot[s].n == n) {
+      return s;
+    }
+  }
+  return ERROR_NOT_FOUND;
+}
+
+/*
+ * Write journal header
+ */
+static uint journal_write_header(uint disk_index)
+{
+  uchar buff[BLOCK_SIZE];
+  struct SFS_JHEADER* jh = (struct SFS_JHEADER*)buff;
+  struct JOURNAL_INFO* ji = &journal_info[disk_index];
+
+  memset(buff, 0, sizeof(buff));
+  jh->type = SFS_JHEADER_ID;
+  jh->sequence = ji->sequence;
+  if(write_disk(index_to_disk(disk_index), ji->start, 0, BLOCK_SIZE, buff)) {
+    return ERROR_IO;
+  }
+  return 0;
+}
+
+/*
+ * Checkpoint journal of a disk
+ * Writes all logged entries to the entries table and empties the journal
+ */
+static uint journal_checkpoint(uint disk_index)
+{
+  uint n[JOURNAL_CACHE_SIZE];
+  uint slot[JOURNAL_CACHE_SIZE];
+  struct JOURNAL_INFO* ji = &journal_info[disk_index];
+  uint disk = index_to_disk(disk_index);
+  uint count = 0;
+  uint result;
+  uint limit;
+  uint run;
+  uint s;
+  uint i;
+
+  if(!ji->enabled || ji->pos == 1) {
+    return 0;
+  }
+
+  /* Find entries to write: logged ones, and entries staged
+   * again after being committed */
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    struct JOURNAL_SLOT* js = &journal_slot[s];
+    if(js->state != JS_FREE && js->disk == disk &&
+      (js->state == JS_LOGGED || js->jblock)) {
+      n[count] = js->n;
+      slot[count] = s;
+      count++;
+    }
+  }
+
+  /* Write them sorted by index, merging contiguous entries */
+  io_sort(n, slot, count);
+  for(i=0; i<count; i+=run) {
+    limit = min(sizeof(io_buff)/sizeof(struct SFS_ENTRY),
+      io_track_blocks(disk, 2 + n[i]*sizeof(struct SFS_ENTRY)/BLOCK_SIZE));
+    run = 0;
+    do {
+      uchar* buff = &io_buff[run*sizeof(struct SFS_ENTRY)];
+      struct JOURNAL_SLOT* js = &journal_slot[slot[i+run]];
+      if(js->state == JS_LOGGED) {
+        lmemcpy(lp(buff), journal_slot_addr(slot[i+run]),
+          lsizeof(struct SFS_ENTRY));
+      } else {
+        /* Cached copy is not committed yet, use the last committed one */
+        result = read_disk(disk, ji->start + js->jblock, 0,
+          sizeof(struct SFS_ENTRY), buff);
+        if(result != 0) {
+          return ERROR_IO;
+        }
+      }
+      run++;
+    } while(i+run < count && run < limit && n[i+run] == n[i]+run);
+
+    result = write_entries_home(io_buff, disk, n[i], run);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    io_account(run);
+  }
+
+  /* Release logged entries */
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    if(journal_slot[s].disk == disk) {
+      if(journal_slot[s].state == JS_LOGGED) {
+        journal_slot[s].state = JS_FREE;
+      }
+      journal_slot[s].jblock = 0;
+    }
+  }
+  io_report(disk);
+
+  /* Journal is now empty */
+  ji->pos = 1;
+  return journal_write_header(disk_index);
+}
+
+/*
+ * Commit all staged entries of a disk as a new transaction
+ */
+static uint journal_commit(uint disk_index)
+{
+  uchar buff[BLOCK_SIZE];
+  struct SFS_JDESC* jd = (struct SFS_JDESC*)buff;
+  struct SFS_JCOMMIT* jc = (struct SFS_JCOMMIT*)buff;
+  struct JOURNAL_INFO* ji = &journal_info[disk_index];
+  uint disk = index_to_disk(disk_index);
+  uint n[JOURNAL_CACHE_SIZE];
+  uint slot[JOURNAL_CACHE_SIZE];
+  uint count = 0;
+  uint jblock;
+  uint result;
+  uint limit;
+  uint run;
+  uint s;
+  uint i;
+
+  if(!ji->enabled) {
+    return 0;
+  }
+
+  /* Count staged entries */
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    if(journal_slot[s].state == JS_STAGED && journal_slot[s].disk == disk) {
+      count++;
+    }
+  }
+  if(count == 0) {
+    return 0;
+  }
+
+  /* Make room if needed */
+  if(ji->pos + count + 2 > ji->size) {
+    result = journal_checkpoint(disk_index);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
+  /* Fill descriptor with staged entries sorted by index,
+   * so replay and checkpoint write them in this order */
+  memset(buff, 0, sizeof(buff));
+  jd->type = SFS_JDESC_ID;
+  jd->sequence = ji->sequence;
+  jd->count = count;
+  count = 0;
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    if(journal_slot[s].state == JS_STAGED && journal_slot[s].disk == disk) {
+      n[count] = journal_slot[s].n;
+      slot[count] = s;
+      count++;
+    }
+  }
+  io_sort(n, slot, count);
+
+  /* Write entries to contiguous journal blocks */
+  for(i=0; i<count; i+=run) {
+    jblock = ji->pos + 1 + i;
+    limit = min(IO_MERGE_BLOCKS, io_track_blocks(disk, ji->start + jblock));
+    for(run=0; i+run<count && run<limit; run++) {
+      journal_slot[slot[i+run]].jblock = jblock + run;
+      jd->ref[i+run] = n[i+run];
+      lmemcpy(lp(&io_buff[run*BLOCK_SIZE]), journal_slot_addr(slot[i+run]),
+        lsizeof(struct SFS_ENTRY));
+    }
+    if(write_disk(disk, ji->start + jblock, 0, run*BLOCK_SIZE, io_buff)) {
+      return ERROR_IO;
+    }
+    io_account(run);
+  }
+
+  /* Write descriptor */
+  if(write_disk(disk, ji->start + ji->pos, 0, BLOCK_SIZE, buff)) {
+    return ERROR_IO;
+  }
+
+  /* Write commit block. Once written, the transaction is valid */
+  memset(buff, 0, sizeof(buff));
+  jc->type = SFS_JCOMMIT_ID;
+  jc->sequence = ji->sequence;
+  if(write_disk(disk, ji->start + ji->pos + count + 1, 0, BLOCK_SIZE, buff)) {
+    return ERROR_IO;
+  }
+
+  /* Staged entries are now logged */
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    if(journal_slot[s].state == JS_STAGED && journal_slot[s].disk == disk) {
+      journal_slot[s].state = JS_LOGGED;
+    }
+  }
+  ji->pos += count + 2;
+  ji->sequence++;
+
+  return 0;
+}
+
+/*
+ * Commit staged entries of all disks
+ */
+static uint journal_commit_all()
+{
+  uint disk_index;
+  uint result;
+  for(disk_index=0; disk_index<MAX_DISK; disk_index++) {
+    result = journal_commit(disk_index);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Get a free cache slot
+ * Checkpoints when the cache is full
+ * Returns slot index or an error code
+ */
+static uint journal_get_free_slot()
+{
+  uint disk_index;
+  uint result;
+  uint s;
+  uint pass;
+
+  for(pass=0; pass<2; pass++) {
+    for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+      if(journal_slot[s].state == JS_FREE) {
+        return s;
+      }
+    }
+
+    /* Cache is full. Release logged entries. If all of
+     * them are staged, the transaction is too large */
+    if(pass == 0) {
+      for(disk_index=0; disk_index<MAX_DISK; disk_index++) {
+        result = journal_checkpoint(disk_index);
+        if(result >= ERROR_ANY) {
+          return result;
+        }
+      }
+    }
+  }
+
+  debugstr("Journal: cache full, transaction too large\n\r");
+  return ERROR_NO_SPACE;
+}
+
+/*
+ * Stage an entry update in the journal cache
+ */
+static uint journal_stage(struct SFS_ENTRY* entry, uint disk, uint n)
+{
+  uint s = journal_find(disk, n);
+  if(s == ERROR_NOT_FOUND) {
+    s = journal_get_free_slot();
+    if(s >= ERROR_ANY) {
+      return s;
+    }
+    journal_slot[s].disk = disk;
+    journal_slot[s].n = n;
+    journal_slot[s].jblock = 0;
+  }
+  journal_slot[s].state = JS_STAGED;
+  lmemcpy(journal_slot_addr(s), lp(entry), lsizeof(struct SFS_ENTRY));
+
+  /* Commit now if not inside a transaction */
+  if(journal_depth == 0) {
+    return journal_commit(disk_to_index(disk));
+  }
+  return 0;
+}
+
+/*
+ * Drop staged entries of a failed transaction
+ * Entries committed before go back to their last committed copy.
+ * Free space accounting of the disks involved is rebuilt, since
+ * the failed operation could have allocated or freed space
+ */
+static void journal_abort()
+{
+  struct SFS_SUPERBLOCK sb;
+  uchar rebuild[MAX_DISK];
+  uint disk_index;
+  uint s;
+
+  memset(rebuild, 0, sizeof(rebuild));
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    struct JOURNAL_SLOT* js = &journal_slot[s];
+    if(js->state != JS_STAGED) {
+      continue;
+    }
+    disk_index = disk_to_index(js->disk);
+    rebuild[disk_index] = 1;
+    js->state = JS_FREE;
+    if(js->jblock && read_disk(js->disk,
+      journal_info[disk_index].start + js->jblock, 0,
+      sizeof(struct SFS_ENTRY), io_buff) == 0) {
+      lmemcpy(journal_slot_addr(s), lp(io_buff), lsizeof(struct SFS_ENTRY));
+      js->state = JS_LOGGED;
+    }
+    lz_invalidate(js->disk, js->n);
+  }
+
+  for(disk_index=0; disk_index<MAX_DISK; disk_index++) {
+    if(rebuild[disk_index]) {
+      debugstr("Journal: %x transaction dropped\n\r", index_to_disk(disk_index));
+      if(read_disk(index_to_disk(disk_index), 1, 0, sizeof(sb), (uchar*)&sb) == 0) {
+        usage_init(disk_index, &sb);
+      } else {
+        usage_release(disk_index);
+      }
+    }
+  }
+}
+
+/*
+ * Begin and end a transaction
+ * Transactions can be nested. Staged entries are committed
+ * when the outermost transaction ends, or dropped if it failed
+ */
+static void journal_begin()
+{
+  journal_depth++;
+}
+
+static uint journal_end(uint result)
+{
+  uint jresult;
+  journal_depth--;
+  if(journal_depth == 0) {
+    if(result >= ERROR_ANY) {
+      journal_abort();
+      return result;
+    }
+    jresult = journal_commit_all();
+    if(jresult >= ERROR_ANY) {
+      return jresult;
+    }
+  }
+  return result;
+}
+
+/*
+ * Forget journal state of a disk
+ * Cached entries are discarded
+ */
+static void journal_forget(uint disk_index)
+{
+  uint disk = index_to_disk(disk_index);
+  uint s;
+  for(s=0; s<JOURNAL_CACHE_SIZE; s++) {
+    if(journal_slot[s].disk == disk) {
+      journal_slot[s].state = JS_FREE;
+    }
+  }
+  memset((uchar*)&journal_info[disk_index], 0, sizeof(struct JOURNAL_INFO));
+}
+
+/*
+ * Mount journal of a disk given its superblock
+ * Replays committed transactions, if any
+ */
+static uint journal_mount(uint disk_index, struct SFS_SUPERBLOCK* sb)
+{
+  uchar buff[BLOCK_SIZE];
+  struct SFS_JHEADER* jh = (struct SFS_JHEADER*)buff;
+  struct JOURNAL_INFO* ji = &journal_info[disk_index];
+  uint disk = index_to_disk(disk_index);
+  uint replayed = 0;
+  uint result;
+
+  journal_forget(disk_index);
+
+  /* No journal or too small to be used */
+  if(sb->journalstart == 0 || sb->journalsize < JOURNAL_CACHE_SIZE + 3) {
+    return 0;
+  }
+
+  /* Allocate cache the first time */
+  if(journal_cache == 0) {
+    journal_cache = hma_alloc((ul_t)JOURNAL_CACHE_SIZE*(ul_t)sizeof(struct SFS_ENTRY));
+    if(journal_cache == 0) {
+      debugstr("Journal: not enough memory\n\r");
+      return ERROR_NO_SPACE;
+    }
+  }
+
+  ji->start = (uint)sb->journalstart;
+  ji->size = (uint)sb->journalsize;
+  ji->pos = 1;
+
+  /* Read header. Initialize journal if it's not valid */
+  result = read_disk(disk, ji->start, 0, BLOCK_SIZE, buff);
+  if(result != 0) {
+    return ERROR_IO;
+  }
+  if(jh->type != SFS_JHEADER_ID) {
+    ji->sequence = 1;
+    memset(buff, 0, sizeof(buff));
+    result = write_disk(disk, ji->start + 1, 0, BLOCK_SIZE, buff);
+    if(result != 0) {
+      return ERROR_IO;
+    }
+    result = journal_write_header(disk_index);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    ji->enabled = 1;
+    return 0;
+  }
+  ji->sequence = jh->sequence;
+
+  /* Replay valid transactions */
+  while(ji->pos + 2 <= ji->size) {
+    struct SFS_JDESC* jd = (struct SFS_JDESC*)buff;
+    struct SFS_JCOMMIT jc;
+    uint jblock;
+    uint limit;
+    uint count;
+    uint run;
+    uint i;
+
+    /* Check descriptor */
+    result = read_disk(disk, ji->start + ji->pos, 0, BLOCK_SIZE, buff);
+    if(result != 0) {
+      return ERROR_IO;
+    }
+    if(jd->type != SFS_JDESC_ID || jd->sequence != ji->sequence ||
+      jd->count > SFS_JDESCREFS || ji->pos + jd->count + 2 > ji->size) {
+      break;
+    }
+    count = (uint)jd->count;
+
+    /* Check commit */
+    result = read_disk(disk, ji->start + ji->pos + count + 1, 0, sizeof(jc), (uchar*)&jc);
+    if(result != 0) {
+      return ERROR_IO;
+    }
+    if(jc.type != SFS_JCOMMIT_ID || jc.sequence != ji->sequence) {
+      break;
+    }
+
+    /* Write logged entries to the entries table.
+     * They are sorted by index, so merge contiguous ones */
+    for(i=0; i<count; i+=run) {
+      jblock = ji->start + ji->pos + 1 + i;
+      limit = min(IO_MERGE_BLOCKS, io_track_blocks(disk, jblock));
+      for(run=1; i+run<count && run<limit &&
+        jd->ref[i+run] == jd->ref[i]+run; run++) {
+      }
+      result = read_disk(disk, jblock, 0, run*BLOCK_SIZE, io_buff);
+      if(result != 0) {
+        return ERROR_IO;
+      }
+      result = write_entries_home(io_buff, disk, (uint)jd->ref[i], run);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+      io_account(run);
+    }
+
+    ji->pos += count + 2;
+    ji->sequence++;
+    replayed++;
+  }
+
+  /* Journal is now empty */
+  ji->pos = 1;
+  if(replayed) {
+    debugstr("Journal: %x replayed %u transactions\n\r", disk, replayed);
+    result = journal_write_header(disk_index);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+  ji->enabled = 1;
+
+  return 0;
+}
+
+/*
+ * Sync file systems
+ */
+uint fs_sync()
+{
+  uint disk_index;
+  uint result = journal_commit_all();
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  for(disk_index=0; disk_index<MAX_DISK; disk_index++) {
+    result = journal_checkpoint(disk_index);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Return 1 if a block of a disk must be copied to memory
+ * in boot to RAM mode: boot block, superblock, used entries
+ * and used data blocks. The journal is not copied
+ */
+static uint bootram_needed_block(struct FS_USAGE* u, uint block)
+{
+  if(block < 2) {
+    return 1;
+  }
+  if(block - 2 < u->nentries) {
+    return bitmap_get(u->entry_map, block - 2);
+  }
+  if(block < u->first_data) {
+    return 0;
+  }
+  return bitmap_get(u->block_map, block);
+}
+
+/*
+ * Release boot to RAM memory
+ */
+static void bootram_release()
+{
+  uint disk_index = disk_to_index(bootram.disk);
+  uint volatile_mode = bootram.map && bootram.mode == BOOTRAM_VOLATILE;
+
+  if(bootram.map) {
+    lmem_free(bootram.map);
+  }
+  if(bootram.data) {
+    lmem_free(bootram.data);
+  }
+  memset((uchar*)&bootram, 0, sizeof(bootram));
+
+  /* Changes in volatile mode are lost. Reload disk info */
+  if(volatile_mode) {
+    usage_release(disk_index);
+    fs_init_info();
+  }
+}
+
+/*
+ * Set boot to RAM mode
+ */
+uint fs_set_bootram(uint mode)
+{
+  uint disk_index = disk_to_index(system_disk);
+  struct FS_USAGE* u = &fs_usage[disk_index];
+  uint count = 0;
+  uint spare, min_spare;
+  uint b, n, run, limit;
+  uint result;
+
+  /* Write pending updates, so disk and memory copy are the same */
+  fs_sync();
+  bootram_release();
+
+  if(mode == BOOTRAM_DISABLED) {
+    return 0;
+  }
+  if(disk_index >= MAX_DISK || !u->valid) {
+    return ERROR_NOT_FOUND;
+  }
+
+  /* Count needed blocks */
+  for(b=0; b<u->nblocks; b++) {
+    count += bootram_needed_block(u, b);
+  }
+
+  /* Allocate map and slots. Leave as many free slots for blocks
+   * written later as fit in memory, up to the free blocks of the disk.
+   * In volatile mode written blocks can't go anywhere else,
+   * so it's refused if there is not room for some of them */
+  min_spare = mode == BOOTRAM_VOLATILE ?
+    min(u->free_blocks, BOOTRAM_MIN_EXTRA) : 0;
+  spare = min(u->free_blocks, BOOTRAM_EXTRA_BLOCKS);
+  bootram.map = lmem_alloc((ul_t)u->nblocks * 2L);
+  while(1) {
+    bootram.nslots = count + spare;
+    bootram.data = lmem_alloc((ul_t)bootram.nslots * (ul_t)BLOCK_SIZE);
+    if(bootram.data != 0 || spare <= min_spare) {
+      break;
+    }
+    spare = max(spare / 2, min_spare);
+  }
+  if(bootram.map == 0 || bootram.data == 0) {
+    debugstr("Boot to RAM: not enough memory (%u+%u blocks)\n\r",
+      count, spare);
+    bootram_release();
+    return ERROR_NO_SPACE;
+  }
+
+  bootram.disk = system_disk;
+  bootram.nblocks = u->nblocks;
+  for(b=0; b<bootram.nblocks; b++) {
+    bootram_set_slot(b, 0);
+  }
+
+  /* Copy blocks. Contiguous blocks are read at once, without
+   * crossing a track boundary */
+  b = 0;
+  while(b < bootram.nblocks) {
+    if(!bootram_needed_block(u, b)) {
+      b++;
+      continue;
+    }
+
+    limit = min(IO_MERGE_BLOCKS, io_track_blocks(system_disk, b));
+    run = 1;
+    while(run < limit && b+run < bootram.nblocks &&
+      bootram_needed_block(u, b+run)) {
+      run++;
+    }
+
+    result = read_disk(system_disk, b, 0, run*BLOCK_SIZE, io_buff);
+    if(result != 0) {
+      bootram_release();
+      return ERROR_IO;
+    }
+    io_account(run);
+
+    lmemcpy(bootram_addr(bootram.used+1), lp(io_buff), (ul_t)run*(ul_t)BLOCK_SIZE);
+    for(n=0; n<run; n++) {
+      bootram_set_slot(b+n, ++bootram.used);
+    }
+    b += run;
+  }
+
+  bootram.mode = mode;
+  debugstr("Boot to RAM: %x %u blocks copied, %u free slots\n\r",
+    system_disk, bootram.used, bootram.nslots - bootram.used);
+  io_report(system_disk);
+
+  return bootram.used;
+}
+
+/*
+ * Get boot profile info
+ */
+uint fs_bootpf_get(struct BOOTPF_INFO* info)
+{
+  memset((uchar*)info, 0, sizeof(struct BOOTPF_INFO));
+  if(fs_read_file((uchar*)info, BOOTPF_FILE, 0, sizeof(struct BOOTPF_INFO)) !=
+      sizeof(struct BOOTPF_INFO) ||
+    (info->state != BOOTPF_RECORD && info->state != BOOTPF_ENABLED) ||
+    info->nblocks > BOOTPF_MAX_BLOCKS) {
+    memset((uchar*)info, 0, sizeof(struct BOOTPF_INFO));
+    info->state = BOOTPF_DISABLED;
+  }
+  return info->state;
+}
+
+/*
+ * Set boot profile state
+ */
+uint fs_bootpf_set(uint state)
+{
+  struct BOOTPF_INFO info;
+  uint result;
+
+  if(state == BOOTPF_DISABLED) {
+    if(fs_bootpf_get(&info) != BOOTPF_DISABLED) {
+      return fs_delete(BOOTPF_FILE);
+    }
+    return 0;
+  }
+  if(state != BOOTPF_RECORD) {
+    return ERROR_NOT_FOUND;
+  }
+
+  memset((uchar*)&info, 0, sizeof(info));
+  info.state = BOOTPF_RECORD;
+  result = fs_write_file((uchar*)&info, BOOTPF_FILE, 0, sizeof(info), WF_CREATE | WF_TRUNCATE);
+  return result >= ERROR_ANY ? result : 0;
+}
+
+/*
+ * Begin recording boot profile
+ */
+void fs_bootpf_begin()
+{
+  memset((uchar*)&bootpf, 0, sizeof(bootpf));
+  bootpf.recording = 1;
+  bootpf.start_ms = system_timer_ms;
+}
+
+/*
+ * Read a run of entire blocks to far memory below 1MB,
+ * and add them to the extended memory cache
+ * Returns 0 on success, another value otherwise
+ */
+static uint bootpf_read_far(uint block, uint count, lp_t buff)
+{
+  uint disk_index = disk_to_index(system_disk);
+  uint spb = BLOCK_SIZE >= SECTOR_SIZE ? BLOCK_SIZE / SECTOR_SIZE : 1;
+  uint n;
+
+  /* DMA transfers can't cross a 64KB boundary */
+  if((buff & 0xFFFFL) + (ul_t)count * (ul_t)BLOCK_SIZE > 0x10000L ||
+    read_disk_sector_far(system_disk, block * spb, count * spb, buff)) {
+    return 1;
+  }
+  for(n=0; n<count; n++) {
+    xcache_put(disk_index, block + n, buff + (lp_t)n * (lp_t)BLOCK_SIZE);
+  }
+  return 0;
+}
+
+/*
+ * Start boot profile
+ */
+uint fs_bootpf_start(struct BOOTPF_INFO* info)
+{
+  uint disk_index = disk_to_index(system_disk);
+  uint count = 0;
+  uint track = 0;
+  lp_t tbuff = 0;
+  uint i, b, run, limit;
+
+  /* Recording began before disks were mounted.
+   * Keep recording only if the profile must be recorded */
+  bootpf.recording = 0;
+  if(fs_bootpf_get(info) == BOOTPF_RECORD) {
+    bootpf.recording = 1;
+    debugstr("Boot profile: recording (%u blocks read before)\n\r",
+      bootpf.nblocks);
+    return BOOTPF_RECORD;
+  }
+  bootpf.nblocks = 0;
+
+  if(info->state != BOOTPF_ENABLED || info->nblocks == 0) {
+    return info->state;
+  }
+  if(xcache.nslots == 0) {
+    debugstr("Boot profile: no cache to prefetch blocks\n\r");
+    return BOOTPF_DISABLED;
+  }
+  if(fs_read_file((uchar*)bootpf.block, BOOTPF_FILE, sizeof(struct BOOTPF_INFO),
+    info->nblocks * sizeof(uint)) != info->nblocks * sizeof(uint)) {
+    return BOOTPF_DISABLED;
+  }
+
+  /* Get a far buffer for a whole track. If there is no
+   * memory for it, use the io buffer */
+  if(disk_index < MAX_DISK && !disk_info[disk_index].ram) {
+    track = disk_info[disk_index].sectors /
+      (BLOCK_SIZE >= SECTOR_SIZE ? BLOCK_SIZE / SECTOR_SIZE : 1);
+  }
+  if(track > IO_MERGE_BLOCKS) {
+    tbuff = lmem_alloc((ul_t)track * (ul_t)BLOCK_SIZE);
+  }
+  if(tbuff == 0) {
+    track = IO_MERGE_BLOCKS;
+  }
+
+  /* Read blocks sorted. Contiguous blocks are read at once,
+   * up to a whole track, without crossing a track boundary.
+   * Repeated blocks are skipped */
+  io_sort(bootpf.block, 0, info->nblocks);
+  i = 0;
+  while(i < info->nblocks) {
+    b = bootpf.block[i];
+    limit = min(track, io_track_blocks(system_disk, b));
+    run = 1;
+    i++;
+    while(i < info->nblocks && (bootpf.block[i] < b+run ||
+      (bootpf.block[i] == b+run && run < limit))) {
+      if(bootpf.block[i] == b+run) {
+        run++;
+      }
+      i++;
+    }
+
+    /* If the far read fails (a DMA boundary, for example)
+     * read the run through the io buffer */
+    if(tbuff && bootpf_read_far(b, run, tbuff) == 0) {
+      io_account(run);
+      count += run;
+      continue;
+    }
+    while(run) {
+      limit = min(run, IO_MERGE_BLOCKS);
+      if(read_disk(system_disk, b, 0, limit*BLOCK_SIZE, io_buff) == 0) {
+        io_account(limit);
+        count += limit;
+      }
+      b += limit;
+      run -= limit;
+    }
+  }
+
+  if(tbuff) {
+    lmem_free(tbuff);
   }
+  debugstr("Boot profile: %u blocks prefetched\n\r", count);
+  io_report(system_disk);
+  return BOOTPF_ENABLED;
+}
 
-  if(result != 0) {
-    debugstr("Write disk error (%x)\n\r", result);
+/*
+ * Stop boot profile recording, and save it
+ */
+uint fs_bootpf_stop(struct BOOTPF_INFO* info, ul_t boot_ms)
+{
+  uint result;
+
+  if(!bootpf.recording) {
+    return 0;
+  }
+  bootpf.recording = 0;
+
+  memset((uchar*)info, 0, sizeof(struct BOOTPF_INFO));
+  info->state = BOOTPF_ENABLED;
+  info->nblocks = bootpf.nblocks;
+  info->boot_ms = boot_ms;
+
+  result = fs_write_file((uchar*)info, BOOTPF_FILE, 0, sizeof(struct BOOTPF_INFO),
+    WF_CREATE | WF_TRUNCATE);
+  if(result < ERROR_ANY && bootpf.nblocks) {
+    result = fs_write_file((uchar*)bootpf.block, BOOTPF_FILE, sizeof(struct BOOTPF_INFO),
+      bootpf.nblocks * sizeof(uint), 0);
+  }
+  if(result >= ERROR_ANY) {
+    return result;
   }
 
-  return result;
+  debugstr("Boot profile: %u blocks recorded in %Ums\n\r", bootpf.nblocks, boot_ms);
+  return bootpf.nblocks;
 }
 
 /*
@@ -306,9 +2177,10 @@ uint fs_get_info(uint disk_index, struct FS_INFO* info)
   }
 
   /* Count avaliable disks (n) and return index of avaliable disks
-   * number disk_index (j) */
+   * number disk_index (j). Disks not accessed yet are probed */
   n = 0;
   for(i=0; i<MAX_DISK; i++) {
+    disk_probe(i);
     if(disk_info[i].size != 0) {
       if(n == disk_index) {
         j = i;
@@ -319,45 +2191,121 @@ uint fs_get_info(uint disk_index, struct FS_INFO* info)
 
   /* If found, fill info */
   if(j != 0xFFFF) {
-    info->id = index_to_disk(i);
+    info->id = index_to_disk(j);
     strcpy_s(info->name, disk_to_string(info->id), sizeof(info->name));
-    info->fs_type = disk_info[i].fstype;
-    info->fs_size = blocks_to_MB(disk_info[i].fssize);
-    info->disk_size = disk_info[i].size;
+    info->fs_type = disk_info[j].fstype;
+    info->fs_size = blocks_to_MB(disk_info[j].fssize);
+    info->disk_size = disk_info[j].size;
+
+    /* Free space comes from accounting, no disk access needed */
+    info->fs_free = ((ul_t)fs_usage[j].free_blocks*(ul_t)BLOCK_SIZE)/1024L;
+    info->fs_largest_free = ((ul_t)usage_largest_run(j)*(ul_t)BLOCK_SIZE)/1024L;
+    info->free_entries = fs_usage[j].free_entries;
   }
 
   return n;
 }
 
+/*
+ * Mount a disk: read superblock and fill disk info
+ */
+static void disk_mount(uint disk_index)
+{
+  uint result = 0;
+
+  debugstr("Check filesystem in %x: ", index_to_disk(disk_index));
+
+  /* Write pending updates before reading the disk again */
+  if(journal_commit(disk_index) < ERROR_ANY) {
+    journal_checkpoint(disk_index);
+  }
+
+  /* If hardware related disk info is valid */
+  if(disk_info[disk_index].size != 0) {
+    /* Read superblock and check file system type and data */
+    struct SFS_SUPERBLOCK sb;
+    result = read_disk(index_to_disk(disk_index), 1, 0, sizeof(sb), (uchar*)&sb);
+    if(result == 0 && sb.type == SFS_TYPE_ID) {
+      disk_info[disk_index].fstype = FS_TYPE_NSFS;
+      disk_info[disk_index].fssize = sb.size;
+      debugstr("NSFS\n\r");
+
+      /* Replay journal before reading any entry */
+      journal_mount(disk_index, &sb);
+
+      /* Build free space accounting if not already valid */
+      if(!fs_usage[disk_index].valid ||
+        fs_usage[disk_index].nblocks != (uint)min(sb.size, (uint32_t)ERROR_ANY) ||
+        fs_usage[disk_index].nentries != (uint)min(sb.nentries, (uint32_t)ERROR_ANY)) {
+        usage_init(disk_index, &sb);
+      }
+      return;
+    }
+  }
+  disk_info[disk_index].fstype = FS_TYPE_UNKNOWN;
+  disk_info[disk_index].fssize = 0;
+  journal_forget(disk_index);
+  usage_release(disk_index);
+  debugstr("unknown\n\r");
+}
+
+/*
+ * Probe a disk the first time it's accessed:
+ * get hardware info from the BIOS and mount it.
+ * Results are kept in disk_info, even if the disk is missing,
+ * so each disk is only probed once
+ */
+static void disk_probe(uint disk_index)
+{
+  struct DISKINFO* info = &disk_info[disk_index];
+
+  if(disk_index >= MAX_DISK || info->probed) {
+    return;
+  }
+  info->probed = 1;
+
+  /* The RAM disk is created later, see config */
+  if(disk_index != RAMDISK_INDEX) {
+    if(get_disk_info(info->id, &info->sectors, &info->sides, &info->cylinders) == 0) {
+      info->size = ((ul_t)info->sectors * (ul_t)info->sides *
+        (ul_t)info->cylinders) / (1048576L / (ul_t)BLOCK_SIZE);
+      info->last_access = system_timer_ms;
+
+      debugstr("DISK (%x : size=%U MB sect_per_track=%d, sides=%d, cylinders=%d)\n\r",
+        info->id, info->size, info->sectors, info->sides, info->cylinders);
+    } else {
+      /* Failed. Do not use this disk */
+      info->sectors = 0;
+      info->sides = 0;
+      info->cylinders = 0;
+      info->size = 0;
+      info->last_access = 0;
+    }
+  }
+
+  disk_mount(disk_index);
+}
+
 /*
  * Init file system info
- * Reads superblock and fills disk info
+ * Mounts again probed disks, and probes the system disk
  */
 void fs_init_info()
 {
-  uint result = 0;
   uint disk_index = 0;
 
-  /* For each disk */
+  lz_invalidate(UNKNOWN_VALUE, 0);
+
+  /* Disks could have been replaced */
+  xcache_invalidate(UNKNOWN_VALUE);
+
+  /* Other disks are probed when accessed */
   for(disk_index=0; disk_index<MAX_DISK; disk_index++) {
-    debugstr("Check filesystem in %x: ", index_to_disk(disk_index));
-
-    /* If hardware related disk info is valid */
-    if(disk_info[disk_index].size != 0) {
-      /* Read superblock and check file system type and data */
-      struct SFS_SUPERBLOCK sb;
-      result = read_disk(index_to_disk(disk_index), 1, 0, sizeof(sb), &sb);
-      if(result == 0 && sb.type == SFS_TYPE_ID) {
-        disk_info[disk_index].fstype = FS_TYPE_NSFS;
-        disk_info[disk_index].fssize = sb.size;
-        debugstr("NSFS\n\r");
-        continue;
-      }
+    if(disk_info[disk_index].probed) {
+      disk_mount(disk_index);
     }
-    disk_info[disk_index].fstype = FS_TYPE_UNKNOWN;
-    disk_info[disk_index].fssize = 0;
-    debugstr("unknown\n\r");
   }
+  disk_probe(disk_to_index(system_disk));
 }
 
 /*
@@ -430,7 +2378,7 @@ static uint path_parse_disk_parent_name(uchar** name, uint* parent, uint* disk,
     }
     /* Check entry exists */
     if(*tok && *nexttok) {
-      *parent = fs_get_entry(&entry, tok, *parent, *disk);
+      *parent = find_entry(&entry, tok, *parent, *disk);
       if(*parent >= ERROR_ANY) {
         return *parent;
       }
@@ -454,9 +2402,18 @@ static uint get_entry_n(struct SFS_ENTRY* entry, uint disk, uint n)
   uint32_t offset = ((uint32_t)n *
     (uint32_t)sizeof(struct SFS_ENTRY)) % (uint32_t)BLOCK_SIZE;
 
+  uint result;
+
+  /* Entries modified but not yet checkpointed are in the journal cache */
+  uint s = journal_find(disk, n);
+  if(s != ERROR_NOT_FOUND) {
+    lmemcpy(lp(entry), journal_slot_addr(s), lsizeof(struct SFS_ENTRY));
+    return n;
+  }
+
   /* Read and return */
-  uint result = read_disk(disk, (uint)block, (uint)offset,
-    sizeof(struct SFS_ENTRY), entry);
+  result = read_disk(disk, (uint)block, (uint)offset,
+    sizeof(struct SFS_ENTRY), (uchar*)entry);
 
   return result != 0 ? ERROR_IO : n;
 }
@@ -464,9 +2421,10 @@ static uint get_entry_n(struct SFS_ENTRY* entry, uint disk, uint n)
 /*
  * Get an entry given a path, parent and disk
  */
-uint fs_get_entry(struct SFS_ENTRY* entry, uchar* path, uint parent, uint disk)
+static uint find_entry(struct SFS_ENTRY* entry, uchar* path, uint parent, uint disk)
 {
   struct SFS_SUPERBLOCK sb;
+  struct FS_USAGE* u;
   uint n = 0;
   uint result;
   uchar* name;
@@ -497,13 +2455,19 @@ uint fs_get_entry(struct SFS_ENTRY* entry, uchar* path, uint parent, uint disk)
   }
 
   /* Read superblock */
-  result = read_disk(disk, 1, 0, sizeof(sb), &sb);
+  result = read_disk(disk, 1, 0, sizeof(sb), (uchar*)&sb);
   if(result != 0) {
     return ERROR_IO;
   }
 
-  /* Check all entries */
+  /* Check all entries. Free entries are skipped without
+   * reading them if accounting is valid */
+  u = &fs_usage[disk_to_index(disk)];
   while(n < sb.nentries) {
+    if(u->valid && n < u->nentries && !bitmap_get(u->entry_map, n)) {
+      n++;
+      continue;
+    }
     result = get_entry_n(entry, disk, n);
     if(result >= ERROR_ANY) {
       return result;
@@ -533,16 +2497,17 @@ static uint get_nref_entry_from_entry(struct SFS_ENTRY* outentry,
 {
   /* Initialize return entry information to the first entry */
   uint result = nentry;
-  memcpy(outentry, entry, sizeof(struct SFS_ENTRY));
+  memcpy((uchar*)outentry, (uchar*)entry, sizeof(struct SFS_ENTRY));
 
   /* While reference index exceeds number of references in an entry */
-  while((nref = nref / SFS_ENTRYREFS) > 0) {
+  while(nref >= SFS_ENTRYREFS) {
     if(outentry->next) {
       /* Advance tot he next chained entry */
       result = get_entry_n(outentry, disk, (uint)outentry->next);
       if(result >= ERROR_ANY) {
         return result;
       }
+      nref -= SFS_ENTRYREFS;
     } else {
       return ERROR_NOT_FOUND;
     }
@@ -551,50 +2516,282 @@ static uint get_nref_entry_from_entry(struct SFS_ENTRY* outentry,
 }
 
 /*
- * Read file in buff, given path, offset and count
+ * Read stored data of a file in buff, given its head entry,
+ * offset and count. Data is read as is, even if it's compressed
+ * Returns number of read bytes or an error code
  */
-uint fs_read_file(uchar* buff, uchar* path, uint offset, uint count)
+static uint read_stored(uchar* buff, struct SFS_ENTRY* head, uint disk,
+  uint nentry, uint offset, uint count)
 {
   struct SFS_ENTRY entry;
-  uint nentry;
   uint result = 0;
   uint read = 0;
   uint block;
+  uint limit;
+  uint size;
+  uint run;
+
+  /* Compute initial block and offset */
+  offset = min(offset, head->size);
+  count = min(count, head->size - offset);
+  block = offset / BLOCK_SIZE;
+  offset = offset % BLOCK_SIZE;
+
+  /* Get chained entry for initial reference index number */
+  nentry = get_nref_entry_from_entry(&entry, head, disk, nentry, block);
+  if(nentry >= ERROR_ANY) {
+    return nentry;
+  }
+  block = block % SFS_ENTRYREFS;
 
-  /* Find entry */
-  uint disk = path_get_disk(path);
-  nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
-  if(nentry < ERROR_ANY && (entry.flags & T_FILE)) {
-    /* Compute initial block and offset */
-    offset = min(offset, entry.size);
-    count = min(count, entry.size - offset);
-    block = offset / BLOCK_SIZE;
-    offset = offset % BLOCK_SIZE;
-    while(read < count) {
-      /* Get chained entry for a given reference index number */
-      nentry = get_nref_entry_from_entry(&entry, &entry, disk, nentry, block);
+  while(read < count) {
+    /* Advance to next chained entry when needed */
+    if(block >= SFS_ENTRYREFS) {
+      if(entry.next == 0) {
+        return ERROR_NOT_FOUND;
+      }
+      nentry = get_entry_n(&entry, disk, (uint)entry.next);
       if(nentry >= ERROR_ANY) {
         return nentry;
       }
-      block = block % SFS_ENTRYREFS;
+      block = 0;
+    }
 
-      /* Read in buffer */
-      result = read_disk(disk, (uint)entry.ref[block % SFS_ENTRYREFS], offset,
-        min(BLOCK_SIZE-offset, count-read), &(buff[read]), disk);
+    /* Merge contiguous data blocks in a single read */
+    limit = io_track_blocks(disk, (uint)entry.ref[block]);
+    size = min(BLOCK_SIZE - offset, count - read);
+    for(run=1; run<limit && block+run<SFS_ENTRYREFS && read+size<count &&
+      entry.ref[block+run] == entry.ref[block]+run; run++) {
+      size += min(BLOCK_SIZE, count - read - size);
+    }
 
-      if(result != 0) {
+    /* Read in buffer */
+    result = read_disk(disk, (uint)entry.ref[block], offset, size, &(buff[read]));
+    if(result != 0) {
+      return ERROR_IO;
+    }
+    io_account(run);
+
+    read += size;
+    block += run;
+    offset = 0;
+  }
+  return read;
+}
+
+/*
+ * Compressed files
+ *
+ * See fs.h for the on-disk format.
+ * The header of the last accessed compressed file and its last
+ * decompressed chunk are cached, so sequential reads smaller than
+ * a chunk only decompress each chunk once.
+ */
+struct LZ_CACHE {
+  uint  header_valid; /* lz_header is valid */
+  uint  chunk_valid;  /* lz_chunk is valid */
+  uint  disk;         /* Disk id of cached file */
+  uint  n;            /* Head entry index of cached file */
+  uint  chunk;        /* Index of cached chunk */
+  uint  chunk_size;   /* Size of cached chunk */
+};
+
+static struct LZ_CACHE lz_cache;
+static struct SFS_LZHEADER lz_header;
+static uchar lz_chunk[SFS_LZCHUNK];
+
+/*
+ * Invalidate cached data of a file, or all if disk is UNKNOWN_VALUE
+ */
+static void lz_invalidate(uint disk, uint n)
+{
+  if(disk == UNKNOWN_VALUE || (lz_cache.disk == disk && lz_cache.n == n)) {
+    lz_cache.header_valid = 0;
+    lz_cache.chunk_valid = 0;
+  }
+}
+
+/*
+ * Load header of a compressed file given its head entry
+ */
+static uint lz_load_header(struct SFS_ENTRY* head, uint disk, uint n)
+{
+  if(lz_cache.header_valid && lz_cache.disk == disk && lz_cache.n == n) {
+    return 0;
+  }
+
+  lz_invalidate(UNKNOWN_VALUE, 0);
+  if(head->size < sizeof(lz_header) ||
+    read_disk(disk, (uint)head->ref[0], 0, sizeof(lz_header), (uchar*)&lz_header)) {
+    return ERROR_IO;
+  }
+  if(lz_header.type != SFS_LZ_ID || lz_header.nchunks > SFS_LZCHUNKS ||
+    lz_header.size > lz_header.nchunks * SFS_LZCHUNK ||
+    lz_header.size > SFS_LZMAXSIZE || head->size > lz_header.size) {
+    debugstr("LZ: %x bad header in entry %u\n\r", disk, n);
+    return ERROR_IO;
+  }
+
+  lz_cache.disk = disk;
+  lz_cache.n = n;
+  lz_cache.header_valid = 1;
+  return 0;
+}
+
+/*
+ * Decompress an LZSS compressed chunk
+ * Returns decompressed size or ERROR_IO if data is not valid
+ */
+static uint lz_decompress(uchar* dst, uint dst_size, uchar* src, uint src_size)
+{
+  uint i = 0;
+  uint o = 0;
+  uint bit;
+  uchar flags;
+
+  while(i < src_size && o < dst_size) {
+    flags = src[i++];
+    for(bit=0; bit<8 && i<src_size && o<dst_size; bit++) {
+      if(flags & (1 << bit)) {
+        /* Literal byte */
+        dst[o++] = src[i++];
+      } else {
+        /* Match: copy previous output */
+        uint w;
+        uint dist;
+        uint len;
+        if(i + 1 >= src_size) {
+          return ERROR_IO;
+        }
+        w = src[i] | (src[i+1] << 8);
+        i += 2;
+        dist = (w & SFS_LZMAXDIST) + 1;
+        len = (w >> SFS_LZDISTBITS) + SFS_LZMINMATCH;
+        if(dist > o) {
+          return ERROR_IO;
+        }
+        while(len-- && o < dst_size) {
+          dst[o] = dst[o-dist];
+          o++;
+        }
+      }
+    }
+  }
+  return o;
+}
+
+/*
+ * Get original size of a file given its head entry
+ */
+static uint32_t lz_file_size(struct SFS_ENTRY* head, uint disk, uint n)
+{
+  if((head->flags & F_LZ) && lz_load_header(head, disk, n) < ERROR_ANY) {
+    return lz_header.size;
+  }
+  return head->size;
+}
+
+/*
+ * Read a compressed file in buff, given its head entry, offset and count
+ * Returns number of read bytes or an error code
+ */
+static uint read_lz(uchar* buff, struct SFS_ENTRY* head, uint disk,
+  uint nentry, uint offset, uint count)
+{
+  uint read = 0;
+  uint result;
+  uint chunk;
+  uint stored;
+  uint pos;
+  uint n;
+
+  result = lz_load_header(head, disk, nentry);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  offset = min(offset, lz_header.size);
+  count = min(count, lz_header.size - offset);
+
+  while(read < count) {
+    chunk = (offset + read) / SFS_LZCHUNK;
+    pos = (offset + read) % SFS_LZCHUNK;
+
+    /* Read and decompress chunk if it's not cached */
+    if(!lz_cache.chunk_valid || lz_cache.chunk != chunk) {
+      lz_cache.chunk_valid = 0;
+      lz_cache.chunk = chunk;
+      lz_cache.chunk_size = (uint)min((uint32_t)SFS_LZCHUNK,
+        lz_header.size - (uint32_t)chunk*SFS_LZCHUNK);
+      if(chunk + 1 < (uint)lz_header.nchunks) {
+        stored = (uint)(lz_header.offset[chunk+1] - lz_header.offset[chunk]);
+      } else {
+        stored = (uint)(head->size - lz_header.offset[chunk]);
+      }
+      if(stored > lz_cache.chunk_size) {
         return ERROR_IO;
       }
 
-      read += min(BLOCK_SIZE - offset, count);
-      block++;
-      offset = 0;
+      /* Chunks which can't be compressed are stored as is */
+      if(stored == lz_cache.chunk_size) {
+        result = read_stored(lz_chunk, head, disk, nentry,
+          (uint)lz_header.offset[chunk], stored);
+      } else {
+        result = read_stored(io_buff, head, disk, nentry,
+          (uint)lz_header.offset[chunk], stored);
+        if(result == stored) {
+          result = lz_decompress(lz_chunk, lz_cache.chunk_size, io_buff, stored);
+          stored = lz_cache.chunk_size;
+        }
+      }
+      if(result != stored) {
+        return ERROR_IO;
+      }
+      lz_cache.chunk_valid = 1;
     }
-    result = read;
-  } else {
-    result = nentry;
+
+    /* Copy requested bytes */
+    n = min(lz_cache.chunk_size - pos, count - read);
+    memcpy(&buff[read], &lz_chunk[pos], n);
+    read += n;
   }
-  return result;
+  return read;
+}
+
+/*
+ * Read file in buff, given path, offset and count
+ */
+uint fs_read_file(uchar* buff, uchar* path, uint offset, uint count)
+{
+  struct SFS_ENTRY entry;
+  uint nentry;
+
+  /* Find entry */
+  uint disk = path_get_disk(path);
+  nentry = find_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  if(nentry < ERROR_ANY && (entry.flags & T_FILE)) {
+    if(entry.flags & F_LZ) {
+      return read_lz(buff, &entry, disk, nentry, offset, count);
+    }
+    return read_stored(buff, &entry, disk, nentry, offset, count);
+  }
+  return nentry;
+}
+
+/*
+ * Get an entry given a path, parent and disk
+ * The size of compressed files is their original size
+ */
+uint fs_get_entry(struct SFS_ENTRY* entry, uchar* path, uint parent, uint disk)
+{
+  uint n = find_entry(entry, path, parent, disk);
+  if(n < ERROR_ANY && (entry->flags & F_LZ)) {
+    if(disk == UNKNOWN_VALUE) {
+      disk = path_get_disk(path);
+    }
+    entry->size = lz_file_size(entry, disk, n);
+  }
+  return n;
 }
 
 /*
@@ -602,18 +2799,22 @@ uint fs_read_file(uchar* buff, uchar* path, uint offset, uint count)
  */
 static uint write_entry(struct SFS_ENTRY* entry, uint disk, uint n)
 {
-  /* Compute block number and offset */
-  uint32_t block = 2L +
-    ((uint32_t)n*(uint32_t)sizeof(struct SFS_ENTRY))/(uint32_t)BLOCK_SIZE;
+  uint result;
 
-  uint32_t offset = ((uint32_t)n *
-    (uint32_t)sizeof(struct SFS_ENTRY)) % (uint32_t)BLOCK_SIZE;
+  /* Use journal if enabled, otherwise write directly */
+  uint index = disk_to_index(disk);
+  if(index < MAX_DISK && journal_info[index].enabled) {
+    result = journal_stage(entry, disk, n);
+  } else {
+    result = write_entry_home(entry, disk, n);
+  }
 
-  /* Write and return */
-  uint result = write_disk(disk, (uint)block, (uint)offset,
-    sizeof(struct SFS_ENTRY), (uchar*)entry);
+  if(result < ERROR_ANY) {
+    usage_mark_entry(disk, n, entry->flags & F_USED);
+  }
+  lz_invalidate(disk, n);
 
-  return result != 0 ? ERROR_IO : 0;
+  return result;
 }
 
 /*
@@ -655,9 +2856,17 @@ static uint find_free_entry(uint disk)
   struct SFS_SUPERBLOCK sb;
   struct SFS_ENTRY entry;
   uint n = 0;
+  uint result;
+
+  /* Use accounting if available */
+  uint index = disk_to_index(disk);
+  if(index < MAX_DISK && fs_usage[index].valid) {
+    return bitmap_find_clear(fs_usage[index].entry_map, 0,
+      fs_usage[index].nentries);
+  }
 
   /* Read super block */
-  uint result = read_disk(disk, 1, 0, sizeof(sb), &sb);
+  result = read_disk(disk, 1, 0, sizeof(sb), (uchar*)&sb);
   if(result != 0) {
     return ERROR_IO;
   }
@@ -678,20 +2887,8 @@ static uint find_free_entry(uint disk)
 }
 
 /*
- * Get number of needed blocks to contain a given size (bytes)
- */
-static uint needed_blocks(uint size)
-{
-  uint nblocks = size / BLOCK_SIZE;
-  if(size % BLOCK_SIZE) {
-    nblocks++;
-  }
-  return nblocks;
-}
-
-/*
- * Find first free block at disk
- * Return its index or ERROR_NOT_FOUND
+ * Find first free block at disk and allocate it
+ * Return its index or ERROR_NO_SPACE
  */
 static uint find_free_block(uint disk)
 {
@@ -699,24 +2896,35 @@ static uint find_free_block(uint disk)
   struct SFS_ENTRY entry;
   uint free_block = 0;
   uint max_blocks;
-  uint first_data_block;
+  uint first_block;
   uint n = 0;
   uint b = 0;
   uint found = 0;
+  uint result;
+
+  /* Use accounting if available */
+  uint index = disk_to_index(disk);
+  if(index < MAX_DISK && fs_usage[index].valid) {
+    free_block = bitmap_find_clear(fs_usage[index].block_map,
+      fs_usage[index].first_data, fs_usage[index].nblocks);
+    if(free_block < ERROR_ANY) {
+      usage_mark_block(disk, free_block, 1);
+    }
+    return free_block;
+  }
 
   /* Read superblock */
-  uint result = read_disk(disk, 1, 0, sizeof(sb), (uchar*)&sb);
+  result = read_disk(disk, 1, 0, sizeof(sb), (uchar*)&sb);
   if(result != 0) {
     return ERROR_IO;
   }
 
   /* Compute first data block index */
-  first_data_block = 2L +
-    ((uint32_t)sb.nentries*(uint32_t)sizeof(struct SFS_ENTRY))/(uint32_t)BLOCK_SIZE;
+  first_block = first_data_block(&sb);
 
   /* For each possible block index */
   max_blocks = sb.size;
-  for(free_block=first_data_block; free_block<max_blocks; free_block++) {
+  for(free_block=first_block; free_block<max_blocks; free_block++) {
 
     /* Check if there is an entry referencing it */
     found = 0;
@@ -727,7 +2935,7 @@ static uint find_free_block(uint disk)
         return result;
       }
       if(entry.flags & T_FILE) {
-        for(b=0; b<min(needed_blocks((uint)entry.size), SFS_ENTRYREFS); b++) {
+        for(b=0; b<entry_block_refs(&entry); b++) {
           if(entry.ref[b] == free_block) {
             /* If there is, this block is not free */
             found = 1;
@@ -771,8 +2979,8 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
     return result;
   }
 
-  /* Advance to the last chained entry, create if needed */
-  while(nentries > 0) {
+  /* Advance to the last needed chained entry, create if needed */
+  while(nentries > 1) {
     if(entry.next) {
       nentry = get_entry_n(&entry, disk, (uint)entry.next);
       if(nentry >= ERROR_ANY) {
@@ -791,7 +2999,7 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
       nentry = entry.next;
       entry.next = 0;
       entry.size = 0;
-      memset(entry.ref, 0, sizeof(entry.ref));
+      memset((uchar*)entry.ref, 0, sizeof(entry.ref));
       result = write_entry(&entry, disk, nentry);
       if(result >= ERROR_ANY) {
         return result;
@@ -801,7 +3009,14 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
   }
 
   /* Set to 0 unused references of last chained entry */
-  for(i=refcount%SFS_ENTRYREFS; i<SFS_ENTRYREFS; i++) {
+  i = refcount % SFS_ENTRYREFS;
+  if(i == 0 && refcount > 0) {
+    i = SFS_ENTRYREFS;
+  }
+  for(; i<SFS_ENTRYREFS; i++) {
+    if((entry.flags & T_FILE) && entry.ref[i]) {
+      usage_mark_block(disk, (uint)entry.ref[i], 0);
+    }
     entry.ref[i] = 0;
   }
   result = write_entry(&entry, disk, nentry);
@@ -824,7 +3039,8 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
         return current;
       }
       next = entry.next;
-      memset(&entry, 0, sizeof(entry));
+      usage_free_entry_blocks(disk, &entry);
+      memset((uchar*)&entry, 0, sizeof(entry));
       result = write_entry(&entry, disk, current);
       if(result >= ERROR_ANY) {
         return result;
@@ -958,8 +3174,8 @@ static uint remove_ref_in_entry(uint disk, uint nentry, uint ref)
   if(result >= ERROR_ANY) {
     return result;
   }
-  memcpy(&currentry, &entry, sizeof(entry));
-  memcpy(&nextentry, &entry, sizeof(entry));
+  memcpy((uchar*)&currentry, (uchar*)&entry, sizeof(entry));
+  memcpy((uchar*)&nextentry, (uchar*)&entry, sizeof(entry));
 
   /* Get total number of references */
   refcount = get_entry_refcount(&entry);
@@ -985,7 +3201,7 @@ static uint remove_ref_in_entry(uint disk, uint nentry, uint ref)
           return result;
         }
       } else {
-        memset(&nextentry, 0, sizeof(nextentry));
+        memset((uchar*)&nextentry, 0, sizeof(nextentry));
       }
     }
 
@@ -1018,10 +3234,109 @@ static uint remove_ref_in_entry(uint disk, uint nentry, uint ref)
   return 0;
 }
 
+/*
+ * Clear compressed flag in all entries of a file chain
+ */
+static uint lz_clear_flag(uint disk, uint n)
+{
+  struct SFS_ENTRY entry;
+  uint result;
+
+  while(1) {
+    result = get_entry_n(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    entry.flags &= ~F_LZ;
+    result = write_entry(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    if(entry.next == 0) {
+      return 0;
+    }
+    n = (uint)entry.next;
+  }
+}
+
+/*
+ * Rewrite a compressed file uncompressed, given its head entry
+ * Data is written to new blocks first. Then references are replaced
+ * and compressed blocks released, so if the transaction fails,
+ * the compressed file is still valid.
+ * Reserving blocks needs accounting
+ */
+static uint lz_expand(struct SFS_ENTRY* head, uint disk, uint n)
+{
+  uint refs[(SFS_LZMAXSIZE + BLOCK_SIZE - 1) / BLOCK_SIZE];
+  uint index = disk_to_index(disk);
+  struct SFS_ENTRY entry;
+  uchar buff[BLOCK_SIZE];
+  uint result;
+  uint nblocks;
+  uint current;
+  uint size;
+  uint b;
+  uint i;
+
+  result = lz_load_header(head, disk, n);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  size = (uint)lz_header.size; /* At most SFS_LZMAXSIZE */
+  nblocks = needed_blocks(size);
+
+  if(index >= MAX_DISK || !fs_usage[index].valid ||
+    fs_usage[index].free_blocks < nblocks) {
+    return ERROR_NO_SPACE;
+  }
+
+  /* Write original data to new blocks */
+  for(i=0; i<nblocks; i++) {
+    memset(buff, 0, sizeof(buff));
+    result = read_lz(buff, head, disk, n, i*BLOCK_SIZE, sizeof(buff));
+    if(result == 0 || result >= ERROR_ANY) {
+      return ERROR_IO;
+    }
+    refs[i] = find_free_block(disk);
+    if(refs[i] >= ERROR_ANY) {
+      return refs[i];
+    }
+    if(write_disk(disk, refs[i], 0, sizeof(buff), buff)) {
+      return ERROR_IO;
+    }
+  }
+
+  /* Replace references in the chain */
+  result = set_entry_refcount(disk, n, nblocks);
+  current = n;
+  i = 0;
+  while(result < ERROR_ANY) {
+    result = get_entry_n(&entry, disk, current);
+    if(result >= ERROR_ANY) {
+      break;
+    }
+    usage_free_entry_blocks(disk, &entry);
+    entry.flags &= ~F_LZ;
+    entry.size = size - i*BLOCK_SIZE;
+    for(b=0; b<SFS_ENTRYREFS; b++) {
+      entry.ref[b] = i < nblocks ? refs[i++] : 0;
+    }
+    result = write_entry(&entry, disk, current);
+    if(entry.next == 0) {
+      break;
+    }
+    current = (uint)entry.next;
+  }
+
+  lz_invalidate(disk, n);
+  return result >= ERROR_ANY ? result : 0;
+}
+
 /*
  * Write buff to file given path, offset, count and flags
  */
-uint fs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags)
+static uint sfs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags)
 {
   uint disk;
   uint nentry;
@@ -1032,7 +3347,7 @@ uint fs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags
 
   /* Find file */
   disk = path_get_disk(path);
-  nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  nentry = find_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
 
   /* Does not exist and should not create or it's a directory: return */
   if((nentry == ERROR_NOT_FOUND && !(flags & WF_CREATE)) ||
@@ -1043,10 +3358,27 @@ uint fs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags
     return ERROR_NOT_FOUND;
   }
 
+  /* Compressed files are stored uncompressed once written.
+   * If the whole file is being replaced, old data is not needed */
+  if(nentry < ERROR_ANY && (entry.flags & F_LZ)) {
+    if(offset == 0 && (flags & WF_TRUNCATE)) {
+      result = lz_clear_flag(disk, nentry);
+    } else {
+      result = lz_expand(&entry, disk, nentry);
+    }
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = get_entry_n(&entry, disk, nentry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
   /* Create file if needed */
   if(nentry == ERROR_NOT_FOUND && (flags & WF_CREATE)) {
     uint parent = 0;
-    memset(&entry, 0, sizeof(entry));
+    memset((uchar*)&entry, 0, sizeof(entry));
 
     /* Parse parent, disk and name */
     result = path_parse_disk_parent_name(&path, &parent, &disk, path);
@@ -1178,6 +3510,16 @@ uint fs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags
   return written;
 }
 
+/*
+ * Write buff to file given path, offset, count and flags
+ * The whole operation is a single journal transaction
+ */
+uint fs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags)
+{
+  journal_begin();
+  return journal_end(sfs_write_file(buff, path, offset, count, flags));
+}
+
 /*
  * Delete entry by index
  * Deletes the full chain
@@ -1217,7 +3559,8 @@ static uint delete_n(uint disk, uint n)
     }
   }
 
-  memset(&entry, 0, sizeof(entry));
+  usage_free_entry_blocks(disk, &entry);
+  memset((uchar*)&entry, 0, sizeof(entry));
   result = write_entry(&entry, disk, n);
   if(result >= ERROR_ANY) {
     return result;
@@ -1226,8 +3569,39 @@ static uint delete_n(uint disk, uint n)
   return 0;
 }
 
+/*
+ * Delete entry by index, and its contents if it's a directory
+ * Each item is deleted in its own journal transaction
+ */
+static uint delete_tree(uint disk, uint n)
+{
+  struct SFS_ENTRY entry;
+  uint result;
+
+  /* Delete directory items first. Remaining
+   * references are packed, so take always the first one */
+  for(;;) {
+    result = get_entry_n(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    if(!(entry.flags & T_DIR) || entry.size == 0 || entry.ref[0] == 0) {
+      break;
+    }
+    result = delete_tree(disk, (uint)entry.ref[0]);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
+  journal_begin();
+  return journal_end(delete_n(disk, n));
+}
+
 /*
  * Delete entry by path
+ * Files are deleted in a single journal transaction,
+ * directories in a transaction per item
  */
 uint fs_delete(uchar* path)
 {
@@ -1237,9 +3611,9 @@ uint fs_delete(uchar* path)
 
   /* Find entry, and delete by index */
   disk = path_get_disk(path);
-  nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  nentry = find_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
   if(nentry < ERROR_ANY) {
-    nentry = delete_n(disk, nentry);
+    nentry = delete_tree(disk, nentry);
   }
 
   return nentry;
@@ -1248,7 +3622,7 @@ uint fs_delete(uchar* path)
 /*
  * Create a dirrectory
  */
-uint fs_create_directory(uchar* path)
+static uint sfs_create_directory(uchar* path)
 {
   struct SFS_ENTRY entry;
   uint disk = UNKNOWN_VALUE;
@@ -1265,7 +3639,7 @@ uint fs_create_directory(uchar* path)
   path = string_to_name(path);
 
   /* Check target does not exist */
-  result = fs_get_entry(&entry, path, parent, disk);
+  result = find_entry(&entry, path, parent, disk);
   if(result != ERROR_NOT_FOUND) {
     if(result >= ERROR_ANY) {
       return result;
@@ -1280,7 +3654,7 @@ uint fs_create_directory(uchar* path)
   }
 
   /* Create entry */
-  memset(&entry, 0, sizeof(entry));
+  memset((uchar*)&entry, 0, sizeof(entry));
   strcpy_s(entry.name, path, SFS_NAMESIZE);
   entry.size = 0;
   entry.flags = T_DIR;
@@ -1308,10 +3682,20 @@ uint fs_create_directory(uchar* path)
   return nentry;
 }
 
+/*
+ * Create a directory
+ * The whole operation is a single journal transaction
+ */
+uint fs_create_directory(uchar* path)
+{
+  journal_begin();
+  return journal_end(sfs_create_directory(path));
+}
+
 /*
  * Move entry
  */
-uint fs_move(uchar* srcpath, uchar* dstpath)
+static uint sfs_move(uchar* srcpath, uchar* dstpath)
 {
   uint result;
   uint dst_parent;
@@ -1331,7 +3715,7 @@ uint fs_move(uchar* srcpath, uchar* dstpath)
   dstname = string_to_name(dstname);
 
   /* Check destination does not exist */
-  result = fs_get_entry(&entry, dstname, dst_parent, dstdisk);
+  result = find_entry(&entry, dstname, dst_parent, dstdisk);
   if(result != ERROR_NOT_FOUND) {
     if(result >= ERROR_ANY) {
       return result;
@@ -1341,7 +3725,7 @@ uint fs_move(uchar* srcpath, uchar* dstpath)
 
   /* Check source exists */
   srcdisk = path_get_disk(srcpath);
-  nentry = fs_get_entry(&entry, srcpath, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  nentry = find_entry(&entry, srcpath, UNKNOWN_VALUE, UNKNOWN_VALUE);
   if(nentry >= ERROR_ANY) {
     return nentry;
   }
@@ -1352,7 +3736,7 @@ uint fs_move(uchar* srcpath, uchar* dstpath)
     if(result != 0) {
       return result;
     }
-    result = delete_n(srcdisk, nentry);
+    result = delete_tree(srcdisk, nentry);
     if(result >= ERROR_ANY) {
       return result;
     }
@@ -1382,8 +3766,24 @@ uint fs_move(uchar* srcpath, uchar* dstpath)
   return nentry;
 }
 
+/*
+ * Move entry
+ * Within a disk, the whole operation is a single journal transaction.
+ * Between disks, it's a copy and a delete, with their own transactions
+ */
+uint fs_move(uchar* srcpath, uchar* dstpath)
+{
+  if(path_get_disk(srcpath) != path_get_disk(dstpath)) {
+    return sfs_move(srcpath, dstpath);
+  }
+  journal_begin();
+  return journal_end(sfs_move(srcpath, dstpath));
+}
+
 /*
  * Copy entry
+ * Files are copied in a single journal transaction,
+ * directories in a transaction per item
  */
 uint fs_copy(uchar* srcpath, uchar* dstpath)
 {
@@ -1405,7 +3805,7 @@ uint fs_copy(uchar* srcpath, uchar* dstpath)
   dstname = string_to_name(dstname);
 
   /* Check destination does not exist */
-  result = fs_get_entry(&entry, dstname, dst_parent, dst_disk);
+  result = find_entry(&entry, dstname, dst_parent, dst_disk);
   if(result != ERROR_NOT_FOUND) {
     if(result >= ERROR_ANY) {
       return result;
@@ -1415,28 +3815,30 @@ uint fs_copy(uchar* srcpath, uchar* dstpath)
 
   /* Check source exists */
   src_disk = path_get_disk(srcpath);
-  nentry = fs_get_entry(&entry, srcpath, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  nentry = find_entry(&entry, srcpath, UNKNOWN_VALUE, UNKNOWN_VALUE);
   if(nentry >= ERROR_ANY) {
     return nentry;
   }
 
-  /* If source is a file, just read and write the full file */
+  /* If source is a file, just read and write the full file
+   * as a single journal transaction */
   if(entry.flags & T_FILE) {
     uint offset = 0;
     uint copied = 0;
     uchar buff[BLOCK_SIZE];
 
-    while(copied = fs_read_file(buff, srcpath, offset, sizeof(buff))) {
+    journal_begin();
+    while((copied = fs_read_file(buff, srcpath, offset, sizeof(buff))) != 0) {
       if(copied >= ERROR_ANY) {
-        return copied;
+        return journal_end(copied);
       }
       result = fs_write_file(buff, dstpath, offset, copied, WF_CREATE);
       if(result >= ERROR_ANY) {
-        return result;
+        return journal_end(result);
       }
       offset += copied;
     }
-    return 0;
+    return journal_end(0);
   }
   /* If source is a directory */
   else if(entry.flags & T_DIR) {
@@ -1489,8 +3891,8 @@ uint fs_list(struct SFS_ENTRY* entry, uchar* path, uint n)
 
   /* Find entry */
   disk = path_get_disk(path);
-  memset(entry, 0, sizeof(struct SFS_ENTRY));
-  nentry = fs_get_entry(&direntry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  memset((uchar*)entry, 0, sizeof(struct SFS_ENTRY));
+  nentry = find_entry(&direntry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
   if(nentry >= ERROR_ANY) {
     return nentry;
   }
@@ -1504,16 +3906,470 @@ uint fs_list(struct SFS_ENTRY* entry, uchar* path, uint n)
         return res;
       }
       /* Get the entry */
-      res = get_entry_n(entry, disk, (uint)direntry.ref[n]);
+      res = get_entry_n(entry, disk, (uint)direntry.ref[n % SFS_ENTRYREFS]);
       if(res >= ERROR_ANY) {
         return res;
       }
+      entry->size = lz_file_size(entry, disk, res);
     }
     return (uint)direntry.size;
   }
   return ERROR_NOT_FOUND;
 }
 
+/*
+ * List many entries in a directory
+ */
+uint fs_list_many(lp_t entries, uchar* path, uint first, uint count)
+{
+  uint nentry;
+  uint disk;
+  uint total;
+  uint chain_first = 0;
+  uint i = 0;
+  struct SFS_ENTRY direntry;
+  struct SFS_ENTRY entry;
+  struct FS_ENTRY o_entry;
+
+  /* Find entry */
+  disk = path_get_disk(path);
+  lmemset(entries, 0, (ul_t)count*lsizeof(struct FS_ENTRY));
+  nentry = find_entry(&direntry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  if(nentry >= ERROR_ANY) {
+    return nentry;
+  }
+
+  /* It must be a directory */
+  if(!(direntry.flags & T_DIR)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  /* Walk the chain only once, reading each listed entry */
+  total = (uint)direntry.size;
+  while(i < count && first + i < total) {
+    uint n = first + i;
+
+    /* Advance to the chained entry contaning the nth reference */
+    while(n - chain_first >= SFS_ENTRYREFS) {
+      if(direntry.next == 0) {
+        return ERROR_NOT_FOUND;
+      }
+      nentry = get_entry_n(&direntry, disk, (uint)direntry.next);
+      if(nentry >= ERROR_ANY) {
+        return nentry;
+      }
+      chain_first += SFS_ENTRYREFS;
+    }
+
+    /* Get the entry */
+    nentry = get_entry_n(&entry, disk, (uint)direntry.ref[n - chain_first]);
+    if(nentry >= ERROR_ANY) {
+      return nentry;
+    }
+    memset((uchar*)&o_entry, 0, sizeof(o_entry));
+    strcpy_s(o_entry.name, entry.name, sizeof(o_entry.name));
+    o_entry.flags = entry.flags;
+    o_entry.size = lz_file_size(&entry, disk, nentry);
+    o_entry.time = entry.time;
+    lmemcpy(entries + (lp_t)i*lsizeof(struct FS_ENTRY), lp(&o_entry),
+      lsizeof(struct FS_ENTRY));
+    i++;
+  }
+
+  return total;
+}
+
+/*
+ * Defragmentation
+ *
+ * Files are analyzed walking the references of their entry chains.
+ * A run is a set of contiguous data blocks, and an access is a single
+ * disk read as issued by fs_read_file (runs are split at chained entries
+ * and track boundaries).
+ * Fragmented files are relocated to a contiguous free blocks run:
+ * data is copied through a far memory staging buffer, and only then
+ * references are updated in a single journal transaction. Old blocks
+ * are not overwritten until references point to the new ones, so a
+ * failure at any point leaves a readable file.
+ */
+#define DEFRAG_STAGE_BLOCKS 32 /* Staging buffer size in blocks */
+
+/*
+ * Build a far memory bitmap of chained entries (those which are not
+ * the head entry of a file or directory)
+ * Returns the bitmap, to be freed with lmem_free, or 0
+ */
+static lp_t frag_chained_map(uint disk_index)
+{
+  struct FS_USAGE* u = &fs_usage[disk_index];
+  struct SFS_ENTRY entry;
+  uint disk = index_to_disk(disk_index);
+  lp_t map;
+  uint n;
+
+  map = lmem_alloc((ul_t)(u->nentries/8 + 1));
+  if(map == 0) {
+    return 0;
+  }
+  lmemset(map, 0, (ul_t)(u->nentries/8 + 1));
+
+  for(n=0; n<u->nentries; n++) {
+    if(!bitmap_get(u->entry_map, n)) {
+      continue;
+    }
+    if(get_entry_n(&entry, disk, n) >= ERROR_ANY) {
+      lmem_free(map);
+      return 0;
+    }
+    if(entry.next && entry.next < u->nentries) {
+      bitmap_set(map, (uint)entry.next, 1);
+    }
+  }
+  return map;
+}
+
+/*
+ * Analyze a file given its head entry
+ * Adds its blocks, runs and accesses to info
+ */
+static uint frag_analyze_file(uint disk, struct SFS_ENTRY* head, struct FS_FRAG_INFO* info)
+{
+  struct SFS_ENTRY entry;
+  uint prev = 0;
+  uint runs = 0;
+  uint limit = 0;
+  uint run = 0;
+  uint count;
+  uint b;
+
+  memcpy((uchar*)&entry, (uchar*)head, sizeof(entry));
+  while(1) {
+    count = entry_block_refs(&entry);
+    for(b=0; b<count; b++) {
+      /* New run */
+      if(prev == 0 || entry.ref[b] != prev + 1) {
+        runs++;
+      }
+      /* New access */
+      if(b == 0 || run >= limit || entry.ref[b] != prev + 1) {
+        limit = io_track_blocks(disk, (uint)entry.ref[b]);
+        run = 0;
+        info->accesses++;
+      }
+      run++;
+      prev = (uint)entry.ref[b];
+      info->blocks++;
+    }
+    if(entry.next == 0) {
+      break;
+    }
+    if(get_entry_n(&entry, disk, (uint)entry.next) >= ERROR_ANY) {
+      return ERROR_IO;
+    }
+  }
+
+  info->files++;
+  info->runs += runs;
+  if(runs > 1) {
+    info->fragmented++;
+  }
+  return runs;
+}
+
+/*
+ * Read a file given its head entry, as fs_read_file would do
+ * Blocks are read from disk, not from the extended memory cache
+ * or boot to RAM memory, so time depends on layout only.
+ * Data is discarded. Elapsed time is added to ms
+ */
+static uint frag_read_file(uint disk, struct SFS_ENTRY* head, ul_t* ms)
+{
+  struct SFS_ENTRY entry;
+  lp_t bootram_map = bootram.map;
+  ul_t start;
+  uint result = 0;
+  uint limit;
+  uint count;
+  uint run;
+  uint b;
+
+  /* Volatile boot to RAM data is not on disk */
+  if(bootram_map && disk == bootram.disk && bootram.mode == BOOTRAM_VOLATILE) {
+    return 0;
+  }
+  xcache_invalidate(disk);
+  if(disk == bootram.disk) {
+    bootram.map = 0;
+  }
+
+  start = system_timer_ms;
+  memcpy((uchar*)&entry, (uchar*)head, sizeof(entry));
+  while(result == 0) {
+    count = entry_block_refs(&entry);
+    for(b=0; b<count && result==0; b+=run) {
+      limit = min(IO_MERGE_BLOCKS, io_track_blocks(disk, (uint)entry.ref[b]));
+      for(run=1; run<limit && b+run<count &&
+        entry.ref[b+run] == entry.ref[b]+run; run++) {
+      }
+      if(read_disk(disk, (uint)entry.ref[b], 0, run*BLOCK_SIZE, io_buff)) {
+        result = ERROR_IO;
+      }
+    }
+    if(result || entry.next == 0) {
+      break;
+    }
+    if(get_entry_n(&entry, disk, (uint)entry.next) >= ERROR_ANY) {
+      result = ERROR_IO;
+    }
+  }
+
+  *ms += system_timer_ms - start;
+  bootram.map = bootram_map;
+  return result;
+}
+
+/*
+ * Copy data blocks of a file to a contiguous run starting at block dst
+ */
+static uint frag_copy_file(uint disk, struct SFS_ENTRY* head, uint dst,
+  uint nblocks, lp_t stage)
+{
+  struct SFS_ENTRY entry;
+  uint chunk;
+  uint limit;
+  uint run;
+  uint b = 0;
+  uint i;
+  uint k;
+
+  memcpy((uchar*)&entry, (uchar*)head, sizeof(entry));
+  for(i=0; i<nblocks; i+=chunk) {
+    chunk = min(DEFRAG_STAGE_BLOCKS, nblocks - i);
+
+    /* Read source blocks in staging buffer */
+    for(k=0; k<chunk; k+=run) {
+      if(b >= SFS_ENTRYREFS) {
+        if(entry.next == 0 ||
+          get_entry_n(&entry, disk, (uint)entry.next) >= ERROR_ANY) {
+          return ERROR_IO;
+        }
+        b = 0;
+      }
+      limit = min(IO_MERGE_BLOCKS, chunk - k);
+      limit = min(limit, io_track_blocks(disk, (uint)entry.ref[b]));
+      for(run=1; run<limit && b+run<SFS_ENTRYREFS &&
+        entry.ref[b+run] == entry.ref[b]+run; run++) {
+      }
+      if(read_disk(disk, (uint)entry.ref[b], 0, run*BLOCK_SIZE, io_buff)) {
+        return ERROR_IO;
+      }
+      lmemcpy(stage + (lp_t)k*BLOCK_SIZE, lp(io_buff), (ul_t)run*BLOCK_SIZE);
+      io_account(run);
+      b += run;
+    }
+
+    /* Write staged blocks to destination */
+    for(k=0; k<chunk; k+=run) {
+      run = min(IO_MERGE_BLOCKS, chunk - k);
+      run = min(run, io_track_blocks(disk, dst + i + k));
+      lmemcpy(lp(io_buff), stage + (lp_t)k*BLOCK_SIZE, (ul_t)run*BLOCK_SIZE);
+      if(write_disk(disk, dst + i + k, 0, run*BLOCK_SIZE, io_buff)) {
+        return ERROR_IO;
+      }
+      io_account(run);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Set references of a file to a contiguous run starting at block dst
+ * Old blocks are released
+ */
+static uint frag_set_refs(uint disk, uint n, uint dst)
+{
+  struct SFS_ENTRY entry;
+  uint result;
+  uint count;
+  uint b;
+
+  while(1) {
+    result = get_entry_n(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    usage_free_entry_blocks(disk, &entry);
+    count = entry_block_refs(&entry);
+    for(b=0; b<count; b++) {
+      entry.ref[b] = dst++;
+    }
+    result = write_entry(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    if(entry.next == 0) {
+      break;
+    }
+    n = (uint)entry.next;
+  }
+  return 0;
+}
+
+/*
+ * Analyze or defragment disk
+ * If defrag is not 0, fragmented files are relocated
+ */
+static uint frag_process(uint disk, struct FS_FRAG_INFO* info, uint defrag)
+{
+  struct SFS_ENTRY entry;
+  struct FS_FRAG_INFO finfo;
+  uint disk_index = disk_to_index(disk);
+  struct FS_USAGE* u;
+  lp_t chained;
+  lp_t stage = 0;
+  uint result = 0;
+  uint nblocks;
+  uint dst;
+  uint b;
+  uint n;
+
+  memset((uchar*)info, 0, sizeof(struct FS_FRAG_INFO));
+
+  /* Block accounting is needed to find free runs */
+  disk_probe(disk_index);
+  if(disk_index >= MAX_DISK || disk_info[disk_index].fstype != FS_TYPE_NSFS ||
+    !fs_usage[disk_index].valid) {
+    return ERROR_NOT_FOUND;
+  }
+  u = &fs_usage[disk_index];
+
+  chained = frag_chained_map(disk_index);
+  if(chained == 0) {
+    return ERROR_NO_SPACE;
+  }
+  if(defrag) {
+    stage = lmem_alloc((ul_t)DEFRAG_STAGE_BLOCKS*(ul_t)BLOCK_SIZE);
+    if(stage == 0) {
+      lmem_free(chained);
+      return ERROR_NO_SPACE;
+    }
+  }
+
+  /* For each head file entry */
+  for(n=0; n<u->nentries; n++) {
+    if(!bitmap_get(u->entry_map, n) || bitmap_get(chained, n)) {
+      continue;
+    }
+    result = get_entry_n(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      break;
+    }
+    if(!(entry.flags & T_FILE)) {
+      continue;
+    }
+
+    memset((uchar*)&finfo, 0, sizeof(finfo));
+    result = frag_analyze_file(disk, &entry, &finfo);
+    if(result >= ERROR_ANY) {
+      break;
+    }
+
+    /* Never relocate the boot program */
+    if(!defrag || finfo.fragmented == 0 || n == 1) {
+      info->files += finfo.files;
+      info->fragmented += finfo.fragmented;
+      info->blocks += finfo.blocks;
+      info->runs += finfo.runs;
+      info->accesses += finfo.accesses;
+      continue;
+    }
+
+    /* Find a free run. Skip file if there is not */
+    nblocks = (uint)finfo.blocks;
+    dst = usage_find_run(disk_index, nblocks);
+    if(dst >= ERROR_ANY) {
+      info->skipped++;
+      continue;
+    }
+    for(b=0; b<nblocks; b++) {
+      usage_mark_block(disk, dst + b, 1);
+    }
+
+    /* Copy data and measure read time before and after */
+    result = frag_read_file(disk, &entry, &info->before_ms);
+    if(result < ERROR_ANY) {
+      result = frag_copy_file(disk, &entry, dst, nblocks, stage);
+    }
+    if(result < ERROR_ANY) {
+      journal_begin();
+      result = journal_end(frag_set_refs(disk, n, dst));
+      if(result >= ERROR_ANY) {
+        /* journal_end restored entries and block accounting */
+        debugstr("Defrag: %x error updating entry %u\n\r", disk, n);
+        break;
+      }
+    } else {
+      for(b=0; b<nblocks; b++) {
+        usage_mark_block(disk, dst + b, 0);
+      }
+      break;
+    }
+
+    result = get_entry_n(&entry, disk, n);
+    if(result < ERROR_ANY) {
+      result = frag_read_file(disk, &entry, &info->after_ms);
+    }
+    if(result >= ERROR_ANY) {
+      break;
+    }
+    info->moved++;
+  }
+
+  if(stage) {
+    lmem_free(stage);
+  }
+  lmem_free(chained);
+
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  if(defrag) {
+    io_report(disk);
+  }
+  return info->moved;
+}
+
+/*
+ * Get fragmentation info
+ */
+uint fs_get_frag_info(uint disk, struct FS_FRAG_INFO* info)
+{
+  uint result = frag_process(disk, info, 0);
+  return result >= ERROR_ANY ? result : 0;
+}
+
+/*
+ * Defragment disk
+ */
+uint fs_defrag(uint disk, struct FS_FRAG_INFO* info)
+{
+  struct FS_FRAG_INFO stats;
+  uint result = frag_process(disk, info, 1);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  /* Add resulting layout stats */
+  if(fs_get_frag_info(disk, &stats) < ERROR_ANY) {
+    info->files = stats.files;
+    info->fragmented = stats.fragmented;
+    info->blocks = stats.blocks;
+    info->runs = stats.runs;
+    info->accesses = stats.accesses;
+  }
+  return result;
+}
+
 /*
  * Format a disk
  */
@@ -1526,13 +4382,18 @@ uint fs_format(uint disk)
   struct SFS_SUPERBLOCK* sb;
   uint nentries;
   uint result = 0;
-  uint offset = 0;
   uint e;
   uint32_t disk_size;
   uint disk_index = disk_to_index(disk);
 
   debugstr("format disk: %x (system_disk=%x)\n\r", disk, system_disk);
 
+  /* Geometry is needed */
+  disk_probe(disk_index);
+
+  /* Pending journaled updates of this disk are no longer meaningful */
+  journal_forget(disk_index);
+
   /* Copy boot block from system disk to target disk */
   result = read_disk(system_disk, 0, 0, BLOCK_SIZE, buff);
   if(result != 0) {
@@ -1560,17 +4421,36 @@ uint fs_format(uint disk)
   sb->type = SFS_TYPE_ID;
   sb->size = disk_size;
   sb->nentries = min(
-    (uint32_t)(((sb->size * (uint32_t)BLOCK_SIZE)/10L)/(uint32_t)sizeof(struct SFS_ENTRY)),
-    1024L);
-  sb->bootstart = 2L + (sb->nentries * (uint32_t)sizeof(struct SFS_ENTRY)) / (uint32_t)BLOCK_SIZE;
-  result = write_disk(disk, 1, 0, BLOCK_SIZE, sb);
+    (uint32_t)((((sb->size * (uint32_t)BLOCK_SIZE)/100L)*SFS_DEFAULT_ENTRIES_PCT)/(uint32_t)sizeof(struct SFS_ENTRY)),
+    (uint32_t)SFS_DEFAULT_ENTRIES);
+  sb->journalstart = 2L + (sb->nentries * (uint32_t)sizeof(struct SFS_ENTRY)) / (uint32_t)BLOCK_SIZE;
+  sb->journalsize = 0;
+  /* RAM disks do not need a journal: their data is lost at shutdown */
+  if(disk_info[disk_index].ram == 0 &&
+    sb->size > sb->journalstart + 4L*SFS_JOURNAL_BLOCKS) {
+    sb->journalsize = SFS_JOURNAL_BLOCKS;
+  }
+  sb->bootstart = sb->journalstart + sb->journalsize;
+  result = write_disk(disk, 1, 0, BLOCK_SIZE, (uchar*)sb);
   if(result != 0) {
     return ERROR_IO;
   }
-  debugstr("format: %x blocks=%U entries=%U boot=%U\n\r", disk, sb->size, sb->nentries, sb->bootstart);
+  usage_reset(disk_index, sb);
+  debugstr("format: %x blocks=%U entries=%U journal=%U boot=%U\n\r", disk,
+    sb->size, sb->nentries, sb->journalsize, sb->bootstart);
 
   nentries = (uint)sb->nentries;
 
+  /* Invalidate journal header. It will be initialized on mount */
+  if(sb->journalsize) {
+    e = (uint)sb->journalstart;
+    memset(buff, 0, sizeof(buff));
+    result = write_disk(disk, e, 0, BLOCK_SIZE, buff);
+    if(result != 0) {
+      return ERROR_IO;
+    }
+  }
+
   /* Create root dir */
   memset(buff, 0, sizeof(buff));
   entry = (struct SFS_ENTRY*)buff;
@@ -1597,6 +4477,12 @@ uint fs_format(uint disk)
     write_entry(entry, disk, e);
   }
 
+  /* RAM disks are not bootable. Do not copy boot program */
+  if(disk_info[disk_index].ram) {
+    fs_init_info();
+    return 0;
+  }
+
   /* Copy boot program */
   result = get_entry_n(entry, system_disk, 1);
   if(result >= ERROR_ANY) {
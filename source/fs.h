@@ -16,23 +16,30 @@
 /* With the current implementation, BLOCK_SIZE must be a power of 2 */
 
 /* Disk layout: */
-/* [boot block | super block | entries table | data blocks] */
+/* [boot block | super block | entries table | journal | data blocks] */
 
 /* Boot block    block 0           Boot sector */
 /* Super block   block 1           Contains information about the layout of the file system */
 /* Entries tab   blocks 2 to n     Table of file and directory entries */
-/* Data blocks   blocks n to end   Data blocks referenced by file entries */
+/* Journal       blocks n to m     Metadata journal. Can be empty */
+/* Data blocks   blocks m to end   Data blocks referenced by file entries */
 
 /* Entries are referenced by their index on the entry table
  * Entry with index n is located at byte:
  *   2*BLOCK_SIZE + n*sizeof(SFS_ENTRY)
  *
  * Data blocks start at block
- *   2 + ((superblock.nentries*sizeof(SFS_ENTRY)) / BLOCK_SIZE)
+ *   2 + ((superblock.nentries*sizeof(SFS_ENTRY)) / BLOCK_SIZE) +
+ *   superblock.journalsize
  *
  * Data blocks are referenced by their absolute disk block index
  */
 
+/* Default number of entries of a new file system: enough entries to fill
+ * SFS_DEFAULT_ENTRIES_PCT percent of disk space, up to SFS_DEFAULT_ENTRIES */
+#define SFS_DEFAULT_ENTRIES     1024
+#define SFS_DEFAULT_ENTRIES_PCT 10
+
 /* SFS 1.0 ID used in superblock.type */
 #define SFS_TYPE_ID 0x05F50010
 
@@ -41,6 +48,58 @@ struct  SFS_SUPERBLOCK {  /* On-disk superblock structure */
   uint32_t  size;         /* Total number of block in file system */
   uint32_t  nentries;     /* Number of entries in entries table */
   uint32_t  bootstart;    /* Block index of first boot program block */
+  uint32_t  journalstart; /* Block index of first journal block, or 0 */
+  uint32_t  journalsize;  /* Number of blocks of journal, or 0 */
+};
+
+/* File systems created before the journal was introduced have
+ * journalstart and journalsize set to 0, and are used without journal */
+
+/* Metadata journal:
+ *
+ * Entry updates are first written to the journal, grouped in transactions,
+ * and only later (when the journal is full, or when the file system is
+ * synced) written to their location in the entries table (checkpoint).
+ * After a crash, committed transactions are replayed on mount, so the
+ * entries table is never left with half updated chains or references.
+ * Data blocks are not journaled.
+ *
+ * Journal layout (block indexes relative to journalstart):
+ * block 0: journal header
+ * block 1 to journalsize-1: transactions, written one after another
+ *
+ * A transaction is a descriptor block, followed by one block for each
+ * modified entry (a full copy of the entry) and a commit block.
+ * A transaction is valid only if its descriptor and commit blocks have
+ * the expected type and the sequence number that follows the previous one.
+ * Replay starts at block 1 with the header sequence number, and stops
+ * at the first invalid transaction. After a checkpoint, the header sequence
+ * number is updated so old transactions are no longer valid, and the next
+ * transaction is written again at block 1.
+ */
+#define SFS_JOURNAL_BLOCKS 32 /* Default journal size */
+
+#define SFS_JHEADER_ID 0x05F5A001 /* journal header type */
+#define SFS_JDESC_ID   0x05F5A002 /* transaction descriptor type */
+#define SFS_JCOMMIT_ID 0x05F5A003 /* transaction commit type */
+
+#define SFS_JDESCREFS  125 /* Max number of entries in a transaction */
+
+struct SFS_JHEADER {       /* On-disk journal header */
+  uint32_t  type;          /* Must be SFS_JHEADER_ID */
+  uint32_t  sequence;      /* Sequence number of first transaction */
+};
+
+struct SFS_JDESC {         /* On-disk transaction descriptor */
+  uint32_t  type;          /* Must be SFS_JDESC_ID */
+  uint32_t  sequence;      /* Sequence number of this transaction */
+  uint32_t  count;         /* Number of entries in this transaction */
+  uint32_t  ref[SFS_JDESCREFS]; /* Entry index of each logged entry */
+};
+
+struct SFS_JCOMMIT {       /* On-disk transaction commit */
+  uint32_t  type;          /* Must be SFS_JCOMMIT_ID */
+  uint32_t  sequence;      /* Sequence number of this transaction */
 };
 
 /* The boot program must be stored in contiguous data blocks */
@@ -55,6 +114,8 @@ struct  SFS_SUPERBLOCK {  /* On-disk superblock structure */
 #define F_USED (T_DIR | T_FILE) /* Not a flag! Used to find free entries */
 /* ( (entry flags & F_USED) == 0 ) means this is a free entry */
 
+#define F_LZ   0x04  /* Flag: File data is compressed. See below */
+
 /* fs time format: */
 /* bits  0-21   second of month */
 /* bits 22-31   months since 2017/01/01 00:00:00 */
@@ -101,6 +162,49 @@ struct  SFS_ENTRY {             /* On-disk entry structure */
  * With the current implementation, the boot program must be entry index 1.
  */
 
+/* Compressed files:
+ *
+ * When F_LZ is set in the flags of a file (all of its chained entries),
+ * its data (entry.size bytes, referenced as usual) contains:
+ * - a SFS_LZHEADER, filling the first data block
+ * - compressed chunks. Each chunk holds SFS_LZCHUNK bytes of the original
+ *   file (the last one can be smaller), and is compressed independently,
+ *   so any part of the file can be read decompressing only its chunks.
+ *
+ * Chunk n is stored from byte header.offset[n] to header.offset[n+1]
+ * of file data. A chunk whose stored size is its original size is stored
+ * uncompressed.
+ *
+ * Compressed chunks use LZSS: a flags byte followed by up to 8 items.
+ * Bit i of flags (lowest first) is 1 if item i is a literal byte,
+ * or 0 if it's a match: a 16 bit little endian word
+ *   (distance-1) | ((length-SFS_LZMINMATCH) << SFS_LZDISTBITS)
+ * meaning "copy length bytes starting distance bytes back in the output".
+ *
+ * Files are compressed by mkfs. The file system reads them transparently,
+ * and reports their original size. Once written, they are stored
+ * uncompressed. Since file offsets are 16 bit, only files up to
+ * SFS_LZMAXSIZE bytes can be compressed.
+ */
+#define SFS_LZ_ID      0x05F5C001 /* SFS_LZHEADER.type */
+#define SFS_LZCHUNK    1024       /* Original bytes per chunk */
+#define SFS_LZCHUNKS   125        /* Max number of chunks in a file */
+#define SFS_LZDISTBITS 10         /* Match distance bits */
+#define SFS_LZMAXDIST  ((1 << SFS_LZDISTBITS) - 1)
+#define SFS_LZMINMATCH 3          /* Min match length */
+#define SFS_LZMAXMATCH (SFS_LZMINMATCH + (0xFFFF >> SFS_LZDISTBITS))
+#define SFS_LZMAXSIZE  0xFFFF     /* Max original file size */
+
+struct SFS_LZHEADER {
+  uint32_t  type;     /* Must be SFS_LZ_ID */
+  uint32_t  size;     /* Original file size */
+  uint32_t  nchunks;  /* Number of chunks */
+  uint32_t  offset[SFS_LZCHUNKS]; /* Stored offset of each chunk */
+};
+
+/* Stored offset of chunk n is offset[n], and chunk data ends at offset[n+1]
+ * or, for the last chunk, at the end of file data */
+
  #define ROOT_DIR_NAME    "."
  #define PATH_SEPARATOR   '/'
  #define PATH_SEPARATOR_S "/"
@@ -118,6 +222,7 @@ struct  SFS_ENTRY {             /* On-disk entry structure */
  * fd1 - Second floppy disk
  * hd0 - First hard disk
  * hd1 - Second hard disk
+ * rd0 - RAM disk
  *
  * Path components are separated with PATH_SEPARATOR ('/')
  * The root directory of a disk can be omitted or referred as
@@ -136,11 +241,13 @@ struct  SFS_ENTRY {             /* On-disk entry structure */
  * fd1 : 0x01
  * hd0 : 0x80
  * hd1 : 0x81
+ * rd0 : 0xE0
  */
 
 /*
  * Init filesystem info
  * Call this to update internal file system related disk info
+ * Probed disks are mounted again, and the system disk is probed
  */
 void fs_init_info();
 
@@ -234,14 +341,143 @@ uint fs_create_directory(uchar* path);
  */
 uint fs_list(struct SFS_ENTRY* entry, uchar* path, uint n);
 
+/*
+ * List many directory entries
+ * Output: entries, an array of count FS_ENTRY items in far memory
+ * (use lp() for a near buffer)
+ * Gets up to count entries of path directory, starting at index first.
+ * The directory chain is traversed only once, so listing a full directory
+ * this way is much cheaper than calling fs_list for each index.
+ * Unfilled items of entries are zeroed.
+ * Returns:
+ * - ERROR_NOT_FOUND if path does not exist
+ * - number of elements in this directory otherwise
+ */
+uint fs_list_many(lp_t entries, uchar* path, uint first, uint count);
+
+/*
+ * Get fragmentation info of a disk
+ * Output: info
+ * Returns 0 on success
+ */
+uint fs_get_frag_info(uint disk, struct FS_FRAG_INFO* info);
+
+/*
+ * Defragment disk
+ * Each fragmented file is relocated to a contiguous run of free blocks,
+ * if there is one big enough
+ * Output: info, the resulting layout and relocation results
+ * Returns number of relocated files or an error code
+ */
+uint fs_defrag(uint disk, struct FS_FRAG_INFO* info);
+
 /*
  * Create filesystem in disk
  * Deletes all files, creates NSFS filesystem
- * and adds a copy of the kernel
+ * and adds a copy of the kernel (except in RAM disks)
  * Returns 0 on success
  */
 uint fs_format(uint disk);
 
+/*
+ * Sync file systems
+ * Writes all pending journaled entry updates to their
+ * final location in the entries table of each disk
+ * Returns 0 on success
+ */
+uint fs_sync();
+
+/*
+ * Boot to RAM modes
+ */
+#define BOOTRAM_DISABLED 0 /* System disk is accessed as usual */
+#define BOOTRAM_ENABLED  1 /* Reads from memory, writes to memory and disk */
+#define BOOTRAM_VOLATILE 2 /* Reads and writes only memory */
+
+/*
+ * Set boot to RAM mode
+ * Used blocks of the system disk are copied to far memory,
+ * and further accesses to these blocks are served from there
+ * Returns number of blocks in memory or an error code
+ */
+uint fs_set_bootram(uint mode);
+
+/*
+ * Enable the extended memory disk cache
+ * xmem_kb is the size of memory above 1MB (KB). Blocks read from
+ * or written to disks are kept there, up to a fixed limit
+ * Returns number of cache blocks, 0 if disabled
+ */
+uint fs_init_xcache(ul_t xmem_kb);
+
+/*
+ * Get disk cache usage: extended memory cache
+ * and boot RAM disk fields of info
+ */
+void fs_get_cache_info(struct MEM_INFO* info);
+
+/*
+ * Boot prefetch profile
+ * Blocks read from the system disk during a boot are recorded in
+ * a file, and read in advance in next boots (see fs_bootpf_begin
+ * and fs_bootpf_start)
+ */
+#define BOOTPF_FILE       "boot.pf" /* Profile file, in system disk */
+#define BOOTPF_MAX_BLOCKS 256       /* Max number of recorded blocks */
+#define BOOTPF_RECORD_MS  10000L    /* Blocks are recorded only during this time */
+
+#define BOOTPF_DISABLED 0 /* There is no profile */
+#define BOOTPF_RECORD   1 /* Blocks read in next boot will be recorded */
+#define BOOTPF_ENABLED  2 /* Recorded blocks are prefetched at boot */
+
+/*
+ * Profile file header, followed by nblocks block indexes (uint)
+ */
+struct BOOTPF_INFO {
+  uint  state;   /* BOOTPF_RECORD or BOOTPF_ENABLED */
+  uint  nblocks; /* Number of recorded blocks */
+  ul_t  boot_ms; /* Boot time when the profile was recorded (ms) */
+};
+
+/*
+ * Get boot profile info from profile file
+ * Returns profile state
+ */
+uint fs_bootpf_get(struct BOOTPF_INFO* info);
+
+/*
+ * Set boot profile state
+ * BOOTPF_RECORD records blocks read in next boot,
+ * BOOTPF_DISABLED deletes the profile
+ * Returns 0 on success or an error code
+ */
+uint fs_bootpf_set(uint state);
+
+/*
+ * Begin recording blocks read from the system disk. Called once
+ * at boot, before fs_init_info, so blocks read to mount disks are
+ * recorded too. fs_bootpf_start keeps or discards them
+ */
+void fs_bootpf_begin();
+
+/*
+ * Start boot profile. Called once at boot, after fs_init_info and
+ * fs_init_xcache, before the config file is read. Depending on the
+ * profile state, recorded blocks are read into the extended memory
+ * cache, or recording goes on. info is filled with profile file info
+ * Returns BOOTPF_ENABLED if blocks were prefetched,
+ * BOOTPF_RECORD if recording or BOOTPF_DISABLED
+ */
+uint fs_bootpf_start(struct BOOTPF_INFO* info);
+
+/*
+ * Stop recording boot profile, and save it. Called when
+ * boot finishes. boot_ms is the boot time. If recording,
+ * info is updated with the saved profile info
+ * Returns number of recorded blocks or an error code
+ */
+uint fs_bootpf_stop(struct BOOTPF_INFO* info, ul_t boot_ms);
+
 /*
  * Convert fs time to system TIME
  * See fs time format specification above
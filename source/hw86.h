@@ -82,6 +82,10 @@ extern uint get_disk_info(uint disk, uint* st, uint* hd, uint* cl);
  * Read disk sector
  */
 extern uint read_disk_sector(uint disk, uint sector, uint n, uchar* buff);
+/*
+ * Read disk sectors to far memory below 1MB
+ */
+extern uint read_disk_sector_far(uint disk, uint sector, uint n, lp_t buff);
 /*
  * Write disk sector
  */
@@ -95,13 +99,45 @@ extern void turn_off_fd_motors();
  */
 extern void get_time(uchar* BDCtime, uchar* date);
 /*
- * Set far memory byte
+ * Enter unreal mode, so far memory functions can address
+ * all memory without loading segments
+ * Returns 1 if enabled, 0 if not possible (virtual 8086 mode)
+ */
+extern uint unreal_init();
+/*
+ * Set far memory byte, word or dword
+ * These functions don't disable interrupts
  */
 extern void lmem_setbyte(lp_t addr, uchar b);
+extern void lmem_setword(lp_t addr, uint w);
+extern void lmem_setdword(lp_t addr, ul_t d);
 /*
- * Get far memory byte
+ * Get far memory byte, word or dword
+ * These functions don't disable interrupts
  */
 extern uchar lmem_getbyte(lp_t addr);
+extern uint lmem_getword(lp_t addr);
+extern ul_t lmem_getdword(lp_t addr);
+/*
+ * Copy far memory bytes. Areas can overlap.
+ * Size must be lower than 0xFFF0
+ */
+extern void lmem_copy(lp_t dst, lp_t src, uint size);
+/*
+ * Set far memory bytes to a value.
+ * Size must be lower than 0xFFF0
+ */
+extern void lmem_fill(lp_t dst, uchar value, uint size);
+/*
+ * Get extended memory size (KB above 1MB), 0 if none
+ */
+extern ul_t xmem_get_size();
+/*
+ * Copy words between linear addresses, which can be above 1MB.
+ * Copies directly in unreal mode with A20 line enabled, and
+ * uses BIOS block move otherwise. Returns 0 on success
+ */
+extern uint xmem_copy(ul_t dst, ul_t src, uint words);
 /*
  * User program far call
  */
@@ -538,7 +538,11 @@ _read_disk_sector:
   mov  ah, 2            ; Params for int 0x13: read disk sectors
   mov  al, [bx+22]      ; Number of sectors to read
   mov  si, [bx+24]      ; Set ES:BX to point the buffer
+  mov  bx, [dbuffseg]   ; Buffer is in DS, unless it's far
+  cmp  bx, 0
+  jne  .buff_seg
   mov  bx, ds
+.buff_seg:
   mov  es, bx
   mov  bx, si
 
@@ -584,6 +588,41 @@ _read_disk_sector:
 .n dw 0
 
 
+;
+; uint read_disk_sector_far(uint disk, uint sector, uint n, lp_t buff)
+; Read disk sectors to far memory. buff must be a linear address
+; lower than 1MB, and the buffer can't cross a 64KB boundary
+;
+global _read_disk_sector_far
+_read_disk_sector_far:
+  push bx
+  push eax
+  push edx
+
+  mov  bx, sp
+  mov  eax, [bx+18]     ; Buffer linear address
+  call lmem_addr
+  mov  [dbuffseg], dx
+  push ax               ; Buffer offset
+  push word [bx+16]     ; Number of sectors
+  push word [bx+14]     ; Start logical sector
+  push word [bx+12]     ; Disk
+  call _read_disk_sector
+  add  sp, 8
+  mov  [.result], ax
+  mov  word [dbuffseg], 0
+  push ds               ; Restore ES
+  pop  es
+
+  pop  edx
+  pop  eax
+  pop  bx
+  mov  ax, [.result]
+  ret
+
+.result dw 0
+
+
 ;
 ; void turn_off_floppy_motors()
 ; Since IRQ0 is used for timer, this must be done manually
@@ -714,6 +753,8 @@ struc DISKINFO
   .cylinders  resw 1
   .disk_size  resd 1
   .last_accss resd 1
+  .ram        resd 1
+  .probed     resw 1
   .size:
 endstruc
 
@@ -722,7 +763,7 @@ endstruc
 ; To allow disk read and write
 ;
 set_disk_params:
-  pusha
+  pushad
 
   mov  byte bl, [tdev]
   mov  bh, 0
@@ -731,6 +772,7 @@ set_disk_params:
   pop  bx
   mov  bl, DISKINFO.size
   mul  bl
+  movzx eax, ax         ; Callers may leave the high word set
   mov  bx, [_disk_info + eax + DISKINFO.sectors]
   mov  [dsects], bx
   mov  bx, [_disk_info + eax + DISKINFO.sides]
@@ -738,11 +780,12 @@ set_disk_params:
   mov  ebx, [_system_timer_ms]
   mov  [_disk_info + eax + DISKINFO.last_accss], ebx
 
-  popa
+  popad
   ret
 
 extern _disk_to_index
 extern _disk_info
+extern _a20_enabled, _unreal_enabled
 
 
 ;
@@ -807,6 +850,153 @@ _get_disk_info:
 
 dsects dw 0             ; Current disk sectors per track
 dsides dw 0             ; Current disk sides
+dbuffseg dw 0           ; Far buffer segment, 0 if buffer is in DS
+
+
+;
+; ul_t xmem_get_size()
+; Get extended memory size (KB above 1MB), 0 if none
+;
+global _xmem_get_size
+_xmem_get_size:
+  push bx
+  push cx
+
+  xor  cx, cx
+  xor  dx, dx
+  mov  ax, 0xE801       ; Get memory size for large configurations
+  int  0x15
+  jc   .try88
+  cmp  ah, 0x86         ; Unsupported function
+  je   .try88
+  cmp  ah, 0x80         ; Invalid command
+  je   .try88
+  jcxz .e801            ; Some BIOS only return cx:dx
+  mov  ax, cx
+  mov  bx, dx
+.e801:
+  and  eax, 0xFFFF      ; ax = KB between 1MB and 16MB
+  and  ebx, 0xFFFF      ; bx = 64KB blocks above 16MB
+  shl  ebx, 6
+  add  eax, ebx
+  jmp  .done
+
+.try88:
+  mov  ah, 0x88         ; Get extended memory size (up to 64MB)
+  int  0x15
+  jc   .none
+  and  eax, 0xFFFF
+  jmp  .done
+
+.none:
+  xor  eax, eax
+
+.done:
+  mov  edx, eax         ; Return size in dx:ax
+  shr  edx, 16
+  pop  cx
+  pop  bx
+  ret
+
+
+;
+; uint xmem_copy(ul_t dst, ul_t src, uint words)
+; Copy words between linear addresses. In unreal mode,
+; with A20 line enabled, memory is copied directly.
+; Otherwise, BIOS block move is used
+; Returns 0 on success
+;
+global _xmem_copy
+_xmem_copy:
+  cmp  byte [_unreal_enabled], 0
+  je   .bios
+  cmp  byte [_a20_enabled], 0
+  jne  .flat
+
+.bios:
+  push bx
+  push cx
+  push si
+  push es
+
+  mov  bx, sp
+  mov  ax, [bx+10]      ; Destination descriptor base
+  mov  [xmem_gdt+0x1A], ax
+  mov  ax, [bx+12]
+  mov  [xmem_gdt+0x1C], al
+  mov  [xmem_gdt+0x1F], ah
+  mov  ax, [bx+14]      ; Source descriptor base
+  mov  [xmem_gdt+0x12], ax
+  mov  ax, [bx+16]
+  mov  [xmem_gdt+0x14], al
+  mov  [xmem_gdt+0x17], ah
+  mov  cx, [bx+18]      ; Number of words
+
+  mov  ax, cs           ; es:si = descriptor table
+  mov  es, ax
+  mov  si, xmem_gdt
+  mov  ah, 0x87
+  int  0x15
+  mov  al, ah           ; Return status
+  mov  ah, 0
+  jnc  .a20
+  or   al, 1            ; Error, but no status
+
+.a20:
+  cmp  byte [_a20_enabled], 0
+  je   .unreal
+  push ax               ; Some BIOS disable A20 after a block move,
+  mov  ax, 0x2401       ; and the HMA is used. Enable it again
+  int  0x15
+  pop  ax
+
+.unreal:
+  cmp  byte [_unreal_enabled], 0
+  je   .end
+  call unreal_enter     ; Block move resets segment limits
+
+.end:
+  pop  es
+  pop  si
+  pop  cx
+  pop  bx
+  ret
+
+.flat:
+  pushf
+  push ds
+  push es
+  push eax
+  push ecx
+  push esi
+  push edi
+  push bx
+
+  mov  bx, sp
+  mov  edi, [bx+26]     ; Destination
+  mov  esi, [bx+30]     ; Source
+  movzx ecx, word [bx+34] ; Number of words
+  shl  ecx, 1
+  call flat_copy
+
+  pop  bx
+  pop  edi
+  pop  esi
+  pop  ecx
+  pop  eax
+  pop  es
+  pop  ds
+  popf
+  xor  ax, ax           ; Success
+  ret
+
+xmem_gdt:               ; Block move descriptor table
+  times 16 db 0         ; Null and GDT descriptors, filled by BIOS
+  dw 0xFFFF, 0          ; Source: limit, base 0-15
+  db 0, 0x93, 0, 0      ;   base 16-23, access rights, base 24-31
+  dw 0xFFFF, 0          ; Destination
+  db 0, 0x93, 0, 0
+  times 16 db 0         ; BIOS code and stack descriptors
 
 
 ;
@@ -991,33 +1181,110 @@ _reboot:
   ret
 
 
+;
+; Far memory accessors
+; In unreal mode, memory is addressed through fs, which is
+; zero based. Otherwise, es is loaded with the segment.
+; Interrupts are left enabled: es is restored before
+; returning, and interrupt handlers load their own segments
+;
+
 ;
 ; void lmem_setbyte(lp_t addr, uchar b)
 ; Set far memory byte
 ;
 global _lmem_setbyte
 _lmem_setbyte:
-  cli
-  push es
-  push ecx
   push bx
-  push ax
+  push es
+  push esi
+  push eax
+  push edx
 
   mov  bx, sp
-  mov  cx, [bx+14]
-  sal  cx, 12
-  mov  es, cx
-  mov  cx, [bx+12]
-  mov  al, [bx+16]
-  mov  bx, cx
+  mov  esi, [bx+18]     ; Address
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  mov  al, [bx+22]
+  mov  [fs:esi], al
+  jmp  .end
+.real:
+  call lmem_es_si
+  mov  al, [bx+22]
+  mov  [es:si], al
 
-  mov  [es:bx], al
+.end:
+  pop  edx
+  pop  eax
+  pop  esi
+  pop  es
+  pop  bx
+  ret
 
-  pop  ax
+
+;
+; void lmem_setword(lp_t addr, uint w)
+; Set far memory word
+;
+global _lmem_setword
+_lmem_setword:
+  push bx
+  push es
+  push esi
+  push eax
+  push edx
+
+  mov  bx, sp
+  mov  esi, [bx+18]     ; Address
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  mov  ax, [bx+22]
+  mov  [fs:esi], ax
+  jmp  .end
+.real:
+  call lmem_es_si
+  mov  ax, [bx+22]
+  mov  [es:si], ax
+
+.end:
+  pop  edx
+  pop  eax
+  pop  esi
+  pop  es
   pop  bx
-  pop  ecx
+  ret
+
+
+;
+; void lmem_setdword(lp_t addr, ul_t d)
+; Set far memory dword
+;
+global _lmem_setdword
+_lmem_setdword:
+  push bx
+  push es
+  push esi
+  push eax
+  push edx
+
+  mov  bx, sp
+  mov  esi, [bx+18]     ; Address
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  mov  eax, [bx+22]
+  mov  [fs:esi], eax
+  jmp  .end
+.real:
+  call lmem_es_si
+  mov  eax, [bx+22]
+  mov  [es:si], eax
+
+.end:
+  pop  edx
+  pop  eax
+  pop  esi
   pop  es
-  sti
+  pop  bx
   ret
 
 
@@ -1027,27 +1294,362 @@ _lmem_setbyte:
 ;
 global _lmem_getbyte
 _lmem_getbyte:
-  cli
+  push bx
+  push es
+  push esi
+  push edx
+
+  mov  bx, sp
+  mov  esi, [bx+14]     ; Address
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  movzx ax, byte [fs:esi]
+  jmp  .end
+.real:
+  call lmem_es_si
+  movzx ax, byte [es:si]
+
+.end:
+  pop  edx
+  pop  esi
+  pop  es
+  pop  bx
+  ret
+
+
+;
+; uint lmem_getword(lp_t addr)
+; Get far memory word
+;
+global _lmem_getword
+_lmem_getword:
+  push bx
+  push es
+  push esi
+  push edx
+
+  mov  bx, sp
+  mov  esi, [bx+14]     ; Address
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  mov  ax, [fs:esi]
+  jmp  .end
+.real:
+  call lmem_es_si
+  mov  ax, [es:si]
+
+.end:
+  pop  edx
+  pop  esi
+  pop  es
+  pop  bx
+  ret
+
+
+;
+; ul_t lmem_getdword(lp_t addr)
+; Get far memory dword
+;
+global _lmem_getdword
+_lmem_getdword:
+  push bx
+  push es
+  push esi
+
+  mov  bx, sp
+  mov  esi, [bx+10]     ; Address
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  mov  eax, [fs:esi]
+  jmp  .end
+.real:
+  call lmem_es_si
+  mov  eax, [es:si]
+
+.end:
+  mov  edx, eax         ; Return in dx:ax
+  shr  edx, 16
+  pop  esi
+  pop  es
+  pop  bx
+  ret
+
+
+;
+; Load es:si with linear address esi, for segmented access
+; Changes eax and edx
+;
+lmem_es_si:
+  mov  eax, esi
+  call lmem_addr
+  mov  es, dx
+  mov  si, ax
+  ret
+
+
+;
+; void lmem_copy(lp_t dst, lp_t src, uint size)
+; Copy far memory bytes. Areas can overlap.
+; Size must be lower than 0xFFF0 (HMA: end of segment)
+;
+global _lmem_copy
+_lmem_copy:
+  pushf
+  push ds
   push es
+  push eax
+  push edx
   push ecx
+  push esi
+  push edi
   push bx
 
   mov  bx, sp
-  mov  cx, [bx+12]
-  sal  cx, 12
-  mov  es, cx
-  mov  cx, [bx+10]
-  mov  bx, cx
-  mov  ax, 0
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  mov  edi, [bx+30]     ; Unreal mode: copy between linear addresses
+  mov  esi, [bx+34]
+  movzx ecx, word [bx+38]
+  call flat_copy
+  jmp  .end
 
-  mov  al, [es:bx]
+.real:
+  mov  cx, [bx+38]      ; Number of bytes
+  mov  eax, [bx+34]     ; ds:si = source
+  call lmem_addr
+  mov  si, ax
+  push dx
+  mov  eax, [bx+30]     ; es:di = destination
+  call lmem_addr
+  mov  es, dx
+  mov  di, ax
+  mov  eax, [bx+30]     ; Copy backwards if destination is above
+  cmp  eax, [bx+34]     ; source, so overlapping areas are right
+  pop  ds               ; Stack can't be addressed from now on
+  ja   .backward
+
+  cld
+  shr  cx, 1
+  rep  movsw
+  jnc  .end
+  movsb
+  jmp  .end
+
+.backward:
+  std
+  add  si, cx           ; Point to last byte
+  add  di, cx
+  dec  si
+  dec  di
+  shr  cx, 1
+  jnc  .words
+  movsb
+.words:
+  dec  si               ; Point to last word
+  dec  di
+  rep  movsw
 
+.end:
   pop  bx
+  pop  edi
+  pop  esi
   pop  ecx
+  pop  edx
+  pop  eax
   pop  es
-  sti
+  pop  ds
+  popf
+  ret
+
+
+;
+; void lmem_fill(lp_t dst, uchar value, uint size)
+; Set far memory bytes to a value.
+; Size must be lower than 0xFFF0 (HMA: end of segment)
+;
+global _lmem_fill
+_lmem_fill:
+  pushf
+  push es
+  push eax
+  push edx
+  push ecx
+  push edi
+  push bx
+
+  mov  bx, sp
+  cmp  byte [_unreal_enabled], 0
+  je   .real
+  mov  edi, [bx+24]     ; Unreal mode: es:edi = linear address
+  xor  ax, ax
+  mov  es, ax
+  mov  al, [bx+28]      ; Value, in all bytes
+  mov  ah, al
+  mov  dx, ax
+  shl  eax, 16
+  mov  ax, dx
+  movzx ecx, word [bx+30] ; Number of bytes
+  mov  edx, ecx
+
+  cld
+  shr  ecx, 2
+  a32  rep stosd
+  mov  ecx, edx
+  and  ecx, 3
+  a32  rep stosb
+  jmp  .end
+
+.real:
+  mov  eax, [bx+24]     ; es:di = destination
+  call lmem_addr
+  mov  es, dx
+  mov  di, ax
+  mov  al, [bx+28]      ; Value, in both bytes
+  mov  ah, al
+  mov  cx, [bx+30]      ; Number of bytes
+
+  cld
+  shr  cx, 1
+  rep  stosw
+  jnc  .end
+  stosb
+
+.end:
+  pop  bx
+  pop  edi
+  pop  ecx
+  pop  edx
+  pop  eax
+  pop  es
+  popf
+  ret
+
+
+;
+; Convert linear address in eax to segment (dx)
+; and offset (ax). Offset is lower than 0x10,
+; except in the HMA, addressed through segment 0xFFFF
+;
+lmem_addr:
+  cmp  eax, 0xFFFF0
+  jae  .hma
+  mov  edx, eax
+  shr  edx, 4
+  and  ax, 0x000F
+  ret
+.hma:
+  sub  eax, 0xFFFF0
+  mov  dx, 0xFFFF
+  ret
+
+
+;
+; Copy ecx bytes from linear address esi to linear
+; address edi, in unreal mode. Areas can overlap.
+; Changes ds, es, eax, ecx, esi, edi and direction flag
+;
+flat_copy:
+  xor  ax, ax           ; Zero based segments, 4GB limit
+  mov  ds, ax
+  mov  es, ax
+  mov  eax, ecx
+  cmp  edi, esi         ; Copy backwards if destination is above
+  ja   .backward        ; source, so overlapping areas are right
+
+  cld
+  shr  ecx, 2
+  a32  rep movsd
+  mov  ecx, eax
+  and  ecx, 3
+  a32  rep movsb
+  ret
+
+.backward:
+  std
+  lea  esi, [esi+ecx-1] ; Point to last byte
+  lea  edi, [edi+ecx-1]
+  and  ecx, 3
+  a32  rep movsb
+  mov  ecx, eax
+  shr  ecx, 2
+  sub  esi, 3           ; Point to last dword
+  sub  edi, 3
+  a32  rep movsd
+  ret
+
+
+;
+; uint unreal_init()
+; Enter unreal mode: segment limits are set to 4GB, so
+; memory can be addressed with 32 bit offsets from a zero
+; based segment (fs) instead of loading a segment for each
+; access. It's not possible if the CPU runs in virtual 8086
+; mode (protected mode already enabled by a memory manager)
+; Returns 1 if enabled, 0 otherwise
+;
+global _unreal_init
+_unreal_init:
+  smsw ax
+  test al, 1
+  jz   .enter
+  xor  ax, ax
+  ret
+.enter:
+  call unreal_enter
+  mov  ax, 1
+  ret
+
+;
+; Switch to protected mode, load data segments with a
+; flat descriptor and return to real mode. Segments keep
+; the 4GB limit until something enters protected mode again
+;
+unreal_enter:
+  pushf
+  push ds
+  push es
+  push eax
+  push bx
+
+  xor  eax, eax         ; GDT linear address
+  mov  ax, cs
+  shl  eax, 4
+  add  eax, unreal_gdt
+  mov  [unreal_gdtr+2], eax
+
+  cli
+  lgdt [unreal_gdtr]
+  mov  eax, cr0
+  or   al, 1
+  mov  cr0, eax
+  jmp  $+2
+  mov  bx, 0x08         ; Flat data descriptor
+  mov  ds, bx
+  mov  es, bx
+  mov  fs, bx
+  mov  gs, bx
+  and  al, 0xFE
+  mov  cr0, eax
+  jmp  $+2
+  xor  bx, bx           ; Back in real mode: base 0
+  mov  fs, bx
+  mov  gs, bx
+
+  pop  bx
+  pop  eax
+  pop  es
+  pop  ds
+  popf
   ret
 
+unreal_gdtr:
+  dw 0x000F             ; GDT limit
+  dd 0                  ; GDT linear address
+unreal_gdt:
+  dw 0, 0, 0, 0         ; Null descriptor
+  dw 0xFFFF, 0          ; Flat data: limit 0-15, base 0-15
+  db 0, 0x92, 0xCF, 0   ;   base 16-23, access rights, limit 16-19 and 4KB granularity, base 24-31
+
 
 ;
 ; Enter kernel mode
@@ -1522,6 +2124,7 @@ extern _net_irq ; netword IRQ number, assumed > 8
 ;
 ;
 INT_CODE_SYSCALL equ 0x80
+INT_CODE_FASTCALL equ 0x81
 global _install_ISR
 _install_ISR:
   cli                   ; hardware interrupts are now stopped
@@ -1534,6 +2137,11 @@ _install_ISR:
   mov  ax, cs
   mov  [es:INT_CODE_SYSCALL*4+2], ax
 
+  ; add routine to interrupt vector table (FASTCALL)
+  mov  dx, FAST_ISR
+  mov  [es:INT_CODE_FASTCALL*4], dx
+  mov  [es:INT_CODE_FASTCALL*4+2], ax
+
   sti
   ret
 
@@ -1636,3 +2244,71 @@ SYS_ISR:
 .arg2   dw 0
 .arg3   dw 0
 extern _kernel_service
+
+
+;
+; FAST_ISR
+; Fast syscall Interrupt Service Routine
+; Service in ax, parameters in bx, cx, dx and si
+; Result in dx:ax. Other registers are preserved
+;
+FAST_ISR:
+  push es
+  push ds
+  push bp
+  push di
+  push si
+  push cx
+  push bx
+
+  mov  bp, KERNSEG      ; Kernel data segment
+  mov  es, bp
+  mov  ds, bp
+
+  ; Store current stack
+  mov  bp, ss
+  mov  di, sp
+  cmp  bp, KERNSEG
+  je   .nset
+
+  ; Set the kernel stack (interrupts are disabled)
+  push ds
+  pop  ss
+  mov  sp, [kstack]
+
+  ; Push old stack
+.nset:
+  push bp
+  push di
+
+  ; Push args
+  push si
+  push dx
+  push cx
+  push bx
+  push ax
+
+  ; Service
+  sti
+  cld
+  call _kernel_fastcall
+  cli
+  add  sp, 10
+
+  ; Pop old stack
+  pop  di
+  pop  bp
+  mov  ss, bp
+  mov  sp, di
+
+  ; Restore previous to call
+  pop  bx
+  pop  cx
+  pop  si
+  pop  di
+  pop  bp
+  pop  ds
+  pop  es
+  iret
+
+extern _kernel_fastcall
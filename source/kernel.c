@@ -12,6 +12,14 @@
 #include "net.h"
 
 uchar a20_enabled = 0; /* A20 line enabled */
+uchar unreal_enabled = 0; /* Flat memory access (unreal mode) */
+ul_t xmem_size = 0; /* Extended memory size (KB) */
+uint xcache_blocks = 0; /* Blocks of disk cache in extended memory */
+
+ul_t boot_time_ms = 0; /* Time from kernel start to prompt */
+ul_t boot_disks_ms = 0; /* Part of boot time used to probe disks */
+uint bootpf_used = BOOTPF_DISABLED; /* Boot profile usage in this boot */
+struct BOOTPF_INFO bootpf_info; /* Boot profile file info */
 
 uchar serial_status = 0; /* Serial port status */
 uint serial_debug = 1; /* Debug info through serial port */
@@ -37,8 +45,6 @@ uint screen_height_px = 600;
 uchar  system_disk; /* System disk */
 struct DISKINFO disk_info[MAX_DISK];  /* Disk info */
 
-#define KERN_MEMSEG 0x0800L
-
 /*
  * Extern program call
  */
@@ -50,28 +56,71 @@ struct DISKINFO disk_info[MAX_DISK];  /* Disk info */
 /*
  * Heap related
  * This memory is only for kernel usage
+ *
+ * Buddy allocator: blocks have power of two sizes (size
+ * classes), from HEAP_MIN_SIZE to the whole heap, and start
+ * with a header containing their class. Free blocks are kept
+ * in a list per class. Bigger blocks are split in halves
+ * (buddies) when needed, and free buddies are merged again,
+ * so allocating and freeing don't need to scan the heap
  */
-#define HEAP_MAX_BLOCK   0x0080U
-#define HEAP_MEM_SIZE    0x0400U
-#define HEAP_BLOCK_SIZE  (HEAP_MEM_SIZE / HEAP_MAX_BLOCK)
+#define HEAP_MEM_SIZE    0x0800U
+#define HEAP_MIN_SIZE    0x0010U
+#define HEAP_CLASSES     8 /* 16 bytes to 2KB */
+#define HEAP_CLASS_SIZE(c) (HEAP_MIN_SIZE << (c))
+#define HEAP_USED        0x8000U /* Header flag */
 
 static uchar HEAPADDR[HEAP_MEM_SIZE]; /* Allocate heap memory */
 
 struct HEAPBLOCK {
-  uint   used;
-  void*  ptr;
-} heap[HEAP_MAX_BLOCK];
+  uint   header;             /* Class and HEAP_USED flag */
+  struct HEAPBLOCK* next;    /* Free list links, only in free blocks */
+  struct HEAPBLOCK* prev;
+};
+static struct HEAPBLOCK* heap_free_list[HEAP_CLASSES];
+static struct MEM_POOL_INFO heap_stats;
+
+/*
+ * Add a block to the free list of class c
+ */
+static void heap_push_free(struct HEAPBLOCK* block, uint c)
+{
+  block->header = c;
+  block->prev = 0;
+  block->next = heap_free_list[c];
+  if(block->next) {
+    block->next->prev = block;
+  }
+  heap_free_list[c] = block;
+}
+
+/*
+ * Remove a block from the free list of class c
+ */
+static void heap_remove_free(struct HEAPBLOCK* block, uint c)
+{
+  if(block->prev) {
+    block->prev->next = block->next;
+  } else {
+    heap_free_list[c] = block->next;
+  }
+  if(block->next) {
+    block->next->prev = block->prev;
+  }
+}
 
 /*
- * Init heap: all blocks are unused
+ * Init heap: a single free block
  */
 static void heap_init()
 {
   uint i;
-  for(i=0; i<HEAP_MAX_BLOCK; i++) {
-    heap[i].used = 0;
-    heap[i].ptr = 0;
+  for(i=0; i<HEAP_CLASSES; i++) {
+    heap_free_list[i] = 0;
   }
+  heap_push_free((struct HEAPBLOCK*)HEAPADDR, HEAP_CLASSES-1);
+  memset((uchar*)&heap_stats, 0, sizeof(heap_stats));
+  heap_stats.size = HEAP_MEM_SIZE;
 }
 
 /*
@@ -79,174 +128,728 @@ static void heap_init()
  */
 static void* heap_alloc(uint size)
 {
-  uint n_alloc = 0;
-  uint n_found = 0;
-  uint i, j;
+  struct HEAPBLOCK* block;
+  uint c = 0;
+  uint i;
 
   if(size == 0) {
     return 0;
   }
 
-  /* Get number of blocks to allocate */
-  n_alloc = size / HEAP_BLOCK_SIZE +
-    ((size % HEAP_BLOCK_SIZE) ? 1 : 0);
+  /* Find size class. Block includes its header */
+  while(c < HEAP_CLASSES && HEAP_CLASS_SIZE(c) - sizeof(uint) < size) {
+    c++;
+  }
 
-  /* Find a continuous set of n_alloc free blocks */
-  for(i=0; i<HEAP_MAX_BLOCK; i++) {
-    if(heap[i].used) {
-      n_found = 0;
-    } else {
-      n_found++;
-      if(n_found >= n_alloc) {
-        uint bi = (i+1-n_alloc)*HEAP_BLOCK_SIZE;
-        void* addr = &HEAPADDR[bi];
-        for(j=i+1-n_alloc; j<=i; j++) {
-          heap[j].ptr = addr;
-          heap[j].used = 1;
-        }
+  /* Find smallest free block big enough */
+  i = c;
+  while(i < HEAP_CLASSES && heap_free_list[i] == 0) {
+    i++;
+  }
 
-        return addr;
-      }
-    }
+  if(i >= HEAP_CLASSES) {
+    /* Error: not found */
+    heap_stats.failures++;
+    debugstr("Mem alloc: BAD ALLOC (%d bytes)\n\r", size);
+    return 0;
   }
 
-  /* Error: not found */
-  debugstr("Mem alloc: BAD ALLOC (%d bytes)\n\r", size);
-  return 0;
+  /* Split it in halves until it has the right size */
+  block = heap_free_list[i];
+  heap_remove_free(block, i);
+  while(i > c) {
+    i--;
+    heap_push_free((struct HEAPBLOCK*)((uchar*)block + HEAP_CLASS_SIZE(i)), i);
+  }
+
+  block->header = c | HEAP_USED;
+  heap_stats.allocs++;
+  heap_stats.used += (ul_t)HEAP_CLASS_SIZE(c);
+  heap_stats.peak = max(heap_stats.peak, heap_stats.used);
+  return (uchar*)block + sizeof(uint);
 }
 
 /*
  * Free memory in heap
  */
-static heap_free(void* ptr)
+static void heap_free(void* ptr)
 {
-  uint i;
-  if(ptr != 0) {
-    for(i=0; i<HEAP_MAX_BLOCK; i++) {
-      if(heap[i].ptr == ptr && heap[i].used) {
-        heap[i].used = 0;
-        heap[i].ptr = 0;
-      }
+  struct HEAPBLOCK* block = (struct HEAPBLOCK*)((uchar*)ptr - sizeof(uint));
+  struct HEAPBLOCK* buddy;
+  uint c;
+
+  if(ptr == 0) {
+    return;
+  }
+
+  /* Check it's an allocated block */
+  if((uchar*)block < HEAPADDR || (uchar*)block >= &HEAPADDR[HEAP_MEM_SIZE] ||
+    !(block->header & HEAP_USED)) {
+    debugstr("Mem free: BAD FREE (%x)\n\r", ptr);
+    return;
+  }
+
+  c = block->header & ~HEAP_USED;
+  heap_stats.used -= (ul_t)HEAP_CLASS_SIZE(c);
+
+  /* Merge with its buddy while it's free and not split */
+  while(c < HEAP_CLASSES-1) {
+    buddy = (struct HEAPBLOCK*)(HEAPADDR +
+      (((uchar*)block - HEAPADDR) ^ HEAP_CLASS_SIZE(c)));
+    if(buddy->header != c) {
+      break;
     }
+    heap_remove_free(buddy, c);
+    block = min(block, buddy);
+    c++;
   }
+  heap_push_free(block, c);
+}
 
-  return;
+/*
+ * Get size of the largest free heap block
+ */
+static uint heap_largest()
+{
+  uint c = HEAP_CLASSES;
+  while(c > 0) {
+    c--;
+    if(heap_free_list[c]) {
+      return HEAP_CLASS_SIZE(c) - sizeof(uint);
+    }
+  }
+  return 0;
 }
 
 /*
  * Far memory handling
  * Public memory
+ *
+ * Segregated fit allocator. Memory is divided in blocks of
+ * whole paragraphs. Each block starts with a header paragraph
+ * containing its size and the size of the previous block, so
+ * free neighbours can be merged when a block is freed.
+ * Free blocks are kept in lists by size class (power of two
+ * number of paragraphs), so allocating and freeing don't need
+ * to scan all blocks, and the number of blocks is not limited
  */
 #define LMEM_START 0x00028000L
 #define LMEM_LIMIT 0x0009FC00L
 #define LMEM_BLOCK_SIZE 0x10L
-#define LMEM_MAX_BLOCK 64
-struct LMEMBLOCK {
-  lp_t start;
-  ul_t size;
-} lmem[LMEM_MAX_BLOCK];
+#define LMEM_CLASSES 16
+#define LMEM_FREE 0x4652 /* Block states */
+#define LMEM_USED 0x5553
+#define LMEM_OWNER_KERNEL 0 /* Block owners */
+#define LMEM_OWNER_UPROG  1
+
+struct LMEM_HEADER {
+  uint  size;      /* Block size in paragraphs, header included */
+  uint  prev_size; /* Size of previous block, 0 if first */
+  uint  state;     /* LMEM_FREE or LMEM_USED */
+  uint  owner;     /* LMEM_OWNER_ of used blocks */
+  lp_t  next;      /* Free list links, only in free blocks */
+  lp_t  prev;
+};
+
+struct LMEM_POOL {
+  lp_t  start;
+  lp_t  limit;
+  lp_t  free_list[LMEM_CLASSES]; /* Free blocks of each class */
+  struct MEM_POOL_INFO stats;
+};
+
+static struct LMEM_POOL lmem;
 
 /*
- * Init far memory: all blocks are unused
+ * High Memory Area (HMA)
+ * With A20 enabled, the first 64KB above 1MB are addressed
+ * through segment 0xFFFF. They are used for kernel buffers,
+ * so these don't take user programs far memory
  */
-static void lmem_init()
+#define HMA_START 0x00100000L
+#define HMA_LIMIT 0x0010FFF0L
+static struct LMEM_POOL hma;
+uint hma_enabled = 0; /* HMA is available */
+
+/*
+ * Read and write block headers
+ */
+static void pool_get_header(lp_t block, struct LMEM_HEADER* h)
+{
+  lmem_copy(lp(h), block, sizeof(struct LMEM_HEADER));
+}
+
+static void pool_set_header(lp_t block, struct LMEM_HEADER* h)
 {
-  memset(&lmem, 0, sizeof(lmem));
+  lmem_copy(block, lp(h), sizeof(struct LMEM_HEADER));
 }
 
 /*
- * Allocate far memory
+ * Get size class of a number of paragraphs
  */
-static lp_t lmem_alloc(ul_t size)
+static uint pool_class(uint n)
 {
-  lp_t start = 0;
-  uint i;
+  uint c = 0;
+  while(n > 1 && c < LMEM_CLASSES-1) {
+    n >>= 1;
+    c++;
+  }
+  return c;
+}
 
-  /* If size is 0 or all blocks are used, return */
-  if(size==0 || lmem[LMEM_MAX_BLOCK-1].size!=0) {
-    return 0;
+/*
+ * Add a block to the free list of its class
+ */
+static void pool_push_free(struct LMEM_POOL* pool, lp_t block, struct LMEM_HEADER* h)
+{
+  struct LMEM_HEADER nh;
+  uint c = pool_class(h->size);
+
+  h->state = LMEM_FREE;
+  h->prev = 0;
+  h->next = pool->free_list[c];
+  if(h->next) {
+    pool_get_header(h->next, &nh);
+    nh.prev = block;
+    pool_set_header(h->next, &nh);
   }
+  pool->free_list[c] = block;
+  pool_set_header(block, h);
+}
+
+/*
+ * Remove a block from the free list of its class
+ */
+static void pool_remove_free(struct LMEM_POOL* pool, struct LMEM_HEADER* h)
+{
+  struct LMEM_HEADER lh;
 
-  /* Align blocks to 16 bytes */
-  if(size % LMEM_BLOCK_SIZE) {
-    size += LMEM_BLOCK_SIZE - size%LMEM_BLOCK_SIZE;
+  if(h->prev) {
+    pool_get_header(h->prev, &lh);
+    lh.next = h->next;
+    pool_set_header(h->prev, &lh);
+  } else {
+    pool->free_list[pool_class(h->size)] = h->next;
   }
+  if(h->next) {
+    pool_get_header(h->next, &lh);
+    lh.prev = h->prev;
+    pool_set_header(h->next, &lh);
+  }
+}
 
-  /* Find a continuous big enough free space */
-  for(i=0; i<LMEM_MAX_BLOCK; i++) {
-    /* If this block is allocated */
-    if(lmem[i].start) {
-      /* If there are no more blocks, set not found and break */
-      if(i == LMEM_MAX_BLOCK-1) {
-        start = 0;
-        break;
-      }
-      /* A possible start is at the end of this block */
-      start = lmem[i].start + lmem[i].size;
-      /* If there is enough space, break */
-      if(lmem[i+1].start==0 || lmem[i+1].start>start+size) {
-        i++; /* The right place for the new block is after current block */
-        break;
-      }
-    } else {
-      /* Next blocks are free. If it's the first, set start address */
-      if(start == 0) {
-        start = LMEM_START;
-      }
-      /* Set not found if there isn't enough space */
-      if(LMEM_LIMIT-start < size) {
-        start = 0;
+/*
+ * Update previous block size in the header
+ * of the block that follows a given one
+ */
+static void pool_set_prev_size(struct LMEM_POOL* pool, lp_t block, uint size)
+{
+  struct LMEM_HEADER h;
+  lp_t next = block + (ul_t)size * LMEM_BLOCK_SIZE;
+  if(next < pool->limit) {
+    pool_get_header(next, &h);
+    h.prev_size = size;
+    pool_set_header(next, &h);
+  }
+}
+
+/*
+ * Init a pool between start and limit addresses:
+ * all memory is a single free block
+ */
+static void pool_init(struct LMEM_POOL* pool, lp_t start, lp_t limit)
+{
+  struct LMEM_HEADER h;
+
+  memset((uchar*)pool, 0, sizeof(struct LMEM_POOL));
+  pool->start = start;
+  pool->limit = limit;
+  pool->stats.size = limit - start;
+
+  h.size = (uint)((limit - start) / LMEM_BLOCK_SIZE);
+  h.prev_size = 0;
+  pool_push_free(pool, start, &h);
+}
+
+/*
+ * Allocate memory from a pool for a given owner
+ */
+static lp_t pool_alloc(struct LMEM_POOL* pool, ul_t size, uint owner)
+{
+  struct LMEM_HEADER h;
+  struct LMEM_HEADER rh;
+  lp_t block = 0;
+  ul_t n;
+  uint c;
+
+  if(size == 0) {
+    return 0;
+  }
+
+  /* Number of paragraphs, header included */
+  n = (size + LMEM_BLOCK_SIZE - 1L) / LMEM_BLOCK_SIZE + 1L;
+
+  if(n <= 0xFFFFL) {
+    /* Blocks in the class of n could be smaller than n,
+     * unless it's a power of two. Blocks in bigger classes
+     * are always big enough, so take the first one found */
+    c = pool_class((uint)n);
+    if(n & (n-1L)) {
+      c++;
+    }
+    while(c < LMEM_CLASSES && pool->free_list[c] == 0) {
+      c++;
+    }
+    if(c < LMEM_CLASSES) {
+      block = pool->free_list[c];
+      pool_get_header(block, &h);
+    } else if(n & (n-1L)) {
+      /* Otherwise, look for a big enough block in the class of n */
+      block = pool->free_list[pool_class((uint)n)];
+      while(block) {
+        pool_get_header(block, &h);
+        if(h.size >= (uint)n) {
+          break;
+        }
+        block = h.next;
       }
-      break;
     }
   }
 
-  /* Found if start != 0 */
-  if(start != 0) {
+  if(block == 0) {
+    /* Error: not found */
+    pool->stats.failures++;
+    debugstr("LMem alloc: BAD ALLOC (%U bytes)\n\r", size);
+    return 0;
+  }
+
+  pool_remove_free(pool, &h);
+
+  /* The rest of the block is a new free block */
+  if(h.size - (uint)n > 1) {
+    rh.size = h.size - (uint)n;
+    rh.prev_size = (uint)n;
+    pool_set_prev_size(pool, block + n*LMEM_BLOCK_SIZE, rh.size);
+    pool_push_free(pool, block + n*LMEM_BLOCK_SIZE, &rh);
+    h.size = (uint)n;
+  }
+
+  h.state = LMEM_USED;
+  h.owner = owner;
+  h.next = 0;
+  h.prev = 0;
+  pool_set_header(block, &h);
+
+  pool->stats.allocs++;
+  pool->stats.used += (ul_t)h.size * LMEM_BLOCK_SIZE;
+  pool->stats.peak = max(pool->stats.peak, pool->stats.used);
+
+  debugstr("LMem alloc: %X, %U bytes\n\r", block + LMEM_BLOCK_SIZE, size);
+  return block + LMEM_BLOCK_SIZE;
+}
+
+/*
+ * Free memory allocated with pool_alloc
+ */
+static void pool_free(struct LMEM_POOL* pool, lp_t ptr)
+{
+  struct LMEM_HEADER h;
+  struct LMEM_HEADER nh;
+  lp_t block = ptr - LMEM_BLOCK_SIZE;
+  lp_t next;
+
+  if(ptr == 0) {
+    return;
+  }
+
+  /* Check it's an allocated block */
+  if(ptr <= pool->start || ptr >= pool->limit) {
+    h.state = 0;
+  } else {
+    pool_get_header(block, &h);
+  }
+  if(h.state != LMEM_USED) {
+    debugstr("LMem free: BAD FREE (%X)\n\r", ptr);
+    return;
+  }
+  pool->stats.used -= (ul_t)h.size * LMEM_BLOCK_SIZE;
+
+  /* Merge with next block if it's free */
+  next = block + (ul_t)h.size * LMEM_BLOCK_SIZE;
+  if(next < pool->limit) {
+    pool_get_header(next, &nh);
+    if(nh.state == LMEM_FREE) {
+      pool_remove_free(pool, &nh);
+      h.size += nh.size;
+    }
+  }
+
+  /* Merge with previous block if it's free */
+  if(h.prev_size) {
+    next = block - (ul_t)h.prev_size * LMEM_BLOCK_SIZE;
+    pool_get_header(next, &nh);
+    if(nh.state == LMEM_FREE) {
+      pool_remove_free(pool, &nh);
+      h.size += nh.size;
+      h.prev_size = nh.prev_size;
+      block = next;
+    }
+  }
+
+  pool_set_prev_size(pool, block, h.size);
+  pool_push_free(pool, block, &h);
+}
 
-    /* Allocate block at i */
-    memcpy(&lmem[i+1], &lmem[i],
-      (LMEM_MAX_BLOCK-i-1)*sizeof(struct LMEMBLOCK));
+/*
+ * Free all blocks of a pool that belong to a given owner
+ * Returns the number of bytes freed
+ */
+static ul_t pool_reclaim(struct LMEM_POOL* pool, uint owner)
+{
+  struct LMEM_HEADER h;
+  struct LMEM_HEADER nh;
+  lp_t block = pool->start;
+  lp_t next;
+  ul_t freed = 0;
+
+  while(block < pool->limit) {
+    pool_get_header(block, &h);
+    next = block + (ul_t)h.size * LMEM_BLOCK_SIZE;
+    if(h.state == LMEM_USED && h.owner == owner) {
+      /* The next block is merged if it's free. Skip it */
+      if(next < pool->limit) {
+        pool_get_header(next, &nh);
+        if(nh.state == LMEM_FREE) {
+          next += (ul_t)nh.size * LMEM_BLOCK_SIZE;
+        }
+      }
+      freed += (ul_t)(h.size - 1) * LMEM_BLOCK_SIZE;
+      pool_free(pool, block + LMEM_BLOCK_SIZE);
+    }
+    block = next;
+  }
+  return freed;
+}
 
-    lmem[i].start = start;
-    lmem[i].size = size;
+/*
+ * Get size of the largest free block of a pool
+ * Blocks in the highest non empty class are checked
+ */
+static ul_t pool_largest(struct LMEM_POOL* pool)
+{
+  struct LMEM_HEADER h;
+  lp_t block = 0;
+  uint largest = 0;
+  uint c = LMEM_CLASSES;
+
+  while(c > 0 && block == 0) {
+    c--;
+    block = pool->free_list[c];
+  }
+  while(block) {
+    pool_get_header(block, &h);
+    largest = max(largest, h.size);
+    block = h.next;
+  }
+  return largest ? (ul_t)(largest - 1) * LMEM_BLOCK_SIZE : 0L;
+}
 
-    debugstr("LMem alloc: %X, %U bytes\n\r", lmem[i].start, lmem[i].size);
+/*
+ * Init far memory: all memory is free
+ */
+static void lmem_init()
+{
+  pool_init(&lmem, LMEM_START, LMEM_LIMIT);
+}
 
-    return start;
+/*
+ * Init HMA: all memory is free
+ * It's only enabled if memory does not wrap around at 1MB
+ */
+static void hma_init()
+{
+  uchar low, high;
+
+  hma_enabled = 0;
+
+  if(a20_enabled) {
+    low = lmem_getbyte(0L);
+    high = lmem_getbyte(HMA_START);
+    lmem_setbyte(HMA_START, ~low);
+    hma_enabled = lmem_getbyte(0L) == low &&
+      lmem_getbyte(HMA_START) == (uchar)~low;
+    lmem_setbyte(HMA_START, high);
+    lmem_setbyte(0L, low);
+  }
+  if(hma_enabled) {
+    pool_init(&hma, HMA_START, HMA_LIMIT);
   }
+  debugstr("HMA: %s\n\r", hma_enabled ? "enabled" : "not available");
+}
 
-  /* Error: not found */
-  debugstr("LMem alloc: BAD ALLOC (%U bytes)\n\r", size);
-  return 0;
+/*
+ * Allocate far memory
+ */
+lp_t lmem_alloc(ul_t size)
+{
+  return pool_alloc(&lmem, size, LMEM_OWNER_KERNEL);
 }
 
 /*
  * Free far memory
  */
-static void lmem_free(lp_t ptr)
+void lmem_free(lp_t ptr)
+{
+  pool_free(&lmem, ptr);
+}
+
+/*
+ * Copy far memory, in chunks that lmem_copy can handle
+ */
+#define LMEM_COPY_CHUNK 0x8000L
+ul_t kernel_lmemcpy(lp_t dst, lp_t src, ul_t size)
+{
+  ul_t done = 0;
+  uint n;
+
+  /* Start from the end if destination overlaps the end of source */
+  if(dst > src && dst < src + size) {
+    while(done < size) {
+      n = (uint)min(size - done, LMEM_COPY_CHUNK);
+      done += n;
+      lmem_copy(dst + size - done, src + size - done, n);
+    }
+  } else {
+    while(done < size) {
+      n = (uint)min(size - done, LMEM_COPY_CHUNK);
+      lmem_copy(dst + done, src + done, n);
+      done += n;
+    }
+  }
+  return size;
+}
+
+/*
+ * Set far memory to a value
+ */
+ul_t kernel_lmemset(lp_t dst, uchar value, ul_t size)
+{
+  ul_t done = 0;
+  uint n;
+
+  while(done < size) {
+    n = (uint)min(size - done, LMEM_COPY_CHUNK);
+    lmem_fill(dst + done, value, n);
+    done += n;
+  }
+  return size;
+}
+
+/*
+ * Allocate kernel buffer memory, from the HMA if possible
+ */
+lp_t hma_alloc(ul_t size)
+{
+  lp_t ptr = 0;
+  if(hma_enabled) {
+    ptr = pool_alloc(&hma, size, LMEM_OWNER_KERNEL);
+  }
+  if(ptr == 0) {
+    ptr = lmem_alloc(size);
+  }
+  return ptr;
+}
+
+/*
+ * Free kernel buffer memory
+ */
+void hma_free(lp_t ptr)
+{
+  if(ptr >= HMA_START && ptr < HMA_LIMIT) {
+    pool_free(&hma, ptr);
+  } else {
+    lmem_free(ptr);
+  }
+}
+
+/*
+ * Stack usage
+ * Stacks are filled with STACK_FILL before they are used, so
+ * the deepest point they reached is the first byte, from the
+ * bottom, that doesn't hold this value anymore
+ */
+#define STACK_FILL        0x5A
+#define USTACK_CHECK_SIZE 0x4000L /* Checked bytes below program args */
+
+static lp_t ustack_start = 0; /* Bottom of filled user stack */
+static uint ustack_last = 0;  /* User stack usage of last program */
+static uint ustack_max = 0;   /* User stack usage of all programs */
+
+/*
+ * Fill the kernel stack below the frame of this function
+ */
+static void kstack_fill()
+{
+  uchar* p = kernel_stack;
+  while(p < (uchar*)&p - 16) {
+    *p++ = STACK_FILL;
+  }
+}
+
+/*
+ * Get maximum kernel stack usage
+ */
+static uint kstack_used()
+{
+  uint n = 0;
+  while(n < KERNEL_STACK_SIZE && kernel_stack[n] == STACK_FILL) {
+    n++;
+  }
+  return KERNEL_STACK_SIZE - n;
+}
+
+/*
+ * Fill the user stack, from the end of the
+ * program image up to the program args
+ */
+static void ustack_fill(uint image_size)
+{
+  ul_t size = UPROG_ARGLOC - UPROG_MEMLOC - (ul_t)image_size;
+  size = min(size, USTACK_CHECK_SIZE);
+  ustack_start = (UPROG_MEMSEG<<4) + UPROG_ARGLOC - size;
+  lmem_fill(ustack_start, STACK_FILL, (uint)size);
+}
+
+/*
+ * Update user stack usage after a program finished
+ */
+static void ustack_check()
+{
+  uchar buff[64];
+  lp_t end = (UPROG_MEMSEG<<4) + UPROG_ARGLOC;
+  lp_t p = ustack_start;
+  uint n = sizeof(buff);
+  uint i = n;
+
+  while(p < end && i == n) {
+    n = (uint)min(end - p, (lp_t)sizeof(buff));
+    lmem_copy(lp(buff), p, n);
+    i = 0;
+    while(i < n && buff[i] == STACK_FILL) {
+      i++;
+    }
+    p += i;
+  }
+  ustack_last = (uint)(end - p);
+  ustack_max = max(ustack_max, ustack_last);
+}
+
+/*
+ * Get memory usage info
+ */
+static void mem_get_info(struct MEM_INFO* info)
+{
+  memset((uchar*)info, 0, sizeof(struct MEM_INFO));
+
+  memcpy((uchar*)&info->pool[MEM_POOL_HEAP], (uchar*)&heap_stats,
+    sizeof(struct MEM_POOL_INFO));
+  info->pool[MEM_POOL_HEAP].largest = heap_largest();
+  memcpy((uchar*)&info->pool[MEM_POOL_LMEM], (uchar*)&lmem.stats,
+    sizeof(struct MEM_POOL_INFO));
+  info->pool[MEM_POOL_LMEM].largest = pool_largest(&lmem);
+  if(hma_enabled) {
+    memcpy((uchar*)&info->pool[MEM_POOL_HMA], (uchar*)&hma.stats,
+      sizeof(struct MEM_POOL_INFO));
+    info->pool[MEM_POOL_HMA].largest = pool_largest(&hma);
+  }
+
+  fs_get_cache_info(info);
+
+  info->kstack_size = KERNEL_STACK_SIZE;
+  info->kstack_max = kstack_used();
+  info->ustack_size = ustack_start ?
+    (uint)((UPROG_MEMSEG<<4) + UPROG_ARGLOC - ustack_start) : 0;
+  info->ustack_last = ustack_last;
+  info->ustack_max = ustack_max;
+}
+
+/*
+ * Get BIOS timer ticks since midnight (about 18.2 per second)
+ * Used to measure time before the timer is initialized
+ */
+static ul_t bios_ticks()
 {
-  uint i = 0;
-  if(ptr != 0) {
-    while(i<LMEM_MAX_BLOCK) {
-      /* Find block */
-      if(lmem[i].start == ptr) {
-        /* Free block */
-        lmem[i].start = 0;
-        lmem[i].size = 0;
-
-        /* Keep the list sorted and contiguous */
-        memcpy(&lmem[i], &lmem[i+1],
-          (LMEM_MAX_BLOCK-i-1)*sizeof(struct LMEMBLOCK));
-        lmem[LMEM_MAX_BLOCK-1].start = 0;
-        lmem[LMEM_MAX_BLOCK-1].size = 0;
+  return (ul_t)lmem_getbyte(0x46CL) | ((ul_t)lmem_getbyte(0x46DL) << 8) |
+    ((ul_t)lmem_getbyte(0x46EL) << 16);
+}
+
+/*
+ * Get ms elapsed since a given BIOS timer ticks count
+ */
+static ul_t bios_ticks_to_ms(ul_t start)
+{
+  ul_t ticks = bios_ticks();
+  if(ticks < start) {
+    ticks += 0x1800B0L; /* Ticks per day */
+  }
+  return (ticks - start) * 10000L / 182L;
+}
+
+/*
+ * RAM disk
+ * Its data is stored in far memory, and it's formatted
+ * each time it's created, so it's empty at boot
+ */
+uint ramdisk_size = 0; /* RAM disk size (KB), 0 if disabled */
+uint bootram_mode = BOOTRAM_DISABLED; /* Boot to RAM mode, see fs.h */
+
+/*
+ * Create the RAM disk with the given size (KB) and format it
+ * Previous RAM disk contents are lost. Size 0 disables it
+ * Returns 0 on success, an error code otherwise
+ */
+static uint ramdisk_init(uint size_kb)
+{
+  struct DISKINFO* info = &disk_info[RAMDISK_INDEX];
+  uint result = 0;
+
+  /* Release previous RAM disk */
+  if(info->ram) {
+    lmem_free(info->ram);
+  }
+  info->ram = 0;
+  info->sectors = 0;
+  info->sides = 0;
+  info->cylinders = 0;
+  info->size = 0;
+  info->probed = 1;
+  ramdisk_size = 0;
+
+  if(size_kb) {
+    info->ram = lmem_alloc((ul_t)size_kb * 1024L);
+    if(info->ram == 0) {
+      result = ERROR_NO_SPACE;
+    } else {
+      /* A single track disk */
+      info->sectors = size_kb * (1024 / SECTOR_SIZE);
+      info->sides = 1;
+      info->cylinders = 1;
+      info->size = ((ul_t)size_kb + 1023L) / 1024L; /* Round up to 1MB */
+      ramdisk_size = size_kb;
+
+      result = fs_format(RAMDISK_ID);
+      if(result >= ERROR_ANY) {
+        debugstr("RAM disk: format failed (%x)\n\r", result);
       } else {
-        i++;
+        debugstr("RAM disk: %u KB at %X\n\r", size_kb, info->ram);
+        result = 0;
       }
     }
   }
 
-  return;
+  /* Update file system info */
+  fs_init_info();
+  return result;
 }
 
 /*
@@ -258,6 +861,59 @@ static uint BCD_to_int(uchar BCD)
     return h + (BCD & 0xF);
 }
 
+/*
+ * Get key press, with the given KM_ mode
+ * Special keys are returned in the high byte,
+ * and ASCII characters in the low byte
+ */
+static uint in_key(uint mode)
+{
+  uint k;
+
+  do {
+    k = io_in_key();
+  } while((k==0 && mode==KM_WAIT_KEY) ||
+    (k!=0 && mode==KM_CLEAR_BUFFER));
+
+  if(k != 0) {
+    if(getHI(k)==(KEY_DEL    >> 8) ||
+       getHI(k)==(KEY_END    >> 8) ||
+       getHI(k)==(KEY_DEL    >> 8) ||
+       getHI(k)==(KEY_HOME   >> 8) ||
+       getHI(k)==(KEY_INS    >> 8) ||
+       getHI(k)==(KEY_PG_DN  >> 8) ||
+       getHI(k)==(KEY_PG_UP  >> 8) ||
+       getHI(k)==(KEY_PRT_SC >> 8) ||
+       getHI(k)==(KEY_UP     >> 8) ||
+       getHI(k)==(KEY_LEFT   >> 8) ||
+       getHI(k)==(KEY_RIGHT  >> 8) ||
+       getHI(k)==(KEY_DOWN   >> 8) ||
+       getHI(k)==(KEY_F1     >> 8) ||
+       getHI(k)==(KEY_F2     >> 8) ||
+       getHI(k)==(KEY_F3     >> 8) ||
+       getHI(k)==(KEY_F4     >> 8) ||
+       getHI(k)==(KEY_F5     >> 8) ||
+       getHI(k)==(KEY_F6     >> 8) ||
+       getHI(k)==(KEY_F7     >> 8) ||
+       getHI(k)==(KEY_F8     >> 8) ||
+       getHI(k)==(KEY_F9     >> 8) ||
+       getHI(k)==(KEY_F10    >> 8) ||
+       getHI(k)==(KEY_F11    >> 8) ||
+       getHI(k)==(KEY_F12    >> 8)) {
+      k &= 0xFF00;
+    } else {
+      k &= 0x00FF;
+    }
+  }
+
+  return k;
+}
+
+/*
+ * Number of batched system calls copied at once
+ */
+#define BATCH_COPY_OPS 16
+
 /*
  * Handle system calls
  * Usually:
@@ -353,45 +1009,9 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
     }
 
     case SYSCALL_IO_IN_KEY: {
-      uint mode, k;
+      uint mode;
       lmemcpy(lp(&mode), lparam, lsizeof(mode));
-      do {
-        k = io_in_key();
-      } while((k==0 && mode==KM_WAIT_KEY) ||
-        (k!=0 && mode==KM_CLEAR_BUFFER));
-
-      if(k != 0) {
-        if(getHI(k)==(KEY_DEL    >> 8) ||
-           getHI(k)==(KEY_END    >> 8) ||
-           getHI(k)==(KEY_DEL    >> 8) ||
-           getHI(k)==(KEY_HOME   >> 8) ||
-           getHI(k)==(KEY_INS    >> 8) ||
-           getHI(k)==(KEY_PG_DN  >> 8) ||
-           getHI(k)==(KEY_PG_UP  >> 8) ||
-           getHI(k)==(KEY_PRT_SC >> 8) ||
-           getHI(k)==(KEY_UP     >> 8) ||
-           getHI(k)==(KEY_LEFT   >> 8) ||
-           getHI(k)==(KEY_RIGHT  >> 8) ||
-           getHI(k)==(KEY_DOWN   >> 8) ||
-           getHI(k)==(KEY_F1     >> 8) ||
-           getHI(k)==(KEY_F2     >> 8) ||
-           getHI(k)==(KEY_F3     >> 8) ||
-           getHI(k)==(KEY_F4     >> 8) ||
-           getHI(k)==(KEY_F5     >> 8) ||
-           getHI(k)==(KEY_F6     >> 8) ||
-           getHI(k)==(KEY_F7     >> 8) ||
-           getHI(k)==(KEY_F8     >> 8) ||
-           getHI(k)==(KEY_F9     >> 8) ||
-           getHI(k)==(KEY_F10    >> 8) ||
-           getHI(k)==(KEY_F11    >> 8) ||
-           getHI(k)==(KEY_F12    >> 8)) {
-          k &= 0xFF00;
-        } else {
-          k &= 0x00FF;
-        }
-      }
-
-      return k;
+      return in_key(mode);
     }
 
     case SYSCALL_IO_GET_MOUSE_STATE: {
@@ -436,10 +1056,19 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       heap_free(lparam);
       return 0;
 
+    case SYSCALL_MEM_GET_INFO: {
+      struct MEM_INFO info;
+      mem_get_info(&info);
+      lmemcpy(lparam, lp(&info), lsizeof(info));
+      return 0;
+    }
+
     case SYSCALL_LMEM_ALLOCATE: {
       struct TSYSCALL_LMEM lm;
       lmemcpy(lp(&lm), lparam, lsizeof(lm));
-      lm.dst = lmem_alloc(lm.n);
+      /* Memory allocated by user programs is freed when they finish */
+      lm.dst = pool_alloc(&lmem, lm.n,
+        cs == KERN_MEMSEG ? LMEM_OWNER_KERNEL : LMEM_OWNER_UPROG);
       lmemcpy(lparam, lp(&lm), lsizeof(lm));
       return 0;
     }
@@ -451,21 +1080,27 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
     }
     case SYSCALL_LMEM_GET: {
       struct TSYSCALL_LMEM lm;
-      uint i = 0;
-      for(i=0; i<lsizeof(lm); i++) {
-        ((uint8_t*)(&lm))[i] = lmem_getbyte(lparam+i);
-      }
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
       return lmem_getbyte(lm.dst);
     }
     case SYSCALL_LMEM_SET: {
       struct TSYSCALL_LMEM lm;
-      uint i = 0;
-      for(i=0; i<lsizeof(lm); i++) {
-        ((uint8_t*)(&lm))[i] = lmem_getbyte(lparam+i);
-      }
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
       lmem_setbyte(lm.dst, (uint8_t)lm.n);
       return 0;
     }
+    case SYSCALL_LMEM_COPY: {
+      struct TSYSCALL_LMEMCOPY lm;
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
+      kernel_lmemcpy(lm.dst, lm.src, lm.n);
+      return 0;
+    }
+    case SYSCALL_LMEM_FILL: {
+      struct TSYSCALL_LMEMFILL lm;
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
+      kernel_lmemset(lm.dst, (uint8_t)lm.value, lm.n);
+      return 0;
+    }
 
     case SYSCALL_FS_GET_INFO: {
       struct TSYSCALL_FSINFO fi;
@@ -489,6 +1124,7 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       strcpy_s(o_entry.name, entry.name, sizeof(o_entry.name));
       o_entry.flags = entry.flags;
       o_entry.size = entry.size;
+      o_entry.time = entry.time;
       lmemcpy(fi.entry, lp(&o_entry), lsizeof(o_entry));
       return result;
     }
@@ -582,6 +1218,7 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       strcpy_s(o_entry.name, entry.name, sizeof(o_entry.name));
       o_entry.flags = entry.flags;
       o_entry.size = entry.size;
+      o_entry.time = entry.time;
       lmemcpy(fi.entry, lp(&o_entry), lsizeof(o_entry));
       return result;
     }
@@ -589,6 +1226,28 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
     case SYSCALL_FS_FORMAT:
       return fs_format(lmem_getbyte(lparam));
 
+    case SYSCALL_FS_LIST_MANY: {
+      struct TSYSCALL_FSLISTMANY fi;
+      uchar path[MAX_PATH];
+      lmemcpy(lp(&fi), lparam, lsizeof(fi));
+      lmemcpy(lp(path), fi.path, lsizeof(path));
+
+      /* Entries are written directly to the user buffer */
+      return fs_list_many(fi.entries, path, fi.first, fi.count);
+    }
+
+    case SYSCALL_FS_GET_FRAG_INFO:
+    case SYSCALL_FS_DEFRAG: {
+      struct TSYSCALL_FSFRAG fi;
+      struct FS_FRAG_INFO info;
+      uint result;
+      lmemcpy(lp(&fi), lparam, lsizeof(fi));
+      result = service == SYSCALL_FS_DEFRAG ?
+        fs_defrag(fi.disk, &info) : fs_get_frag_info(fi.disk, &info);
+      lmemcpy(fi.info, lp(&info), lsizeof(info));
+      return result;
+    }
+
     case SYSCALL_CLK_GET_TIME: {
       struct TIME t;
       uchar BCDtime[3];
@@ -630,6 +1289,97 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       lmemcpy(lp(buff), no.buff, (ul_t)no.size);
       return net_send(addr, buff, no.size);
     }
+
+    case SYSCALL_BATCH: {
+      struct TSYSCALL_BATCH bt;
+      struct TSYSCALL_BATCHOP op[BATCH_COPY_OPS];
+      uint i, j, n;
+      lmemcpy(lp(&bt), lparam, lsizeof(bt));
+      for(i=0; i<bt.count; i+=n) {
+        n = min(bt.count-i, BATCH_COPY_OPS);
+        lmemcpy(lp(op), bt.ops + (ul_t)i*sizeof(op[0]), (ul_t)n*sizeof(op[0]));
+        for(j=0; j<n; j++) {
+          op[j].result = kernel_fastcall(op[j].service,
+            op[j].a, op[j].b, op[j].c, op[j].d);
+        }
+        lmemcpy(bt.ops + (ul_t)i*sizeof(op[0]), lp(op), (ul_t)n*sizeof(op[0]));
+      }
+      return bt.count;
+    }
+
+    case SYSCALL_SYS_GET_INFO: {
+      struct SYS_INFO info;
+      info.version_hi = OS_VERSION_HI;
+      info.version_lo = OS_VERSION_LO;
+      info.build = OS_BUILD_NUM;
+      info.system_disk = system_disk;
+      info.serial_status = serial_status;
+      info.a20_enabled = a20_enabled;
+      info.unreal_enabled = unreal_enabled;
+      info.network_enabled = network_enabled;
+      info.xmem_size = xmem_size;
+      info.xcache_size = (ul_t)xcache_blocks * (ul_t)BLOCK_SIZE / 1024L;
+      info.timer_freq = system_timer_freq;
+      info.timer_ms = system_timer_ms;
+      info.boot_ms = boot_time_ms;
+      info.boot_disks_ms = boot_disks_ms;
+      info.bootpf = bootpf_used == BOOTPF_ENABLED ? SYS_BOOTPF_USED :
+        bootpf_used == BOOTPF_RECORD ? SYS_BOOTPF_RECORDED : SYS_BOOTPF_NONE;
+      info.bootpf_boot_ms = bootpf_info.state == BOOTPF_ENABLED ?
+        bootpf_info.boot_ms : 0;
+      lmemcpy(lparam, lp(&info), lsizeof(info));
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Handle fast system calls
+ * Parameters are passed in registers, so they don't need
+ * to be copied, and result is returned in dx:ax.
+ * Only services with up to four uint parameters are here
+ */
+ul_t kernel_fastcall(uint service, uint a, uint b, uint c, uint d)
+{
+  switch(service) {
+
+    case SYSCALL_IO_SET_PIXEL:
+      video_set_pixel(a, b, c);
+      return 0;
+
+    case SYSCALL_IO_DRAW_CHAR:
+      draw_char(a, b, c, d, NO_BACKGROUND);
+      return 0;
+
+    case SYSCALL_IO_OUT_CHAR:
+      io_out_char((uchar)a);
+      return 0;
+
+    case SYSCALL_IO_OUT_CHAR_ATTR:
+      io_out_char_attr(a, b, (uchar)c, (uchar)d);
+      return 0;
+
+    case SYSCALL_IO_SET_CURSOR_POS:
+      io_set_cursor_pos(a, b);
+      return 0;
+
+    case SYSCALL_IO_IN_KEY:
+      return in_key(a);
+
+    case SYSCALL_IO_OUT_CHAR_SERIAL:
+      io_out_char_serial((uchar)a);
+      return 0;
+
+    case SYSCALL_IO_OUT_CHAR_DEBUG:
+      if(serial_debug) {
+        io_out_char_serial((uchar)a);
+      }
+      return 0;
+
+    case SYSCALL_CLK_GET_MILISEC:
+      return system_timer_ms;
   }
 
   return 0;
@@ -813,17 +1563,54 @@ void kernel_time_tick()
  */
 static void execute(uchar* str);
 static void execute_file(uchar* path);
+
+/*
+ * List all entries of a directory in a single traversal
+ * Output: n, number of entries or error code
+ * Returns a far memory array of FS_ENTRY, to be freed
+ * with lmem_free, or 0 if there are no entries or error
+ */
+static lp_t list_all(uchar* path, uint* n)
+{
+  struct FS_ENTRY entry;
+  lp_t entries;
+
+  /* Get number of entries */
+  *n = fs_list_many(lp(&entry), path, 0, 1);
+  if(*n >= ERROR_ANY || *n == 0) {
+    return 0;
+  }
+
+  entries = lmem_alloc((ul_t)*n * lsizeof(struct FS_ENTRY));
+  if(entries == 0) {
+    *n = ERROR_NO_SPACE;
+    return 0;
+  }
+  *n = fs_list_many(entries, path, 0, *n);
+  if(*n >= ERROR_ANY) {
+    lmem_free(entries);
+    return 0;
+  }
+  return entries;
+}
+
 void kernel()
 {
-  uint result;
-  uint i;
-  uint n;
+  ul_t start_ticks = bios_ticks();
+  ul_t ticks;
+  ul_t timer_start_ms;
+
+  /* Fill stack to measure its usage */
+  kstack_fill();
 
   /* Init heap */
   heap_init();
 
-  /* Init far memory */
+  /* Init far memory. Use flat addressing if possible */
+  unreal_enabled = unreal_init();
+  debugstr("Unreal mode: %s\n\r", unreal_enabled ? "enabled" : "not available");
   lmem_init();
+  hma_init();
 
   /* Init video */
   if(graphics_mode) {
@@ -848,46 +1635,32 @@ void kernel()
   disk_info[3].id = 0x81; /* Hard disk 1 */
   strcpy_s(disk_info[3].name, "hd1", sizeof(disk_info[3].name));
 
-  /* Initialize hardware related disks info */
-  debugstr("Disk auxiliar buffer at: %x\n\r", disk_buff);
-
-  for(i=0; i<MAX_DISK; i++) {
-    n = index_to_disk(i);
-
-    /* Try to get info */
-    result = get_disk_info(n, &disk_info[i].sectors,
-      &disk_info[i].sides, &disk_info[i].cylinders);
-
-    /* Use retrieved data if success */
-    if(result == 0) {
-      disk_info[i].size = ((ul_t)disk_info[i].sectors *
-        (ul_t)disk_info[i].sides * (ul_t)disk_info[i].cylinders) /
-        (1048576L / (ul_t)BLOCK_SIZE);
-
-      disk_info[i].last_access = system_timer_ms;
+  disk_info[RAMDISK_INDEX].id = RAMDISK_ID; /* RAM disk */
+  strcpy_s(disk_info[RAMDISK_INDEX].name, "rd0", sizeof(disk_info[RAMDISK_INDEX].name));
 
-      debugstr("DISK (%x : size=%U MB sect_per_track=%d, sides=%d, cylinders=%d)\n\r",
-        n, disk_info[i].size, disk_info[i].sectors, disk_info[i].sides,
-        disk_info[i].cylinders);
+  /* Only the system disk is probed now. Other disks
+   * are probed on first access (see disk_probe in fs.c) */
+  debugstr("Disk auxiliar buffer at: %x\n\r", disk_buff);
 
-    } else {
-      /* Failed. Do not use this disk */
-      disk_info[i].sectors = 0;
-      disk_info[i].sides = 0;
-      disk_info[i].cylinders = 0;
-      disk_info[i].size = 0;
-      disk_info[i].last_access = 0;
-    }
-  }
+  /* Init disk cache in extended memory. Before mounting
+   * disks, so blocks read to mount them are cached */
+  xmem_size = xmem_get_size();
+  xcache_blocks = fs_init_xcache(xmem_size);
 
-  /* Init FS info */
+  /* Init FS info. Blocks read from now on
+   * can be recorded in the boot profile */
+  fs_bootpf_begin();
+  ticks = bios_ticks();
   fs_init_info();
+  boot_disks_ms = bios_ticks_to_ms(ticks);
 
   /* Init PIC */
   PIC_init();
 
-  /* Init timer at 100 Hz */
+  /* Init timer at 100 Hz. From now on, use it to measure boot time */
+  boot_time_ms = bios_ticks_to_ms(start_ticks);
   timer_init(100L);
+  timer_start_ms = system_timer_ms;
 
   /* Init mouse */
   mouse_init();
@@ -898,12 +1671,20 @@ void kernel()
   /* Init network */
   net_init();
 
+  /* Prefetch blocks read in previous boots, or record them */
+  bootpf_used = fs_bootpf_start(&bootpf_info);
+
   /* Execute config file */
   execute_file("config.ini");
 
   putstr("Starting...\n\r");
   debugstr("Starting...\n\r");
 
+  /* Boot finished */
+  boot_time_ms += system_timer_ms - timer_start_ms;
+  fs_bootpf_stop(&bootpf_info, boot_time_ms);
+  debugstr("Boot time: %Ums (disks: %Ums)\n\r", boot_time_ms, boot_disks_ms);
+
   /* Integrated CLI */
   while(1) {
     uchar  str[72];
@@ -970,11 +1751,15 @@ static void execute(uchar* str)
 
     if(argc == 2) {
       uchar line[64];
-      struct SFS_ENTRY entry;
+      struct FS_ENTRY entry;
+      lp_t entries;
 
-      /* Get number of entries in target dir */
-      n = fs_list(&entry, argv[1], 0);
-      if(n >= ERROR_ANY) {
+      /* Get all entries in target dir */
+      entries = list_all(argv[1], &n);
+      if(n == ERROR_NO_SPACE) {
+        putstr("not enough memory\n\r");
+        return;
+      } else if(n >= ERROR_ANY) {
         putstr("path not found\n\r");
         return;
       }
@@ -987,12 +1772,8 @@ static void execute(uchar* str)
           struct TIME etime;
           uint c, size;
 
-          /* Get entry */
-          result = fs_list(&entry, argv[1], i);
-          if(result >= ERROR_ANY) {
-            putstr("Error\n\r");
-            break;
-          }
+          lmemcpy(lp(&entry), entries + (lp_t)i*lsizeof(struct FS_ENTRY),
+            lsizeof(struct FS_ENTRY));
 
           /* Listed entry is a dir? If so,
            * start this line with a '+' */
@@ -1025,6 +1806,7 @@ static void execute(uchar* str)
             etime.second<10?"0":"", etime.second);
         }
         putstr("\n\r");
+        lmem_free(entries);
       }
     } else {
       putstr("usage: list <path>\n\r");
@@ -1091,130 +1873,6 @@ static void execute(uchar* str)
     } else {
       putstr("usage: copy <srcpath> <dstpath>\n\r");
     }
-  } else if(strcmp(argv[0], "info") == 0) {
-    /* Info command: show system info */
-    if(argc == 1) {
-      putstr("\n\r");
-      putstr("NANO S16 [Version %u.%u build %u]\n\r",
-        OS_VERSION_HI, OS_VERSION_LO, OS_BUILD_NUM);
-      putstr("\n\r");
-
-      putstr("Disks:\n\r");
-      fs_init_info(); /* Rescan disks */
-      for(i=0; i<MAX_DISK; i++) {
-        n = index_to_disk(i);
-        if(disk_info[i].size) {
-          putstr("%s %s(%UMB)   Disk size: %UMB\n\r",
-            disk_to_string(n), disk_info[i].fstype == FS_TYPE_NSFS ? "NSFS" : "UNKN",
-            (ul_t)blocks_to_MB(disk_info[i].fssize), disk_info[i].size);
-        }
-      }
-      putstr("\n\r");
-      putstr("System disk: %s\n\r", disk_to_string(system_disk));
-      putstr("Serial port status: %s\n\r", serial_status & 0x80 ? "Error" : "Enabled");
-      putstr("A20 Line status: %s\n\r", a20_enabled ? "Enabled" : "Disabled");
-      putstr("Network status: %s\n\r", network_enabled ? "Enabled" : "Disabled");
-      putstr("Timer frequency: %UHz\n\r", system_timer_freq);
-      putstr("System time alive: %Ums\n\r", system_timer_ms);
-      putstr("\n\r");
-    } else {
-      putstr("usage: info\n\r");
-    }
-  } else if(strcmp(argv[0], "clone") == 0) {
-    /* Clone command: clone system disk in another disk */
-    if(argc == 2) {
-      struct SFS_ENTRY entry;
-      uint disk, disk_index;
-      uint sysdisk_index = disk_to_index(system_disk);
-
-      /* Show source disk info */
-      putstr("System disk: %s    fs=%s  size=%UMB\n\r",
-        disk_to_string(system_disk),
-        disk_info[sysdisk_index].fstype == FS_TYPE_NSFS ? "NSFS   " : "unknown",
-        blocks_to_MB(disk_info[sysdisk_index].fssize));
-
-      /* Check target disk */
-      disk = string_to_disk(argv[1]);
-      if(disk == ERROR_NOT_FOUND) {
-        putstr("Target disk not found (%s)\n\r", argv[1]);
-        return;
-      }
-      if(disk == system_disk) {
-        putstr("Target disk can't be the system disk\n\r");
-        return;
-      }
-
-      /* Show target disk info */
-      disk_index = disk_to_index(disk);
-      putstr("Target disk: %s    fs=%s  size=%UMB\n\r",
-        disk_to_string(disk),
-        disk_info[disk_index].fstype == FS_TYPE_NSFS ? "NSFS   " : "unknown",
-        blocks_to_MB(disk_info[disk_index].fssize));
-
-      putstr("\n\r");
-
-      /* User should know this */
-      putstr("Target disk (%s) will lose all data\n\r", disk_to_string(disk));
-      putstr("Target disk (%s) will contain a %UMB NSFS filesystem after operation\n\r",
-        disk_to_string(disk), disk_info[disk_index].size);
-
-      /* Ask for confirmation */
-      putstr("\n\r");
-      putstr("Press 'y' to confirm: ");
-      if(getkey(KM_WAIT_KEY) != 'y') {
-        putstr("\n\rUser aborted operation\n\r");
-        return;
-      }
-
-      putstr("y\n\r");
-
-      /* Format disk and copy kernel */
-      putstr("Formatting and copying system files...\n\r");
-      result = fs_format(disk);
-      if(result != 0) {
-        putstr("Error formatting disk. Aborted\n\r");
-        return;
-      }
-
-      /* Copy user files */
-      putstr("Copying user files...\n\r");
-
-      n = fs_list(&entry, ROOT_DIR_NAME, 0);
-      if(n >= ERROR_ANY) {
-        putstr("Error creating file list\n\r");
-        return;
-      }
-
-      /* List entries */
-      for(i=0; i<n; i++) {
-        uchar dst[MAX_PATH];
-        result = fs_list(&entry, ROOT_DIR_NAME, i);
-        if(result >= ERROR_ANY) {
-          putstr("Error copying files. Aborted\n\r");
-          break;
-        }
-
-        strcpy_s(dst, argv[1], sizeof(dst));
-        strcat_s(dst, PATH_SEPARATOR_S, sizeof(dst));
-        strcat_s(dst, entry.name, sizeof(dst));
-
-        debugstr("copy %s %s\n\r", entry.name, dst);
-        result = fs_copy(entry.name, dst);
-        /* Skip ERROR_EXISTS errors, because system files were copied
-         * by fs_format function, so they are expected to fail */
-        if(result >= ERROR_ANY && result != ERROR_EXISTS) {
-          putstr("Error copying %s. Aborted\n\r", entry.name);
-          break;
-        }
-      }
-
-      /* Notify result */
-      if(result < ERROR_ANY) {
-        putstr("Operation completed\n\r");
-      }
-    } else {
-      putstr("usage: clone <target_disk>\n\r");
-    }
 
   } else if(strcmp(argv[0], "read") == 0) {
     /* Read command: read a file */
@@ -1271,6 +1929,7 @@ static void execute(uchar* str)
   } else if(strcmp(argv[0], "shutdown") == 0) {
     /* Shutdown command: Shutdown computer */
     if(argc == 1) {
+      fs_sync();  /* Write pending file system updates */
       apm_shutdown();
 
       /* This computer does not support APM */
@@ -1279,6 +1938,7 @@ static void execute(uchar* str)
       putstr("Turn off computer\n\r");
       halt(); /* Halt() */
     } else if(argc == 2 && strcmp(argv[1], "reboot") == 0) {
+        fs_sync();  /* Write pending file system updates */
         reboot();  /* Reboot computer */
         putstr("Reboot not supported\n\r");
     } else {
@@ -1293,6 +1953,13 @@ static void execute(uchar* str)
       putstr("graphics: %s    - use graphics mode\n\r", graphics_mode ? " enabled" : "disabled");
       putstr("net_IP: %u.%u.%u.%u\n\r", local_ip[0], local_ip[1], local_ip[2], local_ip[3]);
       putstr("net_gate: %u.%u.%u.%u\n\r", local_gate[0], local_gate[1], local_gate[2], local_gate[3]);
+      putstr("ramdisk: %u KB - RAM disk (rd0) size, 0 to disable it\n\r", ramdisk_size);
+      putstr("bootram: %s - keep system disk in memory\n\r",
+        bootram_mode == BOOTRAM_ENABLED ? " enabled" :
+        bootram_mode == BOOTRAM_VOLATILE ? "volatile" : "disabled");
+      putstr("bootprofile: %s - prefetch blocks read at boot\n\r",
+        fs_bootpf_get(&bootpf_info) == BOOTPF_ENABLED ? " enabled" :
+        bootpf_info.state == BOOTPF_RECORD ? "  record" : "disabled");
       putstr("\n\r");
     } else if(argc == 2 && strcmp(argv[1], "save") == 0) {
       uchar config_file[512];
@@ -1316,6 +1983,16 @@ static void execute(uchar* str)
       strcat_s(config_file, ip_to_str(tmps, local_gate), sizeof(config_file));
       strcat_s(config_file, "\n", sizeof(config_file));
 
+      strcat_s(config_file, "config ramdisk ", sizeof(config_file));
+      formatstr(tmps, sizeof(tmps), "%u", ramdisk_size);
+      strcat_s(config_file, tmps, sizeof(config_file));
+      strcat_s(config_file, "\n", sizeof(config_file));
+
+      strcat_s(config_file, "config bootram ", sizeof(config_file));
+      strcat_s(config_file, bootram_mode == BOOTRAM_ENABLED ? "enabled" :
+        bootram_mode == BOOTRAM_VOLATILE ? "volatile" : "disabled", sizeof(config_file));
+      strcat_s(config_file, "\n", sizeof(config_file));
+
       fs_write_file(config_file, "config.ini", 0, strlen(config_file)+1, WF_CREATE|WF_TRUNCATE);
       debugstr("Config file saved\n\r");
 
@@ -1342,6 +2019,32 @@ static void execute(uchar* str)
         str_to_ip(local_ip, argv[2]);
       } else if(strcmp(argv[1], "net_gate") == 0) {
         str_to_ip(local_gate, argv[2]);
+      } else if(strcmp(argv[1], "ramdisk") == 0) {
+        if(!sisu(argv[2])) {
+          putstr("Invalid value. Size in KB expected\n\r");
+        } else if(ramdisk_init(stou(argv[2])) != 0) {
+          putstr("Can't create a %s KB RAM disk\n\r", argv[2]);
+        }
+      } else if(strcmp(argv[1], "bootram") == 0) {
+        n = strcmp(argv[2], "enabled") == 0 ? BOOTRAM_ENABLED :
+          strcmp(argv[2], "volatile") == 0 ? BOOTRAM_VOLATILE :
+          strcmp(argv[2], "disabled") == 0 ? BOOTRAM_DISABLED : ERROR_NOT_FOUND;
+        if(n == ERROR_NOT_FOUND) {
+          putstr("Invalid value. Valid values are: enabled, volatile, disabled\n\r");
+        } else if(fs_set_bootram(n) >= ERROR_ANY) {
+          putstr("Can't keep system disk in memory\n\r");
+          bootram_mode = BOOTRAM_DISABLED;
+        } else {
+          bootram_mode = n;
+        }
+      } else if(strcmp(argv[1], "bootprofile") == 0) {
+        n = strcmp(argv[2], "record") == 0 ? BOOTPF_RECORD :
+          strcmp(argv[2], "disabled") == 0 ? BOOTPF_DISABLED : ERROR_NOT_FOUND;
+        if(n == ERROR_NOT_FOUND) {
+          putstr("Invalid value. Valid values are: record, disabled\n\r");
+        } else if(fs_bootpf_set(n) >= ERROR_ANY) {
+          putstr("Can't change boot profile\n\r");
+        }
       }
 
     } else {
@@ -1354,13 +2057,11 @@ static void execute(uchar* str)
       putstr("\n\r");
       putstr("Built-in commands:\n\r");
       putstr("\n\r");
-      putstr("clone    - clone system in another disk\n\r");
       putstr("cls      - clear the screen\n\r");
       putstr("config   - show or set config\n\r");
       putstr("copy     - create a copy of a file or directory\n\r");
       putstr("delete   - delete entry\n\r");
       putstr("help     - show this help\n\r");
-      putstr("info     - show system info\n\r");
       putstr("list     - list directory contents\n\r");
       putstr("makedir  - create directory\n\r");
       putstr("move     - move file or directory\n\r");
@@ -1443,6 +2144,7 @@ static void execute(uchar* str)
     } else {
       uint uarg = 0;
       uint c = 0;
+      ul_t reclaimed;
       lp_t arg_var = (UPROG_MEMSEG<<4)+UPROG_ARGLOC;
       lp_t arg_str = (UPROG_MEMSEG<<4)+UPROG_STRLOC;
 
@@ -1466,7 +2168,16 @@ static void execute(uchar* str)
         prog_file_name, (uint)entry.size);
 
       /* Run program */
+      ustack_fill((uint)entry.size);
       uprog_call(argc, UPROG_ARGLOC);
+      ustack_check();
+
+      /* Free far memory that the program did not free */
+      reclaimed = pool_reclaim(&lmem, LMEM_OWNER_UPROG);
+      if(reclaimed) {
+        debugstr("CLI: Reclaimed %U bytes of far memory from %s\n\r",
+          reclaimed, prog_file_name);
+      }
     }
   }
 }
@@ -9,11 +9,18 @@
 #define OS_VERSION_LO 0
 #define OS_BUILD_NUM 20
 
+/* Kernel code and data segment */
+#define KERN_MEMSEG 0x0800L
+
 /*
  * Hardware related disk information is handled by the kernel module.
  * File system related information is handled by file system module
  */
-#define MAX_DISK 4
+#define MAX_DISK 5
+
+/* The last disk is a RAM disk. Its data is stored in far memory */
+#define RAMDISK_INDEX 4
+#define RAMDISK_ID    0xE0
 
 /* Size of a disk sector */
 #define SECTOR_SIZE 512
@@ -22,6 +29,10 @@
  * to avoid DMA error */
 extern uchar disk_buff[SECTOR_SIZE];
 
+/* Kernel stack, see load.s */
+#define KERNEL_STACK_SIZE 0x3000
+extern uchar kernel_stack[KERNEL_STACK_SIZE];
+
 struct DISKINFO {
     uint  id;          /* Disk id */
     uchar name[4];     /* Disk name */
@@ -32,11 +43,16 @@ struct DISKINFO {
     uint  cylinders;
     ul_t  size;        /* Disk size (MB) */
     ul_t  last_access; /* Last accessed time (system ms) */
-} disk_info[MAX_DISK];
+    lp_t  ram;         /* RAM disk data, 0 for BIOS disks */
+    uint  probed;      /* Hardware info and file system were read */
+};
+
+extern struct DISKINFO disk_info[MAX_DISK]; /* Disk info */
 
 extern uchar system_disk; /* System disk */
 extern uchar serial_status; /* Serial port status */
 extern uchar a20_enabled; /* A20 line enabled */
+extern uchar unreal_enabled; /* Flat memory access (unreal mode) */
 extern uint serial_debug; /* Debug info through serial port */
 
 extern uint graphics_mode; /* Graphics mode enabled */
@@ -45,6 +61,51 @@ extern uint screen_height_px; /* Screen height (pixels) */
 extern uint screen_width_c; /* Screen width (text) */
 extern uint screen_height_c; /* Screen height (text) */
 
+/*
+ * Allocate far memory for kernel usage
+ * Returns 0 if there is not enough memory
+ */
+lp_t lmem_alloc(ul_t size);
+
+/*
+ * Free far memory allocated with lmem_alloc
+ */
+void lmem_free(lp_t ptr);
+
+/*
+ * Copy size bytes of far memory. Areas can overlap
+ */
+ul_t kernel_lmemcpy(lp_t dst, lp_t src, ul_t size);
+
+/*
+ * Set size bytes of far memory to value
+ */
+ul_t kernel_lmemset(lp_t dst, uchar value, ul_t size);
+
+/*
+ * Handle system calls. cs is the caller code segment
+ * The kernel build of ulib calls it directly
+ */
+uint kernel_service(uint cs, uint service, lp_t lparam);
+
+/*
+ * Handle fast system calls, with parameters in registers
+ */
+ul_t kernel_fastcall(uint service, uint a, uint b, uint c, uint d);
+
+/*
+ * Allocate memory for kernel buffers and caches
+ * It's in the HMA if A20 is enabled and there is space left,
+ * or in far memory otherwise. Use lmem functions to access it
+ * Returns 0 if there is not enough memory
+ */
+lp_t hma_alloc(ul_t size);
+
+/*
+ * Free memory allocated with hma_alloc
+ */
+void hma_free(lp_t ptr);
+
 extern ul_t system_timer_freq; /* Actual frequency of timer */
 extern ul_t system_timer_ms; /* Number of whole ms since timer initialized */
 
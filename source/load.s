@@ -82,8 +82,9 @@ LOADSEG EQU 0x0800 ; Where this code is loaded
 
 SECTION .bss
 
-kernel_stack:
-resb 0x3000                    ; kernel stack
+global _kernel_stack
+_kernel_stack:
+resb 0x3000                    ; kernel stack, KERNEL_STACK_SIZE in kernel.h
 kernel_stack_top:
 global _disk_buff
 _disk_buff:
@@ -0,0 +1,126 @@
+/*
+ * User program: Clone system disk in another disk
+ */
+
+#include "types.h"
+#include "ulib/ulib.h"
+
+#define LIST_ENTRIES 4 /* Root entries listed at once */
+
+/*
+ * Find disk info given its id or its name (if name is not 0)
+ * Returns 0 on success
+ */
+static uint find_disk(struct FS_INFO* fsinfo, uint disk, uchar* name)
+{
+  uint n, i;
+  n = get_fsinfo(0, fsinfo);
+  for(i=0; i<n; i++) {
+    get_fsinfo(i, fsinfo);
+    if(name ? strcmp(fsinfo->name, name) == 0 : fsinfo->id == disk) {
+      return 0;
+    }
+  }
+  return ERROR_NOT_FOUND;
+}
+
+/*
+ * Program entry point
+ */
+uint main(uint argc, uchar* argv[])
+{
+  struct FS_ENTRY entries[LIST_ENTRIES];
+  struct FS_INFO sysinfo;
+  struct FS_INFO target;
+  struct SYS_INFO info;
+  uint first, n, i;
+  uint result = 0;
+
+  if(argc != 2) {
+    putstr("usage: clone <target_disk>\n\r");
+    return 1;
+  }
+
+  /* Show source disk info */
+  get_sysinfo(&info);
+  if(find_disk(&sysinfo, info.system_disk, 0) != 0) {
+    putstr("System disk not found\n\r");
+    return 1;
+  }
+  putstr("System disk: %s    fs=%s  size=%UMB\n\r",
+    sysinfo.name, sysinfo.fs_type == FS_TYPE_NSFS ? "NSFS   " : "unknown",
+    sysinfo.fs_size);
+
+  /* Check target disk */
+  if(find_disk(&target, 0, argv[1]) != 0) {
+    putstr("Target disk not found (%s)\n\r", argv[1]);
+    return 1;
+  }
+  if(target.id == sysinfo.id) {
+    putstr("Target disk can't be the system disk\n\r");
+    return 1;
+  }
+
+  /* Show target disk info */
+  putstr("Target disk: %s    fs=%s  size=%UMB\n\r",
+    target.name, target.fs_type == FS_TYPE_NSFS ? "NSFS   " : "unknown",
+    target.fs_size);
+
+  putstr("\n\r");
+
+  /* User should know this */
+  putstr("Target disk (%s) will lose all data\n\r", target.name);
+  putstr("Target disk (%s) will contain a %UMB NSFS filesystem after operation\n\r",
+    target.name, target.disk_size);
+
+  /* Ask for confirmation */
+  putstr("\n\r");
+  putstr("Press 'y' to confirm: ");
+  if(getkey(KM_WAIT_KEY) != 'y') {
+    putstr("\n\rUser aborted operation\n\r");
+    return 1;
+  }
+
+  putstr("y\n\r");
+
+  /* Format disk and copy kernel */
+  putstr("Formatting and copying system files...\n\r");
+  if(format(target.id) != 0) {
+    putstr("Error formatting disk. Aborted\n\r");
+    return 1;
+  }
+
+  /* Copy user files */
+  putstr("Copying user files...\n\r");
+
+  first = 0;
+  do {
+    n = list_many(entries, ".", first, LIST_ENTRIES);
+    if(n >= ERROR_ANY) {
+      putstr("Error creating file list\n\r");
+      return 1;
+    }
+
+    for(i=0; i<LIST_ENTRIES && first+i<n; i++) {
+      uchar dst[64];
+
+      strcpy_s(dst, target.name, sizeof(dst));
+      strcat_s(dst, "/", sizeof(dst));
+      strcat_s(dst, entries[i].name, sizeof(dst));
+
+      debugstr("copy %s %s\n\r", entries[i].name, dst);
+      result = copy(entries[i].name, dst);
+      /* Skip ERROR_EXISTS errors, because system files were copied
+       * by format function, so they are expected to fail */
+      if(result >= ERROR_ANY && result != ERROR_EXISTS) {
+        putstr("Error copying %s. Aborted\n\r", entries[i].name);
+        return 1;
+      }
+    }
+    first += LIST_ENTRIES;
+  } while(first < n);
+
+  /* Notify result */
+  putstr("Operation completed\n\r");
+  return 0;
+}
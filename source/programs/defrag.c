@@ -0,0 +1,74 @@
+/*
+ * User program: Disk defragmenter
+ */
+
+#include "types.h"
+#include "ulib/ulib.h"
+
+/*
+ * Show layout stats
+ */
+static void show_layout(uchar* title, struct FS_FRAG_INFO* frag)
+{
+  putstr("%s files=%u fragmented=%u blocks=%U runs=%U reads=%U\n\r",
+    title, frag->files, frag->fragmented, frag->blocks, frag->runs,
+    frag->accesses);
+}
+
+/*
+ * Program entry point
+ */
+uint main(uint argc, uchar* argv[])
+{
+  struct FS_FRAG_INFO frag;
+  struct FS_INFO fsinfo;
+  uint result;
+  uint disk;
+  uint n, i;
+
+  if(argc != 2) {
+    putstr("usage: defrag <disk>\n\r");
+    return 1;
+  }
+
+  /* Find disk id from its name */
+  disk = ERROR_NOT_FOUND;
+  n = get_fsinfo(0, &fsinfo);
+  for(i=0; i<n; i++) {
+    get_fsinfo(i, &fsinfo);
+    if(strcmp(fsinfo.name, argv[1]) == 0) {
+      disk = fsinfo.id;
+      break;
+    }
+  }
+  if(disk == ERROR_NOT_FOUND) {
+    putstr("Disk not found (%s)\n\r", argv[1]);
+    return 1;
+  }
+
+  /* Show current state */
+  result = get_fraginfo(disk, &frag);
+  if(result >= ERROR_ANY) {
+    putstr("Can't analyze disk %s\n\r", argv[1]);
+    return 1;
+  }
+  show_layout("Before:", &frag);
+  if(frag.fragmented == 0) {
+    putstr("Nothing to do\n\r");
+    return 0;
+  }
+
+  /* Defrag and show results */
+  putstr("Defragmenting...\n\r");
+  result = defrag(disk, &frag);
+  if(result >= ERROR_ANY) {
+    putstr("Error defragmenting disk. Aborted\n\r");
+    return 1;
+  }
+  show_layout("After: ", &frag);
+  putstr("Relocated files: %u (%u skipped, not enough contiguous space)\n\r",
+    frag.moved, frag.skipped);
+  putstr("Read time of relocated files: %Ums before, %Ums after\n\r",
+    frag.before_ms, frag.after_ms);
+  return 0;
+}
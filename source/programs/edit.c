@@ -65,7 +65,7 @@ static void editor_putchar(uint col, uint row, uchar c)
 
   if(c != buff_c) {
     lmemcpy(screen_buff + screen_offset, lp(&c), 1L);
-    putchar_attr(col, row, c, EDITOR_ATTRIBUTES);
+    batch_putchar_attr(col, row, c, EDITOR_ATTRIBUTES);
   }
 }
 
@@ -128,6 +128,9 @@ void show_buffer_at_line(lp_t buff, uint n)
       next_line(SHOW_CURRENT, l, 0L);
     }
   }
+
+  /* Characters are queued by editor_putchar */
+  batch_flush();
 }
 
 /*
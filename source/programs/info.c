@@ -0,0 +1,64 @@
+/*
+ * User program: Show system info
+ */
+
+#include "types.h"
+#include "ulib/ulib.h"
+
+/*
+ * Program entry point
+ */
+uint main(uint argc, uchar* argv[])
+{
+  struct SYS_INFO info;
+  struct FS_INFO fsinfo;
+  uchar* system_disk = "unk";
+  uint n, i;
+
+  if(argc != 1) {
+    putstr("usage: info\n\r");
+    return 1;
+  }
+
+  get_sysinfo(&info);
+  putstr("\n\r");
+  putstr("NANO S16 [Version %u.%u build %u]\n\r",
+    info.version_hi, info.version_lo, info.build);
+  putstr("\n\r");
+
+  putstr("Disks:\n\r");
+  n = get_fsinfo(0, &fsinfo);
+  for(i=0; i<n; i++) {
+    get_fsinfo(i, &fsinfo);
+    putstr("%s %s(%UMB)   Disk size: %UMB",
+      fsinfo.name, fsinfo.fs_type == FS_TYPE_NSFS ? "NSFS" : "UNKN",
+      fsinfo.fs_size, fsinfo.disk_size);
+    if(fsinfo.fs_type == FS_TYPE_NSFS) {
+      putstr("   Free: %UKB (largest %UKB)   Free entries: %U",
+        fsinfo.fs_free, fsinfo.fs_largest_free, fsinfo.free_entries);
+    }
+    putstr("\n\r");
+    if(fsinfo.id == info.system_disk) {
+      system_disk = fsinfo.name;
+    }
+  }
+  putstr("\n\r");
+  putstr("System disk: %s\n\r", system_disk);
+  putstr("Serial port status: %s\n\r", info.serial_status & 0x80 ? "Error" : "Enabled");
+  putstr("A20 Line status: %s\n\r", info.a20_enabled ? "Enabled" : "Disabled");
+  putstr("Flat memory access: %s\n\r", info.unreal_enabled ? "Enabled" : "Disabled");
+  putstr("Extended memory: %UKB   Disk cache: %UKB\n\r", info.xmem_size,
+    info.xcache_size);
+  putstr("Network status: %s\n\r", info.network_enabled ? "Enabled" : "Disabled");
+  putstr("Timer frequency: %UHz\n\r", info.timer_freq);
+  putstr("System time alive: %Ums\n\r", info.timer_ms);
+  putstr("Boot time: %Ums (disks: %Ums, %s)", info.boot_ms, info.boot_disks_ms,
+    info.bootpf == SYS_BOOTPF_USED ? "boot profile used" :
+    info.bootpf == SYS_BOOTPF_RECORDED ? "boot profile recorded" : "no boot profile");
+  if(info.bootpf_boot_ms) {
+    putstr("   Without boot profile: %Ums", info.bootpf_boot_ms);
+  }
+  putstr("\n\r");
+  putstr("\n\r");
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * User program: Show memory usage
+ */
+
+#include "types.h"
+#include "ulib/ulib.h"
+
+/*
+ * Program entry point
+ */
+uint main(uint argc, uchar* argv[])
+{
+  struct MEM_INFO info;
+  uchar* pool_name[MEM_POOLS];
+  uint i;
+
+  if(argc != 1) {
+    putstr("usage: mem\n\r");
+    return 1;
+  }
+
+  pool_name[MEM_POOL_HEAP] = "Kernel heap";
+  pool_name[MEM_POOL_LMEM] = "Far memory";
+  pool_name[MEM_POOL_HMA] = "HMA";
+
+  get_meminfo(&info);
+  putstr("\n\r");
+  for(i=0; i<MEM_POOLS; i++) {
+    struct MEM_POOL_INFO* pi = &info.pool[i];
+    if(pi->size == 0) {
+      putstr("%s: not available\n\r", pool_name[i]);
+      continue;
+    }
+    putstr("%s: %U bytes   Used: %U (peak: %U)   Free: %U (largest: %U)\n\r",
+      pool_name[i], pi->size, pi->used, pi->peak,
+      pi->size - pi->used, pi->largest);
+    putstr("  Allocations: %U   Failed: %U\n\r", pi->allocs, pi->failures);
+  }
+  putstr("Disk cache: %u blocks   Hits: %U   Misses: %U\n\r",
+    info.xcache_blocks, info.xcache_hits, info.xcache_misses);
+  putstr("Boot RAM disk: %u/%u blocks used\n\r",
+    info.bootram_used, info.bootram_blocks);
+  putstr("Kernel stack: %u bytes   Max used: %u\n\r",
+    info.kstack_size, info.kstack_max);
+  putstr("User stack: %u bytes checked   Max used: %u (last program: %u)\n\r",
+    info.ustack_size, info.ustack_max, info.ustack_last);
+  putstr("\n\r");
+  return 0;
+}
@@ -26,10 +26,13 @@
 #define SYSCALL_IO_OUT_CHAR_DEBUG       0x0038
 #define SYSCALL_MEM_ALLOCATE            0x0040
 #define SYSCALL_MEM_FREE                0x0041
+#define SYSCALL_MEM_GET_INFO            0x0042
 #define SYSCALL_LMEM_ALLOCATE           0x0048
 #define SYSCALL_LMEM_FREE               0x0049
 #define SYSCALL_LMEM_GET                0x004A
 #define SYSCALL_LMEM_SET                0x004B
+#define SYSCALL_LMEM_COPY               0x004C
+#define SYSCALL_LMEM_FILL               0x004D
 #define SYSCALL_FS_GET_INFO             0x0050
 #define SYSCALL_FS_GET_ENTRY            0x0051
 #define SYSCALL_FS_READ_FILE            0x0052
@@ -40,10 +43,15 @@
 #define SYSCALL_FS_CREATE_DIRECTORY     0x0057
 #define SYSCALL_FS_LIST                 0x0058
 #define SYSCALL_FS_FORMAT               0x0059
+#define SYSCALL_FS_LIST_MANY            0x005A
+#define SYSCALL_FS_GET_FRAG_INFO        0x005B
+#define SYSCALL_FS_DEFRAG               0x005C
 #define SYSCALL_CLK_GET_TIME            0x0060
 #define SYSCALL_CLK_GET_MILISEC         0x0061
 #define SYSCALL_NET_RECV                0x0070
 #define SYSCALL_NET_SEND                0x0071
+#define SYSCALL_BATCH                   0x0080
+#define SYSCALL_SYS_GET_INFO            0x0090
 
 /*
  * Syscall param structs
@@ -88,6 +96,18 @@ struct TSYSCALL_FSLIST {
   uint               n;
 };
 
+struct TSYSCALL_FSLISTMANY {
+  lp_t               entries; /* FS_ENTRY[] */
+  lp_t               path; /* str */
+  uint               first;
+  uint               count;
+};
+
+struct TSYSCALL_FSFRAG {
+  uint               disk;
+  lp_t               info; /* FS_FRAG_INFO */
+};
+
 struct TSYSCALL_POSATTR {
   uint               x;
   uint               y;
@@ -107,10 +127,42 @@ struct TSYSCALL_LMEM {
   ul_t               n;
 };
 
+struct TSYSCALL_LMEMCOPY {
+  lp_t               dst;
+  lp_t               src;
+  ul_t               n;
+};
+
+struct TSYSCALL_LMEMFILL {
+  lp_t               dst;
+  ul_t               n;
+  uint               value;
+};
+
 struct TSYSCALL_NETOP {
   lp_t               addr; /* uint8_t[4] */
   lp_t               buff; /* byte[] */
   uint               size;
 };
 
+/*
+ * Batched system calls
+ * ops points to count TSYSCALL_BATCHOP records. Each one
+ * is a fast system call (see kernel_fastcall). They are
+ * performed in order, and result is stored in each record
+ */
+struct TSYSCALL_BATCHOP {
+  uint               service;
+  uint               a;
+  uint               b;
+  uint               c;
+  uint               d;
+  ul_t               result;
+};
+
+struct TSYSCALL_BATCH {
+  lp_t               ops; /* struct TSYSCALL_BATCHOP[] */
+  uint               count;
+};
+
 #endif   /* _SYSCALL_H */
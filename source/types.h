@@ -5,6 +5,25 @@
 #ifndef _TYPES_H
 #define _TYPES_H
 
+#ifdef HOST
+
+/* Host build (see fstools/fshost.h): keep the 8086 sizes,
+ * but long pointers must be able to hold a host pointer */
+typedef unsigned char      uchar;
+typedef unsigned short     uint;
+typedef unsigned long int  ul_t; /* ulong */
+typedef unsigned long int  lp_t; /* long pointer */
+
+typedef signed char        int8_t;
+typedef signed short       int16_t;
+typedef signed int         int32_t;
+
+typedef unsigned char      uint8_t;
+typedef unsigned short     uint16_t;
+typedef unsigned int       uint32_t;
+
+#else
+
 /* Default data types */
 typedef unsigned char      uchar;
 typedef unsigned int       uint;
@@ -20,4 +39,6 @@ typedef unsigned char      uint8_t;
 typedef unsigned int       uint16_t;
 typedef unsigned long int  uint32_t;
 
+#endif /* HOST */
+
 #endif /* _TYPES_H */
@@ -12,6 +12,22 @@
  * More detailed descriptions can be found at ulib.h
  */
 
+#ifdef KERNEL
+/*
+ * Kernel build (kulib.o): the kernel is already
+ * running, so services are called directly instead of
+ * through the system call interrupt. The most used ones
+ * call the underlying kernel routines.
+ * Calls the kernel never makes are left out
+ * (#ifndef KERNEL) to save kernel segment space
+ */
+#include "kernel.h"
+#include "hw86.h"
+
+#define syscall(service, param) kernel_service(KERN_MEMSEG, service, param)
+#define fastcall(service, a, b, c, d) kernel_fastcall(service, a, b, c, d)
+#endif
+
 /*
  * Get higher byte from uint
  */
@@ -28,6 +44,7 @@ uchar getLO(uint c)
   return (c & 0xFF);
 }
 
+#ifndef KERNEL
 /*
  * Generate "random" number
  * PRNG based on the middle-square method
@@ -37,7 +54,7 @@ uint rand()
   static ul_t seed = 0;
 
   if(seed == 0) {
-    syscall(SYSCALL_CLK_GET_MILISEC, lp(&seed));
+    seed = fastcall(SYSCALL_CLK_GET_MILISEC, 0, 0, 0, 0);
     seed += 0x11111111L;
   }
 
@@ -47,6 +64,7 @@ uint rand()
 
   return (uint)seed;
 }
+#endif
 
 /*
  * Format and output a string char by char
@@ -159,6 +177,7 @@ void formatstr(uchar* str, uint size, uchar* format, ...)
   format_str_outchar(format, &format+1, stcatchar);
 }
 
+#ifndef KERNEL
 /*
  * Get mouse state
  */
@@ -177,7 +196,7 @@ void get_mouse_state(uint mode, uint* x, uint* y, uint* b)
  */
 void sputchar(uchar c)
 {
-  syscall(SYSCALL_IO_OUT_CHAR_SERIAL, lp(&c));
+  fastcall(SYSCALL_IO_OUT_CHAR_SERIAL, c, 0, 0, 0);
 }
 
 /*
@@ -195,13 +214,20 @@ uchar sgetchar()
 {
   return (uchar)syscall(SYSCALL_IO_IN_CHAR_SERIAL, 0L);
 }
+#endif
 
 /*
  * Send a character to the debug output
  */
 void debugchar(uchar c)
 {
-  syscall(SYSCALL_IO_OUT_CHAR_DEBUG, lp(&c));
+#ifdef KERNEL
+  if(serial_debug) {
+    io_out_char_serial(c);
+  }
+#else
+  fastcall(SYSCALL_IO_OUT_CHAR_DEBUG, c, 0, 0, 0);
+#endif
 }
 
 /*
@@ -212,6 +238,7 @@ void debugstr(uchar* format, ...)
   format_str_outchar(format, &format+1, debugchar);
 }
 
+#ifndef KERNEL
 /*
  * Get video mode
  */
@@ -248,18 +275,14 @@ void clear_screen()
 {
   syscall(SYSCALL_IO_CLEAR_SCREEN, 0L);
 }
+#endif
 
 /*
  * Draw a pixel in graphics mode
  */
 void set_pixel(uint x, uint y, uint color)
 {
-  struct TSYSCALL_POSATTR ca;
-  ca.x = x;
-  ca.y = y;
-  ca.c = color;
-  ca.attr = 0;
-  syscall(SYSCALL_IO_SET_PIXEL, lp(&ca));
+  fastcall(SYSCALL_IO_SET_PIXEL, x, y, color, 0);
 }
 
 /*
@@ -267,38 +290,35 @@ void set_pixel(uint x, uint y, uint color)
  */
 void draw_char(uint x, uint y, uint c, uint color)
 {
-  struct TSYSCALL_POSATTR ca;
-  ca.x = x;
-  ca.y = y;
-  ca.c = c;
-  ca.attr = color;
-  syscall(SYSCALL_IO_DRAW_CHAR, lp(&ca));
+  fastcall(SYSCALL_IO_DRAW_CHAR, x, y, c, color);
 }
 
+#ifndef KERNEL
 /*
  * Draw a map in graphics mode
  */
 void draw_map(uint x, uint y, uchar* buff, uint width, uint height)
 {
-  struct TSYSCALL_POSATTR ca;
   uint i, j;
   for(j=0; j<height; j++) {
     for(i=0; i<width; i++) {
-      ca.x = x+i;
-      ca.y = y+j;
-      ca.c = buff[j*width + i];
-      ca.attr = 0;
-      syscall(SYSCALL_IO_SET_PIXEL, lp(&ca));
+      batch_set_pixel(x+i, y+j, buff[j*width + i]);
     }
   }
+  batch_flush();
 }
+#endif
 
 /*
  * Send a character to the screen
  */
 void putchar(uchar c)
 {
-  syscall(SYSCALL_IO_OUT_CHAR, lp(&c));
+#ifdef KERNEL
+  io_out_char(c);
+#else
+  fastcall(SYSCALL_IO_OUT_CHAR, c, 0, 0, 0);
+#endif
 }
 
 /*
@@ -309,18 +329,15 @@ void putstr(uchar* format, ...)
   format_str_outchar(format, &format+1, putchar);
 }
 
+#ifndef KERNEL
 /*
  * Send a character to the screen with attr
  */
 void putchar_attr(uint col, uint row, uchar c, uchar attr)
 {
-  struct TSYSCALL_POSATTR ca;
-  ca.x = col;
-  ca.y = row;
-  ca.c = c;
-  ca.attr = attr;
-  syscall(SYSCALL_IO_OUT_CHAR_ATTR, lp(&ca));
+  fastcall(SYSCALL_IO_OUT_CHAR_ATTR, col, row, c, attr);
 }
+#endif
 
 /*
  * Get cursor position
@@ -340,12 +357,7 @@ void get_cursor_position(uint* col, uint* row)
  */
 void set_cursor_position(uint col, uint row)
 {
-  struct TSYSCALL_POSITION ps;
-  ps.x = col;
-  ps.y = row;
-  ps.px = 0;
-  ps.py = 0;
-  syscall(SYSCALL_IO_SET_CURSOR_POS, lp(&ps));
+  fastcall(SYSCALL_IO_SET_CURSOR_POS, col, row, 0, 0);
 }
 
 /*
@@ -356,22 +368,84 @@ void set_show_cursor(uint mode)
   syscall(SYSCALL_IO_SET_SHOW_CURSOR, lp(&mode));
 }
 
+#ifndef KERNEL
+/*
+ * Batched screen output
+ * Operations are queued here until the queue is full
+ * or batch_flush is called
+ */
+#define BATCH_SIZE 32
+static struct TSYSCALL_BATCHOP batch_ops[BATCH_SIZE];
+static uint batch_count = 0;
+
+uint batch_flush()
+{
+  struct TSYSCALL_BATCH bt;
+  uint n = batch_count;
+  if(n) {
+    bt.ops = lp(batch_ops);
+    bt.count = n;
+    batch_count = 0;
+    syscall(SYSCALL_BATCH, lp(&bt));
+  }
+  return n;
+}
+
+static void batch_add(uint service, uint a, uint b, uint c, uint d)
+{
+  struct TSYSCALL_BATCHOP* op = &batch_ops[batch_count];
+  op->service = service;
+  op->a = a;
+  op->b = b;
+  op->c = c;
+  op->d = d;
+  op->result = 0;
+  if(++batch_count == BATCH_SIZE) {
+    batch_flush();
+  }
+}
+
+void batch_set_pixel(uint x, uint y, uint color)
+{
+  batch_add(SYSCALL_IO_SET_PIXEL, x, y, color, 0);
+}
+
+void batch_draw_char(uint x, uint y, uint c, uint color)
+{
+  batch_add(SYSCALL_IO_DRAW_CHAR, x, y, c, color);
+}
+
+void batch_putchar(uchar c)
+{
+  batch_add(SYSCALL_IO_OUT_CHAR, c, 0, 0, 0);
+}
+
+void batch_putchar_attr(uint col, uint row, uchar c, uchar attr)
+{
+  batch_add(SYSCALL_IO_OUT_CHAR_ATTR, col, row, c, attr);
+}
+
+void batch_set_cursor_position(uint col, uint row)
+{
+  batch_add(SYSCALL_IO_SET_CURSOR_POS, col, row, 0, 0);
+}
+
 /*
  * Get key press in a char
  */
 uchar getchar()
 {
-  uint m = KM_WAIT_KEY;
-  uint c = syscall(SYSCALL_IO_IN_KEY, lp(&m));
+  uint c = (uint)fastcall(SYSCALL_IO_IN_KEY, KM_WAIT_KEY, 0, 0, 0);
   return (uchar)(c & 0x00FF);
 }
+#endif
 
 /*
  * Get key press
  */
 uint getkey(uint mode)
 {
-  return syscall(SYSCALL_IO_IN_KEY, lp(&mode));
+  return (uint)fastcall(SYSCALL_IO_IN_KEY, mode, 0, 0, 0);
 }
 
 /*
@@ -710,27 +784,16 @@ void mfree(void* ptr)
  */
 ul_t lmemcpy(lp_t dst, lp_t src, ul_t size)
 {
-  ul_t i = 0;
-  uint rdir;
-  struct TSYSCALL_LMEM ldst;
-  struct TSYSCALL_LMEM lsrc;
-  lsrc.n = 0;
-
-  if(src > dst) {
-    rdir = 0;
-  } else {
-    rdir = 1;
-  }
-
-  for(i=0; i<size; i++) {
-    lp_t c = rdir ? size-1L-i : i;
-    lsrc.dst = src + c;
-    ldst.dst = dst + c;
-    ldst.n = syscall(SYSCALL_LMEM_GET, lp(&lsrc));
-    syscall(SYSCALL_LMEM_SET, lp(&ldst));
-  }
-
-  return i;
+#ifdef KERNEL
+  return kernel_lmemcpy(dst, src, size);
+#else
+  struct TSYSCALL_LMEMCOPY lm;
+  lm.dst = dst;
+  lm.src = src;
+  lm.n = size;
+  syscall(SYSCALL_LMEM_COPY, lp(&lm));
+  return size;
+#endif
 }
 
 /*
@@ -738,17 +801,19 @@ ul_t lmemcpy(lp_t dst, lp_t src, ul_t size)
  */
 ul_t lmemset(lp_t dest, uchar value, ul_t size)
 {
-  ul_t i = 0;
-  struct TSYSCALL_LMEM lm;
-  lm.n = value;
-
-  for(i=0; i<size; i++) {
-    lm.dst = dest + i;
-    syscall(SYSCALL_LMEM_SET, lp(&lm));
-  }
-  return i;
+#ifdef KERNEL
+  return kernel_lmemset(dest, value, size);
+#else
+  struct TSYSCALL_LMEMFILL lm;
+  lm.dst = dest;
+  lm.n = size;
+  lm.value = value;
+  syscall(SYSCALL_LMEM_FILL, lp(&lm));
+  return size;
+#endif
 }
 
+#ifndef KERNEL
 /*
  * Allocate size bytes of contiguous far memory
  */
@@ -772,6 +837,22 @@ void lmfree(lp_t ptr)
   syscall(SYSCALL_LMEM_FREE, lp(&lm));
 }
 
+/*
+ * Get memory usage info
+ */
+void get_meminfo(struct MEM_INFO* info)
+{
+  syscall(SYSCALL_MEM_GET_INFO, lp(info));
+}
+
+/*
+ * Get system info
+ */
+void get_sysinfo(struct SYS_INFO* info)
+{
+  syscall(SYSCALL_SYS_GET_INFO, lp(info));
+}
+
 /*
  * Get filesystem info
  */
@@ -874,6 +955,19 @@ uint list(struct FS_ENTRY* entry, uchar* path, uint n)
   return syscall(SYSCALL_FS_LIST, lp(&fi));
 }
 
+/*
+ * List many directory entries
+ */
+uint list_many(struct FS_ENTRY* entries, uchar* path, uint first, uint count)
+{
+  struct TSYSCALL_FSLISTMANY fi;
+  fi.entries = lp(entries);
+  fi.path = lp(path);
+  fi.first = first;
+  fi.count = count;
+  return syscall(SYSCALL_FS_LIST_MANY, lp(&fi));
+}
+
 /*
  * Create filesystem in disk
  */
@@ -882,6 +976,29 @@ uint format(uint disk)
   return syscall(SYSCALL_FS_FORMAT, lp(&disk));
 }
 
+/*
+ * Get fragmentation info of a disk
+ */
+uint get_fraginfo(uint disk, struct FS_FRAG_INFO* info)
+{
+  struct TSYSCALL_FSFRAG fi;
+  fi.disk = disk;
+  fi.info = lp(info);
+  return syscall(SYSCALL_FS_GET_FRAG_INFO, lp(&fi));
+}
+
+/*
+ * Defragment disk
+ */
+uint defrag(uint disk, struct FS_FRAG_INFO* info)
+{
+  struct TSYSCALL_FSFRAG fi;
+  fi.disk = disk;
+  fi.info = lp(info);
+  return syscall(SYSCALL_FS_DEFRAG, lp(&fi));
+}
+#endif
+
 /*
  * Get system date and time
  */
@@ -890,15 +1007,15 @@ void time(struct TIME* t)
   syscall(SYSCALL_CLK_GET_TIME, lp(t));
 }
 
+#ifndef KERNEL
 /*
  * Get system timer, miliseconds
  */
 ul_t get_timer()
 {
-  ul_t timer_ms;
-  syscall(SYSCALL_CLK_GET_MILISEC, lp(&timer_ms));
-  return timer_ms;
+  return fastcall(SYSCALL_CLK_GET_MILISEC, 0, 0, 0, 0);
 }
+#endif
 
 /*
  * Wait an amount of miliseconds
@@ -906,10 +1023,10 @@ ul_t get_timer()
 void wait(uint miliseconds)
 {
   ul_t initial_timer, timer;
-  syscall(SYSCALL_CLK_GET_MILISEC, lp(&initial_timer));
+  initial_timer = fastcall(SYSCALL_CLK_GET_MILISEC, 0, 0, 0, 0);
   timer = initial_timer;
   while(timer < initial_timer + (ul_t)miliseconds) {
-    syscall(SYSCALL_CLK_GET_MILISEC, lp(&timer));
+    timer = fastcall(SYSCALL_CLK_GET_MILISEC, 0, 0, 0, 0);
   }
 }
 
@@ -943,6 +1060,7 @@ uchar* ip_to_str(uchar* str, uint8_t* ip)
   return str;
 }
 
+#ifndef KERNEL
 /*
  * Get and remove from buffer received data.
  * src_ip and buff are filled by the function
@@ -967,3 +1085,4 @@ uint send(uint8_t* dst_ip, uchar* buff, uint len)
   no.size = len;
   return syscall(SYSCALL_NET_SEND, lp(&no));
 }
+#endif
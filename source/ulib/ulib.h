@@ -19,6 +19,13 @@
  */
 uint syscall(uint service, lp_t param);
 
+/*
+ * Fast system call
+ * Parameters are passed in registers. Only some services,
+ * with up to four uint parameters, are available this way
+ */
+ul_t fastcall(uint service, uint a, uint b, uint c, uint d);
+
 
 /*
  * Get HIGH byte
@@ -206,6 +213,28 @@ void set_cursor_position(uint col, uint row);
 #define SHOW_CURSOR 1
 void set_show_cursor(uint mode);
 
+/*
+ * Batched screen output
+ *
+ * These functions work like the ones above, but operations
+ * are queued instead of performing a system call each time.
+ * Queued operations are performed in order, with a single
+ * system call, when the queue is full or batch_flush is called.
+ * Call batch_flush before reading input or using non batched
+ * screen functions, so output appears in the right order
+ */
+void batch_set_pixel(uint x, uint y, uint color);
+void batch_draw_char(uint x, uint y, uint c, uint color);
+void batch_putchar(uchar c);
+void batch_putchar_attr(uint col, uint row, uchar c, uchar attr);
+void batch_set_cursor_position(uint col, uint row);
+
+/*
+ * Perform queued operations
+ * Returns the number of operations performed
+ */
+uint batch_flush();
+
 
 /*
  * Special key codes
@@ -456,6 +485,81 @@ lp_t lmalloc(ul_t size);
  */
 void lmfree(lp_t ptr);
 
+/*
+ * Memory usage info
+ * Sizes in bytes
+ */
+struct MEM_POOL_INFO {
+  ul_t  size;     /* Total size */
+  ul_t  used;     /* Used by allocated blocks, headers included */
+  ul_t  peak;     /* Maximum used */
+  ul_t  largest;  /* Largest block that can be allocated */
+  ul_t  allocs;   /* Number of allocations */
+  ul_t  failures; /* Number of failed allocations */
+};
+
+/* MEM_INFO.pool indices */
+#define MEM_POOL_HEAP 0 /* Kernel heap */
+#define MEM_POOL_LMEM 1 /* Far memory */
+#define MEM_POOL_HMA  2 /* High Memory Area, size 0 if not available */
+#define MEM_POOLS     3
+
+struct MEM_INFO {
+  struct MEM_POOL_INFO pool[MEM_POOLS];
+  uint  xcache_blocks;  /* Disk cache blocks in extended memory */
+  ul_t  xcache_hits;    /* Blocks read from disk cache */
+  ul_t  xcache_misses;  /* Blocks read from disk */
+  uint  bootram_blocks; /* Boot RAM disk blocks */
+  uint  bootram_used;   /* Boot RAM disk blocks in use */
+  uint  kstack_size;    /* Kernel stack size */
+  uint  kstack_max;     /* Kernel stack maximum usage */
+  uint  ustack_size;    /* User stack size checked */
+  uint  ustack_last;    /* User stack usage of last program */
+  uint  ustack_max;     /* User stack maximum usage of all programs */
+};
+
+/*
+ * Get memory usage info
+ * Output: info
+ * Stack usage is measured from stacks filled with a known
+ * value, so it's the deepest point reached since boot
+ */
+void get_meminfo(struct MEM_INFO* info);
+
+/*
+ * System related
+ */
+
+/* SYS_INFO.bootpf values */
+#define SYS_BOOTPF_NONE     0 /* No boot profile */
+#define SYS_BOOTPF_RECORDED 1 /* Boot profile recorded in this boot */
+#define SYS_BOOTPF_USED     2 /* Boot profile used in this boot */
+
+struct SYS_INFO {
+  uint  version_hi;      /* OS version */
+  uint  version_lo;
+  uint  build;
+  uint  system_disk;     /* System disk id */
+  uint  serial_status;   /* Serial port status, bit 7 set on error */
+  uint  a20_enabled;     /* A20 line enabled */
+  uint  unreal_enabled;  /* Flat memory access enabled */
+  uint  network_enabled; /* Network enabled */
+  ul_t  xmem_size;       /* Extended memory (KB) */
+  ul_t  xcache_size;     /* Disk cache in extended memory (KB) */
+  ul_t  timer_freq;      /* Timer frequency (Hz) */
+  ul_t  timer_ms;        /* System time alive (ms) */
+  ul_t  boot_ms;         /* Boot time (ms) */
+  ul_t  boot_disks_ms;   /* Part of boot time used to probe disks (ms) */
+  uint  bootpf;          /* Boot profile usage (SYS_BOOTPF_*) */
+  ul_t  bootpf_boot_ms;  /* Boot time without boot profile, 0 if unknown */
+};
+
+/*
+ * Get system info
+ * Output: info
+ */
+void get_sysinfo(struct SYS_INFO* info);
+
 
 /*
  * File system related
@@ -469,6 +573,7 @@ void lmfree(lp_t ptr);
   * fd1 - Second floppy disk
   * hd0 - First hard disk
   * hd1 - Second hard disk
+  * rd0 - RAM disk
   *
   * Path components are separated with slashes '/'
   * The root directory of a disk can be omitted or referred as "."
@@ -485,6 +590,7 @@ void lmfree(lp_t ptr);
   * fd1 : 0x01
   * hd0 : 0x80
   * hd1 : 0x81
+  * rd0 : 0xE0
   */
 
 /* Special error codes */
@@ -497,11 +603,13 @@ void lmfree(lp_t ptr);
 /* FS_ENTRY flags */
 #define FST_DIR  0x01   /* Directory */
 #define FST_FILE 0x02   /* File */
+#define FST_LZ   0x04   /* Compressed file (flag) */
 
 struct  FS_ENTRY {
   uchar name[15];
   uchar flags;
   uint  size; /* bytes for files, items for directories */
+  ul_t  time; /* last modification time (fs time format) */
 };
 
 #define MAX_PATH 72
@@ -516,6 +624,9 @@ struct FS_INFO {
   uint  fs_type;
   ul_t  fs_size;   /* MB */
   ul_t  disk_size; /* MB */
+  ul_t  fs_free;   /* Free data space (KB) */
+  ul_t  fs_largest_free; /* Largest contiguous free data space (KB) */
+  ul_t  free_entries;    /* Number of free file system entries */
 };
 
 /*
@@ -610,6 +721,18 @@ uint create_directory(uchar* path);
  */
 uint list(struct FS_ENTRY* entry, uchar* path, uint n);
 
+/*
+ * List many directory entries
+ * Output: entries
+ * Gets up to count entries of path directory, starting at index first.
+ * All of them are read in a single directory traversal, so this is
+ * much faster than calling list for each index.
+ * Returns:
+ * - ERROR_NOT_FOUND if path does not exist
+ * - number of elements in ths directory otherwise
+ */
+uint list_many(struct FS_ENTRY* entries, uchar* path, uint first, uint count);
+
 /*
  * Create filesystem in disk
  * Deletes all files, creates NSFS filesystem
@@ -618,6 +741,37 @@ uint list(struct FS_ENTRY* entry, uchar* path, uint n);
  */
 uint format(uint disk);
 
+/*
+ * Fragmentation info
+ */
+struct FS_FRAG_INFO {
+  uint  files;      /* Number of files */
+  uint  fragmented; /* Number of files not stored in a single run */
+  uint  moved;      /* Number of relocated files (defrag only) */
+  uint  skipped;    /* Fragmented files not relocated, no free run (defrag only) */
+  ul_t  blocks;     /* Number of data blocks used by files */
+  ul_t  runs;       /* Number of runs of contiguous data blocks */
+  ul_t  accesses;   /* Number of disk reads needed to read all files */
+  ul_t  before_ms;  /* Read time of relocated files before (defrag only) */
+  ul_t  after_ms;   /* Read time of relocated files after (defrag only) */
+};
+
+/*
+ * Get fragmentation info of a disk
+ * Output: info
+ * Returns 0 on success
+ */
+uint get_fraginfo(uint disk, struct FS_FRAG_INFO* info);
+
+/*
+ * Defragment disk
+ * Each fragmented file is relocated to a contiguous run of free blocks,
+ * if there is one big enough
+ * Output: info, the resulting layout and relocation results
+ * Returns number of relocated files or an error code
+ */
+uint defrag(uint disk, struct FS_FRAG_INFO* info);
+
 
 /*
  * Get current system date and time
@@ -41,6 +41,31 @@ _syscall:
   ret
 
 
+INT_CODE_FAST equ 0x81
+
+;
+; ul_t fastcall(uint s, uint a, uint b, uint c, uint d)
+; Generate OS fast call interrupt with parameters
+; in registers. Result is returned in dx:ax
+;
+global _fastcall
+_fastcall:
+  push bx
+  push si
+
+  mov  bx, sp
+  mov  ax, [bx+6]       ; Service
+  mov  cx, [bx+10]      ; Parameters
+  mov  dx, [bx+12]
+  mov  si, [bx+14]
+  mov  bx, [bx+8]
+  int  INT_CODE_FAST    ; Interrupt
+
+  pop  si
+  pop  bx
+  ret
+
+
 ;
 ; lp_t lp(void* ptr)
 ; Convert pointer to lp_t
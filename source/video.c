@@ -149,6 +149,153 @@ static void set_cursor_pixel(uint x, uint y, uint c)
   lmem_setbyte(VIDEO_MEM + bank_offset, c); /* Set */
 }
 
+/*
+ * Select the bank of a video memory offset and get its address
+ * and the number of bytes from there to the end of the bank
+ */
+static lp_t get_video_addr(ul_t addr, ul_t* bank_left)
+{
+  ul_t bank_number = addr/VESA_BANK_SIZE;
+  ul_t bank_offset = addr%VESA_BANK_SIZE;
+
+  /* This is very expensive, do only if actually needed */
+  if(bank_number != current_bank) {
+    io_set_vesa_bank(bank_number);
+    current_bank = bank_number;
+  }
+
+  *bank_left = VESA_BANK_SIZE - bank_offset;
+  return VIDEO_MEM + bank_offset;
+}
+
+/*
+ * Select the bank of a pixel and get its address and the
+ * number of bytes from there to the end of the bank
+ */
+static lp_t get_pixel_addr(uint x, uint y, ul_t* bank_left)
+{
+  return get_video_addr(
+    (ul_t)x + (ul_t)screen_width_px*(ul_t)(y+video_window_y), bank_left);
+}
+
+/*
+ * Fill n contiguous pixels of video memory, starting at x, y
+ * The bank is computed once for each part of the span
+ * inside a bank, and each part is filled at once
+ */
+static void fill_span(uint x, uint y, ul_t n, uint c)
+{
+  ul_t addr = (ul_t)x + (ul_t)screen_width_px*(ul_t)(y+video_window_y);
+  ul_t bank_left;
+  lp_t dst;
+
+  while(n) {
+    dst = get_video_addr(addr, &bank_left);
+    bank_left = min(n, bank_left);
+    lmemset(dst, (uchar)c, bank_left);
+    addr += bank_left;
+    n -= bank_left;
+  }
+}
+
+/*
+ * Fill a rectangle with a color
+ */
+void video_fill_rect(uint x, uint y, uint w, uint h, uint c)
+{
+  uint i;
+
+  /* Update cursor pixel buffer */
+  if(cursor_shown && cursor_buff_y>=y && cursor_buff_y<y+h) {
+    for(i=0; i<FNT_W-2; i++) {
+      if(cursor_buff_x+i>=x && cursor_buff_x+i<x+w) {
+        cursor_buff[i] = c;
+      }
+    }
+  }
+
+  if(x == 0 && w == screen_width_px) {
+    /* Full rows are contiguous: a single span */
+    fill_span(0, y, (ul_t)w*(ul_t)h, c);
+  } else {
+    for(i=0; i<h; i++) {
+      fill_span(x, y+i, (ul_t)w, c);
+    }
+  }
+}
+
+/*
+ * Set a row of n pixels from a buffer
+ * Pixels are written by dwords, and the row is
+ * split where it crosses a bank boundary
+ */
+static void set_pixel_row(uint x, uint y, uchar* pixels, uint n)
+{
+  ul_t bank_left;
+  lp_t addr;
+  uint i, count;
+
+  /* Update cursor pixel buffer */
+  if(cursor_shown && y==cursor_buff_y) {
+    for(i=0; i<FNT_W-2; i++) {
+      if(cursor_buff_x+i>=x && cursor_buff_x+i<x+n) {
+        cursor_buff[i] = pixels[cursor_buff_x+i-x];
+      }
+    }
+  }
+
+  while(n) {
+    addr = get_pixel_addr(x, y, &bank_left);
+    count = (uint)min((ul_t)n, bank_left);
+    for(i=0; i+4<=count; i+=4) {
+      lmem_setdword(addr + (lp_t)i, *(ul_t*)&pixels[i]);
+    }
+    for(; i<count; i++) {
+      lmem_setbyte(addr + (lp_t)i, pixels[i]);
+    }
+    x += count;
+    pixels += count;
+    n -= count;
+  }
+}
+
+/*
+ * Get a row of n pixels into a buffer
+ * Pixels behind the cursor are read from the cursor buffer
+ */
+static void get_pixel_row(uint x, uint y, uchar* pixels, uint n)
+{
+  ul_t bank_left;
+  lp_t addr;
+  uint i, count;
+  uint tx = x;
+  uchar* tpixels = pixels;
+  uint tn = n;
+
+  while(n) {
+    addr = get_pixel_addr(x, y, &bank_left);
+    count = (uint)min((ul_t)n, bank_left);
+    for(i=0; i+4<=count; i+=4) {
+      *(ul_t*)&pixels[i] = lmem_getdword(addr + (lp_t)i);
+    }
+    for(; i<count; i++) {
+      pixels[i] = lmem_getbyte(addr + (lp_t)i);
+    }
+    x += count;
+    pixels += count;
+    n -= count;
+  }
+
+  /* Read cursor pixel buffer */
+  if(cursor_shown && y==cursor_buff_y) {
+    for(i=0; i<FNT_W-2; i++) {
+      if(cursor_buff_x+i>=tx && cursor_buff_x+i<tx+tn) {
+        tpixels[cursor_buff_x+i-tx] = cursor_buff[i];
+      }
+    }
+  }
+}
+
 /*
  * Get pixels from cursor screen area
  */
@@ -189,17 +336,12 @@ static uint is_visible_char(uchar c)
  */
 void video_clear_screen()
 {
-  uint i, j;
   uint tcursor_shown = cursor_shown;
   video_hide_cursor();
   video_window_y = 0; /* Reset window */
 
   /* Repaint full screen */
-  for(j=0; j<screen_height_px; j++) {
-    for(i=0; i<screen_width_px; i++){
-      video_set_pixel(i, j, DEF_BACKGROUND);
-    }
-  }
+  video_fill_rect(0, 0, screen_width_px, screen_height_px, DEF_BACKGROUND);
 
   /* Switch to video window 0 */
   video_window_y = -video_font_h;
@@ -219,9 +361,7 @@ static void get_BIOS_glyph(uchar* buff, uint character)
 {
   uint i;
   lp_t char_addr = BIOS_font + (lp_t)BIOS_font_offset*(lp_t)character;
-  for(i=0; i<video_font_h; i++) {
-    buff[i] = lmem_getbyte(char_addr + (lp_t)i);
-  }
+  lmem_copy(lp(buff), char_addr, video_font_h);
 }
 
 /*
@@ -231,6 +371,7 @@ void video_draw_char(uint x, uint y, uint c, uint text_cl, uint back_cl)
 {
   uint i, j;
   uchar buff[16]; /* This fixed size should be enough */
+  uchar row[FNT_W];
 
   if(is_visible_char(c)) {
     /* Get font glyph */
@@ -238,23 +379,24 @@ void video_draw_char(uint x, uint y, uint c, uint text_cl, uint back_cl)
 
     /* Draw glyph */
     for(j=0; j<video_font_h; j++) {
-      for(i=0; i<FNT_W; i++) {
-        if(back_cl != NO_BACKGROUND) {
-          uchar bit_color = (buff[j] & (0x80>>i)) ? text_cl : back_cl;
-          video_set_pixel(x+i, y+j, bit_color);
-        } else if(buff[j] & (0x80>>i)) {
-          video_set_pixel(x+i, y+j, text_cl);
+      if(back_cl != NO_BACKGROUND) {
+        /* Opaque: draw whole rows */
+        for(i=0; i<FNT_W; i++) {
+          row[i] = (buff[j] & (0x80>>i)) ? text_cl : back_cl;
+        }
+        set_pixel_row(x, y+j, row, FNT_W);
+      } else {
+        for(i=0; i<FNT_W; i++) {
+          if(buff[j] & (0x80>>i)) {
+            video_set_pixel(x+i, y+j, text_cl);
+          }
         }
       }
     }
 
   } else if(back_cl != NO_BACKGROUND) {
     /* Draw a space */
-    for(j=0; j<video_font_h; j++) {
-      for(i=0; i<FNT_W; i++) {
-        video_set_pixel(x+i, y+j, back_cl);
-      }
-    }
+    video_fill_rect(x, y, FNT_W, video_font_h, back_cl);
   }
 
   return;
@@ -367,7 +509,7 @@ static void update_cursor_after_char(uchar c)
   /* If new position exceeds screen height, scroll */
   if(tc_row > screen_height_c-1) {
     uint tcursor_shown = cursor_shown;
-    uint i, j;
+    uint j;
 
     /* After two full screens, reset window */
     if(video_window_y > 2*screen_height_px) {
@@ -375,22 +517,15 @@ static void update_cursor_after_char(uchar c)
       uint v_w_y = video_window_y;
       video_window_y = 0;
       for(j=video_font_h; j<screen_height_px; j++) {
-        for(i=0; i<screen_width_px; i++){
-          scline[i] = get_pixel(i, j + v_w_y, 1);
-        }
-        for(i=0; i<screen_width_px; i++){
-          video_set_pixel(i, j, (uint)scline[i]);
-        }
+        get_pixel_row(0, j + v_w_y, scline, screen_width_px);
+        set_pixel_row(0, j, scline, screen_width_px);
       }
       mfree(scline);
     }
 
     /* Clear new lines */
-    for(i=0; i<screen_width_px; i++){
-      for(j=screen_height_px; j<screen_height_px+video_font_h; j++) {
-        video_set_pixel(i, j, DEF_BACKGROUND);
-      }
-    }
+    video_fill_rect(0, screen_height_px, screen_width_px, video_font_h,
+      DEF_BACKGROUND);
 
     /* Fast hardware scroll without moving data */
     io_scroll_screen();
@@ -27,6 +27,11 @@ void video_clear_screen();
  */
 void video_set_pixel(uint x, uint y, uint c);
 
+/*
+ * Fill a rectangle with a color
+ */
+void video_fill_rect(uint x, uint y, uint w, uint h, uint c);
+
 /*
  * Draw a character
  */